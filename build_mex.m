@@ -0,0 +1,40 @@
+function build_mex(useAvx512, censusWindow)
+%BUILD_MEX compile the C++ kernels (calc_cost_sgm, calc_pyd_cost_sgm ...) into mex files
+%   The census/SGM kernels have AVX2 (default) and AVX-512BW code paths,
+%   which are selected at compile time. build_mex(1) builds the AVX-512 variant.
+%   censusWindow selects the census window policy of census.h, e.g.
+%   build_mex(0, 'CensusSparse9x7'). Default is the dense 5x5 window.
+%   The SGM path aggregation uses std::thread, which needs C++11.
+%   No prebuilt mex files are kept in the repository, their calling syntax
+%   follows the sources, so run build_mex after every checkout.
+
+if(nargin < 1)
+    useAvx512 = 0;
+end
+if(nargin < 2)
+    censusWindow = 'CensusDense5x5';
+end
+
+if ispc
+    if(useAvx512)
+        simdFlags = 'COMPFLAGS=$COMPFLAGS /arch:AVX512';
+    else
+        simdFlags = 'COMPFLAGS=$COMPFLAGS /arch:AVX2';
+    end
+else
+    if(useAvx512)
+        simdFlags = 'CXXFLAGS=$CXXFLAGS -std=c++11 -pthread -mavx512f -mavx512bw -mpopcnt';
+    else
+        simdFlags = 'CXXFLAGS=$CXXFLAGS -std=c++11 -pthread -mavx2 -mpopcnt';
+    end
+end
+
+sharedSrc = {'common.cpp'};
+windowFlag = ['-DCENSUS_WINDOW=' censusWindow];
+
+mex('-O', simdFlags, windowFlag, 'calc_cost_sgm.cpp', sharedSrc{:});
+mex('-O', simdFlags, windowFlag, 'calc_cost_sgm_ng.cpp', sharedSrc{:});
+mex('-O', simdFlags, windowFlag, 'calc_pyd_cost_sgm.cpp', sharedSrc{:});
+mex('-O', simdFlags, windowFlag, 'calc_pyd_cost_sgm_ng.cpp', sharedSrc{:});
+
+end
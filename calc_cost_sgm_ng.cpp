@@ -1,7 +1,11 @@
 #include "mex.h"
 #include "common.h"
+#include "sgm_ng.h"
+#include "sgm_kernels.h"
 #include <nmmintrin.h>
 #include <algorithm>
+#include <cmath>
+#include <chrono>
 const int M = 1;  //random hints per 
 const int N = 2;
 const int DX = 1;
@@ -22,77 +26,68 @@ const int aggHalfWin = 2;
  *
  * The calling syntax is:
  *
- *      [C, minIdx, minC, mvSub] = calc_cost_sgm(I1, I2, preMv, halfSearchWinSize, aggSize, subPixelRefine)
+ *      [minC, flow] = calc_cost_sgm_ng(I1, I2, temporalHints, halfSearchWinSize, aggSize, subPixelRefine, P1, P2)
  *     
  * Input:
  * I1/I2 are input images
- * preMv is mv map from previous pyramidal level, must be have same or large size with I1/I2
+ * temporalHints is a motion prior (e.g. the forward warped flow of the previous frame pair), same or larger size
+ * than I1/I2. The first random hint of a pixel is its prior, the others are drawn from the search window around
+ * it instead of the whole search range. [] for no prior
  * halfSearchWinSize is the half search windows size in vertical direction. it is doubled in horizontal direction
  * aggSize is the aggregation window size. typically 5x5 is good
  * subPixelRefine: enable sub-pixel position calculation. if set mvSub contains the subpixel location of current level.  
+ * lowMemory: optional (after P1, P2), 1 keeps the cost and path cost sums of the current pixel only
  *
  * Output:
  * minC: the corresponding sum of the path cost w.r.t. mv
  * flow: flow result, stored in a [width, height, 2] matrix
 */
 
-typedef struct _costEntry
-{
-	int mvx;
-	int mvy;
-	int cost;
-} CostEntry;
-
-inline void sgm_step(CostEntry* L, //current path cost
-					 CostEntry* Lpre, //previous path cost
-					 CostEntry* C, //cost map
-					 int dMax, 
-					 int P1, int P2)
+inline void sgm_step(PathCost* L, //current path cost, followed by the top-N costs
+					 const PathCost* Lpre, //previous path cost
+					 MvType* top, //mvs of the current top-N
+					 NgCandidates C, //cost map, the mvs are those of L
+					 const MvType* mvxPre, const MvType* mvyPre, //mvs of Lpre
+					 int dMax, //stride of the path cost entries
+					 int num, int numPre, //candidates of the current/previous pixel
+					 int P1, int P2,
+					 NgCandidateIndex& index) //workspace of the candidate matching
 {
+	ng_candidate_index_build(index, mvxPre, mvyPre, Lpre, numPre, P1);
 
-	PathCost LpreMin = Lpre[dMax].cost; //get minimum value of pre path cost
+	PathCost LpreMin = Lpre[dMax]; //get minimum value of pre path cost
 	for (int i = 0; i < N; i++)
-		L[dMax + i].cost = MAX_PATH_COST;
-
-	for (int d = 0; d< dMax; d++) {
-		int mvx = C[d].mvx;
-		int mvy = C[d].mvy;
+		L[dMax + i] = MAX_PATH_COST;
 
+	for (int d = 0; d< num; d++) {
 		PathCost min1 = LpreMin + P2;
 		PathCost min2 = LpreMin + P2;
-		PathCost min3 = LpreMin + P2;
-		PathCost bestCost = min3;
-
-		for (int d2 = 0; d2 < dMax; d2++) {
-
-			int mvxPre = Lpre[d2].mvx;
-			int mvyPre = Lpre[d2].mvy;
 
-			if(mvx == mvxPre && mvy == mvyPre) // ||d-d'|| = 0
-				min1 = Lpre[d2].cost;
-			else if(abs(mvx - mvxPre) <= 2 && abs(mvy - mvyPre) <= 2) {// ||d-d'|| < r
-				min2 = std::min<PathCost>(min2, Lpre[d2].cost + P1);
-			} 
-		}
+		ng_candidate_index_lookup(index, C.mvx[d], C.mvy[d], min1, min2); //||d-d'|| = 0, ||d-d'|| < r
+		L[d] = std::min<PathCost>(min1, min2);
+	}
 
-		bestCost = std::min<PathCost>(bestCost, min1);
-		bestCost = std::min<PathCost>(bestCost, min2);
-		L[d].cost = (C[d].cost + bestCost) - LpreMin;
-		L[d].mvx = mvx;
-		L[d].mvy = mvy;
+	//the best previous costs are at least LpreMin, and C + P2 fits in PathCost
+	for (int d = 0; d < num; d++)
+		L[d] = (PathCost)(C.cost[d] + L[d] - LpreMin);
 
-		//update top-N;
+	//update top-N;
+	for (int d = 0; d < num; d++) {
 		int j;
 		for (j = 0; j < N; j++) {
-			if (L[d].cost < L[dMax + j].cost)
+			if (L[d] < L[dMax + j])
 				break;
 		}
 
 		if (j < N) {
 			for (int i = N - 1; i > j; i--) {
 				L[dMax + i] = L[dMax + i - 1];
+				top[2 * i] = top[2 * (i - 1)];
+				top[2 * i + 1] = top[2 * (i - 1) + 1];
 			}
 			L[dMax + j] = L[d];
+			top[2 * j] = C.mvx[d];
+			top[2 * j + 1] = C.mvy[d];
 		}
 	}
 }
@@ -119,19 +114,29 @@ inline int adaptive_P2(int P2, int pixCur, int pixPre) {
  */
 
 
-void calc_cost_based_on_hint(CostEntry* ptrCCur, int x, int y, 
+/* costs of the candidates of pixel (x, y) into C: the MV_PER_HINT neighbours of the top-N mvs of each path direction
+ * and of M random hints per direction. Returns the number of candidates, the mvs are distinct: a repeated mv
+ * is skipped before its cost is evaluated (mvSet), the first occurrence keeps its position. The pixels of a row
+ * are visited in increasing x so that costCache can reuse the window columns of the previous pixels.
+ * top1..top4: top-N mvs of the path directions, (mvx, mvy) pairs
+ * temporalHint: rounded motion prior of the pixel or NULL. With a prior, the first random hint is the prior and
+ * the others are drawn from [-rangeX, rangeX] x [-rangeY, rangeY] around it
+ */
+int calc_cost_based_on_hint(NgCandidates C, int x, int y, 
     unsigned* cen1, unsigned* cen2, int width, int height, 
-    CostEntry* ptrL1Hint, CostEntry* ptrL2Hint, CostEntry* ptrL3Hint, CostEntry* ptrL4Hint)
+    const MvType* top1, const MvType* top2, const MvType* top3, const MvType* top4,
+    NgMvSet& mvSet, NgCostCache& costCache, const int* temporalHint = NULL, int rangeX = 0, int rangeY = 0)
 {
 
 
-    CostEntry* ptrL[DIRECTION_NUM];
-    ptrL[0] = ptrL1Hint;
-    ptrL[1] = ptrL2Hint;
-    ptrL[2] = ptrL3Hint;
-    ptrL[3] = ptrL4Hint;
+    const MvType* top[DIRECTION_NUM];
+    top[0] = top1;
+    top[1] = top2;
+    top[2] = top3;
+    top[3] = top4;
 
     int cand = 0;
+	ng_mv_set_clear(mvSet);
 	const int aggPixels = (2 * aggHalfWin + 1)*(2 * aggHalfWin + 1);
     for (int l = 0; l < DIRECTION_NUM; l++) {
         for (int i = 0; i < N + M; i++) {
@@ -140,83 +145,136 @@ void calc_cost_based_on_hint(CostEntry* ptrCCur, int x, int y,
 			int mvy; 
 
 			if (i < N) {
-				mvx = ptrL[l][i].mvx;
-				mvy = ptrL[l][i].mvy;
+				mvx = top[l][2 * i];
+				mvy = top[l][2 * i + 1];
 			}
-			else
+			else if (temporalHint == NULL)
 			{
 				mvx = rand() % 256 - 128;
 				mvy = rand() % 128 - 64;
 				//mexPrintf("mvx %d, mvy %d\n", mvx, mvy);
 			}
+			else if (l == 0 && i == N) {
+				mvx = temporalHint[0];
+				mvy = temporalHint[1];
+			}
+			else {
+				mvx = temporalHint[0] + rand() % (2 * rangeX + 1) - rangeX;
+				mvy = temporalHint[1] + rand() % (2 * rangeY + 1) - rangeY;
+			}
 
             for (int offy = -DY; offy <= DY; offy++) {
                 for (int offx = -DX; offx <= DX; offx++) {
 
-                    unsigned costSum = 0;
+                    if (!ng_mv_set_insert(mvSet, mvx + offx, mvy + offy))
+                        continue;
 
-					
-                    for (int aggy = -aggHalfWin; aggy <= aggHalfWin; aggy++) {
-                        for (int aggx = -aggHalfWin; aggx <= aggHalfWin; aggx++) {
+                    const int candMvx = mvx + offx;
+                    const int candMvy = mvy + offy;
 
+                    //census cost of column xa of the aggregation window, the window sum goes through the cache
+                    auto column = [&](int xa) {
+                        const int x1 = clamp(xa, 0, width - 1);
+                        const int x2 = clamp(x1 + candMvx, 0, width - 1);
+                        unsigned sum = 0;
+                        for (int aggy = -aggHalfWin; aggy <= aggHalfWin; aggy++) {
                             int y1 = clamp(y + aggy, 0, height - 1);
-                            int x1 = clamp(x + aggx, 0, width - 1);
-
-                            unsigned cenCode1 = cen1[width*y1 + x1];
+                            int y2 = clamp(y1 + candMvy, 0, height - 1);
 
-                            int y2 = clamp((offy + y1) + mvy, 0, height - 1);
-                            int x2 = clamp((offx + x1) + mvx, 0, width - 1);
-
-                            unsigned cenCode2 = cen2[width*y2 + x2];
-
-                            int censusCost = _mm_popcnt_u32((cenCode1^cenCode2));
-                            costSum += censusCost;
+                            sum += _mm_popcnt_u32(cen1[width*y1 + x1] ^ cen2[width*y2 + x2]);
                         }
-                    }
+                        return sum;
+                    };
+                    unsigned costSum = ng_cost_cache_sum(costCache, x, y, candMvx, candMvy, column);
 
-                    ptrCCur[cand].cost = 1.0* costSum / aggPixels + 0.5;
-                    ptrCCur[cand].mvx = mvx + offx;
-                    ptrCCur[cand].mvy = mvy + offy;
+                    C.cost[cand] = (CostType)(1.0* costSum / aggPixels + 0.5);
+                    C.mvx[cand] = (MvType)candMvx;
+                    C.mvy[cand] = (MvType)candMvy;
 
                     cand++;
                 }
             }
         }
     }
+    return cand;
 }
 
+//first candidate of pixel (x, y): CSR offset, in low memory mode (offsets NULL) a ring of the current and the
+//previous row, which holds the mvs of Lpre
+inline size_t candidate_offset(const size_t* offsets, int x, int y, int width, int dMax)
+{
+    return offsets != NULL ? offsets[(size_t)y*width + x] : ((size_t)(y & 1)*width + x)*dMax;
+}
+
+/* temporalHints: motion prior map of mvWidth x mvHeight (x plane, then y plane) or NULL,
+ * halfSearchWinX/Y: search window around the prior
+ */
 void sgm2d(unsigned* minC, double* mvSub, 
         PixelType* I1, PixelType* I2, int width, int height, 
-        int P1, int P2 )
+        int P1, int P2, bool lowMemory = false,
+        const double* temporalHints = NULL, int mvWidth = 0, int mvHeight = 0, int halfSearchWinX = 0, int halfSearchWinY = 0)
 {
-    //allocate path cost buffers. dMax cost entries + 1 minimun cost entry
+    //allocate path cost buffers. dMax path costs + N best costs per pixel, the top-N mvs in T1..T4
 
     int dMax = DIRECTION_NUM * (N + M) * MV_PER_HINT;
 	mexPrintf("dMax : %d\n", dMax);
-	int entriesPerPixel = dMax + N; //+N for storing the best N cadidates (cost + mv)
-    CostEntry* L1 = (CostEntry*) mxMalloc (sizeof(CostEntry) * 2 * entriesPerPixel);				//Left -> Right direction
-    CostEntry* L2 = (CostEntry*) mxMalloc (sizeof(CostEntry) * 2 * width * entriesPerPixel);		//top-left -> bottom right direction
-    CostEntry* L3 = (CostEntry*) mxMalloc (sizeof(CostEntry) * 2 * width * entriesPerPixel);		//up -> bottom direction
-    CostEntry* L4 = (CostEntry*) mxMalloc (sizeof(CostEntry) * 2 * width * entriesPerPixel);		//top-right->bottom left direction
-    CostEntry* C = (CostEntry*)mxMalloc(width * height * sizeof(CostEntry) * dMax);
-	unsigned * Sp = (unsigned *)mxMalloc(sizeof(unsigned) * width * height * dMax); //sum of path cost from all DIRECTION_NUM
-
-    memset(L1, 0, sizeof(CostEntry) * 2 * entriesPerPixel);
-    memset(L2, 0, sizeof(CostEntry) * 2 * width * entriesPerPixel);
-    memset(L3, 0, sizeof(CostEntry) * 2 * width * entriesPerPixel);
-    memset(L4, 0, sizeof(CostEntry) * 2 * width * entriesPerPixel);
-	memset(Sp, 0, sizeof(unsigned)*width*height*dMax);
+    mxAssert(NG_MAX_COST + 2 * P2 <= MAX_PATH_COST, "path costs overflow PathCost");
+	int entriesPerPixel = dMax + N; //+N for storing the best N cadidates (cost, mv in T)
+    PathCost* L1 = (PathCost*) mxMalloc (sizeof(PathCost) * 2 * entriesPerPixel);				//Left -> Right direction
+    PathCost* L2 = (PathCost*) mxMalloc (sizeof(PathCost) * 2 * width * entriesPerPixel);		//top-left -> bottom right direction
+    PathCost* L3 = (PathCost*) mxMalloc (sizeof(PathCost) * 2 * width * entriesPerPixel);		//up -> bottom direction
+    PathCost* L4 = (PathCost*) mxMalloc (sizeof(PathCost) * 2 * width * entriesPerPixel);		//top-right->bottom left direction
+    MvType* T1 = (MvType*) mxMalloc (sizeof(MvType) * 2 * 2 * N);
+    MvType* T2 = (MvType*) mxMalloc (sizeof(MvType) * 2 * width * 2 * N);
+    MvType* T3 = (MvType*) mxMalloc (sizeof(MvType) * 2 * width * 2 * N);
+    MvType* T4 = (MvType*) mxMalloc (sizeof(MvType) * 2 * width * 2 * N);
+    //the path costs of all directions of a pixel are complete when the single pass visits it. in low memory mode the
+    //best candidate is taken right there, the candidates of the current and the previous row (the mvs of Lpre) and the
+    //sum of path cost of only the current pixel are kept.
+    //otherwise C/Sp are the deduplicated candidate lists of all pixels, CSR style: pixel i owns [offsets[i], offsets[i + 1]).
+    //they are allocated for dMax candidates per pixel, only the pages of the packed lists are touched
+    const size_t volumeEntries = lowMemory ? 2 * (size_t)width * dMax : (size_t)width * height * dMax;
+    NgCandidates C;
+    C.cost = (CostType*)mxMalloc(volumeEntries * sizeof(CostType));
+    C.mvx = (MvType*)mxMalloc(volumeEntries * sizeof(MvType));
+    C.mvy = (MvType*)mxMalloc(volumeEntries * sizeof(MvType));
+	PathSum* Sp = (PathSum*) mxMalloc (sizeof(PathSum) * (lowMemory ? dMax : volumeEntries)); //sum of path cost from all DIRECTION_NUM
+    size_t* offsets = lowMemory ? NULL : (size_t*)mxMalloc(sizeof(size_t) * ((size_t)width * height + 1));
+    int* candNum = (int*)mxMalloc(sizeof(int) * width * height); //candidates per pixel
+    void* mvSetBuffer = mxMalloc(ng_mv_set_size(dMax));
+    NgMvSet mvSet;
+    ng_mv_set_init(mvSet, mvSetBuffer, dMax);
+    void* costCacheBuffer = mxMalloc(ng_cost_cache_size());
+    NgCostCache costCache;
+    ng_cost_cache_init(costCache, costCacheBuffer, aggHalfWin);
+    double costTime = 0;    //NG_VERBOSE: every NG_CACHE_TIMING_PERIOD-th cost construction is timed
+    size_t costCalls = 0;
+
+    memset(L1, 0, sizeof(PathCost) * 2 * entriesPerPixel);
+    memset(L2, 0, sizeof(PathCost) * 2 * width * entriesPerPixel);
+    memset(L3, 0, sizeof(PathCost) * 2 * width * entriesPerPixel);
+    memset(L4, 0, sizeof(PathCost) * 2 * width * entriesPerPixel);
+    memset(T1, 0, sizeof(MvType) * 2 * 2 * N);
+    memset(T2, 0, sizeof(MvType) * 2 * width * 2 * N);
+    memset(T3, 0, sizeof(MvType) * 2 * width * 2 * N);
+    memset(T4, 0, sizeof(MvType) * 2 * width * 2 * N);
+    if (!lowMemory)
+        offsets[0] = 0;
+    void* indexBuffer = mxMalloc(ng_candidate_index_size(dMax));
+    NgCandidateIndex index;
+    ng_candidate_index_init(index, indexBuffer, dMax);
 
 	double* flowX = mvSub;
 	double* flowY = mvSub + width*height;
 
     const int pathCostEntryPerPixel = entriesPerPixel; 
     const int pathCostEntryPerRow = width * pathCostEntryPerPixel;
-    const int costPerRowEntry = width*dMax;
+    const int topPerRow = width * 2 * N;
     
     const bool adpativeP2 = true;
     const int totalPass = 1;
     const bool enableDiagnalPath = true;
+    mxAssert(totalPass == 1, "the candidate lists are built and the best candidate is taken in the single pass");
     
 
     int ystart = 0;
@@ -244,65 +302,92 @@ void sgm2d(unsigned* minC, double* mvSub,
             xstep = -1;
         }
 
-        CostEntry* ptrL1Pre = L1;
-        CostEntry* ptrL1Cur = L1 + entriesPerPixel;
-        CostEntry* ptrL3PreRow = L3;
-        CostEntry* ptrL3CurRow = L3 + pathCostEntryPerRow;
-        CostEntry* ptrL2PreRow = L2;
-        CostEntry* ptrL2CurRow = L2 + pathCostEntryPerRow;
-        CostEntry* ptrL4PreRow = L4;
-        CostEntry* ptrL4CurRow = L4 + pathCostEntryPerRow;
+        PathCost* ptrL1Pre = L1;
+        PathCost* ptrL1Cur = L1 + entriesPerPixel;
+        PathCost* ptrL3PreRow = L3;
+        PathCost* ptrL3CurRow = L3 + pathCostEntryPerRow;
+        PathCost* ptrL2PreRow = L2;
+        PathCost* ptrL2CurRow = L2 + pathCostEntryPerRow;
+        PathCost* ptrL4PreRow = L4;
+        PathCost* ptrL4CurRow = L4 + pathCostEntryPerRow;
+        MvType* ptrT1Pre = T1;
+        MvType* ptrT1Cur = T1 + 2 * N;
+        MvType* ptrT3PreRow = T3;
+        MvType* ptrT3CurRow = T3 + topPerRow;
+        MvType* ptrT2PreRow = T2;
+        MvType* ptrT2CurRow = T2 + topPerRow;
+        MvType* ptrT4PreRow = T4;
+        MvType* ptrT4CurRow = T4 + topPerRow;
         
         for (int y = ystart; y != yend; y += ystep) {
 
-            unsigned* ptrSp = Sp + y*costPerRowEntry;
-            CostEntry* ptrC = C + y*costPerRowEntry;
-
             for (int x = xstart; x != xend; x += xstep) {
 
-                CostEntry* ptrL3Cur = ptrL3CurRow + x*entriesPerPixel;
-                CostEntry* ptrL3Pre = ptrL3PreRow + x*entriesPerPixel;
+                PathCost* ptrL3Cur = ptrL3CurRow + x*entriesPerPixel;
+                PathCost* ptrL3Pre = ptrL3PreRow + x*entriesPerPixel;
+
+                PathCost* ptrL2Cur = ptrL2CurRow + x*entriesPerPixel;
+                PathCost* ptrL2Pre = ptrL2PreRow + (x - xstep)*entriesPerPixel;
 
-                CostEntry* ptrL2Cur = ptrL2CurRow + x*entriesPerPixel;
-                CostEntry* ptrL2Pre = ptrL2PreRow + (x - xstep)*entriesPerPixel;
+                PathCost* ptrL4Cur = ptrL4CurRow + x*entriesPerPixel;
+                PathCost* ptrL4Pre = ptrL4PreRow + (x + xstep)*entriesPerPixel;
 
-                CostEntry* ptrL4Cur = ptrL4CurRow + x*entriesPerPixel;
-                CostEntry* ptrL4Pre = ptrL4PreRow + (x + xstep)*entriesPerPixel;
+                MvType* ptrT3Cur = ptrT3CurRow + x * 2 * N;
+                MvType* ptrT2Cur = ptrT2CurRow + x * 2 * N;
+                MvType* ptrT4Cur = ptrT4CurRow + x * 2 * N;
 
-                CostEntry* ptrCCur = ptrC + x*dMax;
+                //single forward pass, the lists are appended in pixel order
+                const size_t pixel = (size_t)y*width + x;
+                NgCandidates ptrCCur = ng_candidates_at(C, candidate_offset(offsets, x, y, width, dMax));
 
 
                 //do searching here 
-				calc_cost_based_on_hint(ptrCCur, x, y,
-					cen1, cen2, width, height, ptrL1Cur + dMax, ptrL2Cur + dMax, ptrL3Cur + dMax, ptrL4Cur + dMax);
+				int temporalHint[2];
+				if (temporalHints != NULL) {
+					const size_t mvIdx = (size_t)std::min(y, mvHeight - 1)*mvWidth + std::min(x, mvWidth - 1);
+					temporalHint[0] = (int)floor(temporalHints[mvIdx] + 0.5);
+					temporalHint[1] = (int)floor(temporalHints[(size_t)mvWidth*mvHeight + mvIdx] + 0.5);
+				}
+				const bool timed = NG_VERBOSE && costCalls++ % NG_CACHE_TIMING_PERIOD == 0;
+				std::chrono::steady_clock::time_point costStart;
+				if (timed)
+					costStart = std::chrono::steady_clock::now();
+				const int num = calc_cost_based_on_hint(ptrCCur, x, y,
+					cen1, cen2, width, height, ptrT1Cur, ptrT2Cur, ptrT3Cur, ptrT4Cur,
+					mvSet, costCache, temporalHints != NULL ? temporalHint : NULL, halfSearchWinX, halfSearchWinY);
+				if (timed)
+					costTime += NG_CACHE_TIMING_PERIOD * std::max(std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - costStart).count() - costCache.clockOverhead, 0.0);
+				candNum[pixel] = num;
+				if (!lowMemory)
+					offsets[pixel + 1] = offsets[pixel] + num;
 
                 if (x == xstart) {
-                    memcpy(ptrL1Cur, ptrCCur, sizeof(CostEntry)*dMax);
-                    ptrL1Cur[dMax].cost = 0;
+                    memcpy(ptrL1Cur, ptrCCur.cost, sizeof(PathCost)*num);
+                    ptrL1Cur[dMax] = 0;
 
                     if (enableDiagnalPath) {
-                        memcpy(ptrL2Cur, ptrCCur, sizeof(CostEntry)*dMax);
-                        ptrL2Cur[dMax].cost = 0;
+                        memcpy(ptrL2Cur, ptrCCur.cost, sizeof(PathCost)*num);
+                        ptrL2Cur[dMax] = 0;
                     }
                 }
 
                 if (y == ystart) {
-                    memcpy(ptrL3Cur, ptrCCur, sizeof(CostEntry)*dMax);
-                    ptrL3Cur[dMax].cost = 0;
+                    memcpy(ptrL3Cur, ptrCCur.cost, sizeof(PathCost)*num);
+                    ptrL3Cur[dMax] = 0;
 
                     if (enableDiagnalPath) {
-                        memcpy(ptrL2Cur, ptrCCur, sizeof(CostEntry)*dMax);
-                        ptrL2Cur[dMax].cost = 0;
+                        memcpy(ptrL2Cur, ptrCCur.cost, sizeof(PathCost)*num);
+                        ptrL2Cur[dMax] = 0;
 
-                        memcpy(ptrL4Cur, ptrCCur, sizeof(CostEntry)*dMax);
-                        ptrL4Cur[dMax].cost = 0;
+                        memcpy(ptrL4Cur, ptrCCur.cost, sizeof(PathCost)*num);
+                        ptrL4Cur[dMax] = 0;
                     }
                 }
 
                 if (x == xend - xstep) {
                     if (enableDiagnalPath) {
-                        memcpy(ptrL4Cur, ptrCCur, sizeof(CostEntry)*dMax);
-                        ptrL4Cur[dMax].cost = 0;
+                        memcpy(ptrL4Cur, ptrCCur.cost, sizeof(PathCost)*num);
+                        ptrL4Cur[dMax] = 0;
                     }
                 }
 
@@ -311,22 +396,26 @@ void sgm2d(unsigned* minC, double* mvSub,
                     //when 2nd pyd processing
                     PixelType pixCur = I1[width*y + x];
                     PixelType pixPre = I1[width*y + x - xstep];
-                    
+                    const NgCandidates CPre = ng_candidates_at(C, candidate_offset(offsets, x - xstep, y, width, dMax));
+
                     sgm_step(ptrL1Cur,              //current path cost
                         ptrL1Pre,                   //previous path cost
-                        ptrCCur,                    //cost map
-                        dMax, P1, adpativeP2 ? adaptive_P2(P2, pixCur, pixPre) : P2);
+                        ptrT1Cur, ptrCCur,          //top-N mvs, cost map
+                        CPre.mvx, CPre.mvy,         //previous mvs
+                        dMax, num, candNum[pixel - xstep], P1, adpativeP2 ? adaptive_P2(P2, pixCur, pixPre) : P2, index);
                 }
 
 
                 if (y != ystart) {
                     PixelType pixCur = I1[width*y + x];
                     PixelType pixPre = I1[width*(y-ystep) + x];
+                    const NgCandidates CPre = ng_candidates_at(C, candidate_offset(offsets, x, y - ystep, width, dMax));
 
                     sgm_step(ptrL3Cur,              //current path cost
                         ptrL3Pre,                   //previous path cost
-                        ptrCCur,                    //cost map
-                        dMax, P1, adpativeP2 ? adaptive_P2(P2, pixCur, pixPre) : P2);
+                        ptrT3Cur, ptrCCur,          //top-N mvs, cost map
+                        CPre.mvx, CPre.mvy,         //previous mvs
+                        dMax, num, candNum[pixel - (size_t)ystep*width], P1, adpativeP2 ? adaptive_P2(P2, pixCur, pixPre) : P2, index);
                 }
 
                 if (enableDiagnalPath) {
@@ -334,75 +423,102 @@ void sgm2d(unsigned* minC, double* mvSub,
 
                         PixelType pixCur = I1[width*y + x];
                         PixelType pixPre = I1[width*(y - ystep) + x - xstep];
+                        const NgCandidates CPre = ng_candidates_at(C, candidate_offset(offsets, x - xstep, y - ystep, width, dMax));
 
                         sgm_step(ptrL2Cur,          //current path cost
                             ptrL2Pre,               //previous path cost
-                            ptrCCur,                //cost map
-                            dMax, P1, adpativeP2 ? adaptive_P2(P2, pixCur, pixPre) : P2);
+                            ptrT2Cur, ptrCCur,      //top-N mvs, cost map
+                            CPre.mvx, CPre.mvy,     //previous mvs
+                            dMax, num, candNum[pixel - (size_t)ystep*width - xstep], P1, adpativeP2 ? adaptive_P2(P2, pixCur, pixPre) : P2, index);
                     }
 
                     if (x != xend - xstep && y != ystart) {
 
                         PixelType pixCur = I1[width*y + x];
                         PixelType pixPre = I1[width*(y - ystep) + x + xstep];
+                        const NgCandidates CPre = ng_candidates_at(C, candidate_offset(offsets, x + xstep, y - ystep, width, dMax));
 
                         sgm_step(ptrL4Cur,          //current path cost
                             ptrL4Pre,               //previous path cost
-                            ptrCCur,                //cost map
-                            dMax, P1, adpativeP2 ? adaptive_P2(P2, pixCur, pixPre) : P2);
+                            ptrT4Cur, ptrCCur,      //top-N mvs, cost map
+                            CPre.mvx, CPre.mvy,     //previous mvs
+                            dMax, num, candNum[pixel - (size_t)ystep*width + xstep], P1, adpativeP2 ? adaptive_P2(P2, pixCur, pixPre) : P2, index);
 
                     }
                 }
 
-                for (int d = 0; d < dMax; d++) {
-                    ptrSp[x*dMax + d] += ptrL1Cur[d].cost + ptrL3Cur[d].cost;
+                //a single pass visits every pixel once, the sums need no clearing
+                PathSum* ptrSpCur = lowMemory ? Sp : Sp + offsets[pixel];
+                for (int d = 0; d < num; d++) {
+                    ptrSpCur[d] = ptrL1Cur[d] + ptrL3Cur[d];
                     if (enableDiagnalPath) {
-                        ptrSp[x*dMax + d] += ptrL2Cur[d].cost + ptrL4Cur[d].cost;
+                        ptrSpCur[d] += ptrL2Cur[d] + ptrL4Cur[d];
                     }
                 }
 
+                if (lowMemory) {
+                    PathSum minCost;
+                    const int minIdx = sgm_argmin(ptrSpCur, num, minCost);
+                    minC[y*width + x] = minCost;
+                    flowX[y*width + x] = ptrCCur.mvx[minIdx];
+                    flowY[y*width + x] = ptrCCur.mvy[minIdx];
+                }
+
                 //swap buffer pointer for left->right direction
-                CostEntry* tmp = ptrL1Pre;
+                PathCost* tmp = ptrL1Pre;
                 ptrL1Pre = ptrL1Cur;
                 ptrL1Cur = tmp;
+                MvType* tmpTop = ptrT1Pre;
+                ptrT1Pre = ptrT1Cur;
+                ptrT1Cur = tmpTop;
             }
 
             //swap buffer pointer for top->bottom direction
-            CostEntry* tmp = ptrL3PreRow;
+            PathCost* tmp = ptrL3PreRow;
             ptrL3PreRow = ptrL3CurRow;
             ptrL3CurRow = tmp;
+            MvType* tmpTop = ptrT3PreRow;
+            ptrT3PreRow = ptrT3CurRow;
+            ptrT3CurRow = tmpTop;
 
             if (enableDiagnalPath) {
                 //swap buffer pointer for top left->bottom rightdirection
                 tmp = ptrL2PreRow;
                 ptrL2PreRow = ptrL2CurRow;
                 ptrL2CurRow = tmp;
+                tmpTop = ptrT2PreRow;
+                ptrT2PreRow = ptrT2CurRow;
+                ptrT2CurRow = tmpTop;
 
                 //swap buffer pointer for top right->bottom leftdirection
                 tmp = ptrL4PreRow;
                 ptrL4PreRow = ptrL4CurRow;
                 ptrL4CurRow = tmp;
+                tmpTop = ptrT4PreRow;
+                ptrT4PreRow = ptrT4CurRow;
+                ptrT4CurRow = tmpTop;
             }
         }
     }
     
-    for(int y = 0; y< height; y++) {
-        unsigned* SpPtr = Sp + y*costPerRowEntry;
-		
-        for (int x = 0; x <width; x++) {
-            CostEntry* ptrC = C + width* dMax*y + dMax*x;
-            unsigned minCost = SpPtr[x*dMax];
-            unsigned minIdx = 0;
-
-            for (int d = 1; d<dMax; d++) {
-                if(SpPtr[x*dMax + d] < minCost) {
-                    minCost = SpPtr[x*dMax + d] ;
-                    minIdx = d;
-                }
+    if (NG_VERBOSE)
+        ng_cost_cache_report(costCache, costTime);
+
+    //low memory mode is done in the pass
+    if (!lowMemory) {
+        const size_t entries = offsets[(size_t)width*height];
+        if (NG_VERBOSE)
+            mexPrintf("candidates per pixel: %.1f of %d\n", (double)entries / ((size_t)width*height), dMax);
+
+        for(int y = 0; y< height; y++) {
+            for (int x = 0; x <width; x++) {
+                const size_t pixel = (size_t)y*width + x;
+                PathSum minCost;
+                const int minIdx = sgm_argmin(Sp + offsets[pixel], candNum[pixel], minCost);
+                minC[y*width +x] = minCost;
+                flowX[y*width + x] = C.mvx[offsets[pixel] + minIdx];
+                flowY[y*width + x] = C.mvy[offsets[pixel] + minIdx];
             }
-            minC[y*width +x] = minCost;
-            flowX[y*width + x] = ptrC[minIdx].mvx;
-			flowY[y*width + x] = ptrC[minIdx].mvy;
         }
     }
 		
@@ -410,12 +526,24 @@ void sgm2d(unsigned* minC, double* mvSub,
     mxFree(L2);
     mxFree(L3);
     mxFree(L4);
+    mxFree(T1);
+    mxFree(T2);
+    mxFree(T3);
+    mxFree(T4);
     mxFree(Sp);
+    mxFree(indexBuffer);
+    mxFree(mvSetBuffer);
+    mxFree(costCacheBuffer);
+    mxFree(candNum);
+    if (offsets)
+        mxFree(offsets);
 
     mxFree(cen1);
     mxFree(cen2);
 
-    mxFree(C);
+    mxFree(C.cost);
+    mxFree(C.mvx);
+    mxFree(C.mvy);
 }
 
 void subpixel_refine(double* flow, unsigned* cen1, unsigned* cen2, int width, int height) 
@@ -481,7 +609,7 @@ void subpixel_refine(double* flow, unsigned* cen1, unsigned* cen2, int width, in
 }
         
 /* The gateway function */
-void mexFunction(int nlhs, mxArray *plhs[],
+void mexFunction(int /*nlhs*/, mxArray *plhs[],
                  int nrhs, const mxArray *prhs[])
 {
     PixelType *I1;					/* pointer to Input image I1 */
@@ -494,16 +622,16 @@ void mexFunction(int nlhs, mxArray *plhs[],
     I1 = (PixelType*)mxGetData(prhs[0]);
     I2 = (PixelType*)mxGetData(prhs[1]); 
     
-    preMv = mxGetPr(prhs[2]);
+    preMv = mxIsEmpty(prhs[2]) ? NULL : mxGetPr(prhs[2]);
     width = mxGetM(prhs[0]);
     height = mxGetN(prhs[0]);
     
     double halfSearchWinSize = mxGetScalar(prhs[3]);
-    double aggSize= mxGetScalar(prhs[4]);
-    int subPixelRefine = mxGetScalar(prhs[5]);
+    //prhs[4] (aggSize) and prhs[5] (subPixelRefine) are not used by this kernel
 
     int P1 = mxGetScalar(prhs[6]);
     int P2 = mxGetScalar(prhs[7]);
+    bool lowMemory = nrhs > 8 ? mxGetScalar(prhs[8]) != 0 : false;
     
     /* create the output matrix */
 
@@ -519,9 +647,12 @@ void mexFunction(int nlhs, mxArray *plhs[],
     int mvHeight = mxGetN(prhs[2])/2;
     
 	
-	//perform sgm
+	//perform sgm, the search window is doubled in horizontal direction
+	const int winRadiusY = (int)halfSearchWinSize;
+	const int winRadiusX = 2 * winRadiusY;
 	sgm2d(minC, flowResult, 
 		I1, I2, width, height,
-		P1, P2);
+		P1, P2, lowMemory,
+		preMv, mvWidth, mvHeight, winRadiusX, winRadiusY);
     
 }
\ No newline at end of file
@@ -1,7 +1,11 @@
 #include "mex.h"
 #include "common.h"
+#include "sgm_ng.h"
+#include "sgm_aggregate.h"
 #include <nmmintrin.h>
 #include <algorithm>
+#include <cmath>
+#include <chrono>
 
 /*
  * calc_cost_pyd_sgm_ng.cpp 
@@ -23,58 +27,41 @@
  * halfSearchWinSize is the half search windows size in vertical direction. it is doubled in horizontal direction
  * aggSize is the aggregation window size. typically 5x5 is good
  * subPixelRefine: enable sub-pixel position calculation. if set mvSub contains the subpixel location of current level.  
+ * lowMemory: optional (after P1, P2), 1 keeps only the best candidates of each pixel instead of the full path cost sums
  *
  * Output:
  * minC: the corresponding sum of the path cost w.r.t. mv
  * flow: flow result, stored in a [width, height, 2] matrix
 */
 
-typedef struct _costEntry
+inline void sgm_step(PathCost* L, //current path cost, followed by the minimum
+					 const PathCost* Lpre, //previous path cost
+					 NgCandidates C, //cost map, the mvs are those of L
+					 const MvType* mvxPre, const MvType* mvyPre, //mvs of Lpre
+					 int dMax, //stride of the path cost entries
+					 int num, int numPre, //candidates of the current/previous pixel
+					 int P1, int P2,
+					 NgCandidateIndex& index) //workspace of the candidate matching
 {
-	int mvx;
-	int mvy;
-	int cost;
-} CostEntry;
-
-inline void sgm_step(CostEntry* L, //current path cost
-					 CostEntry* Lpre, //previous path cost
-					 CostEntry* C, //cost map
-					 int dMax, 
-					 int P1, int P2)
-{
-	PathCost minPathCost = MAX_PATH_COST;
-	PathCost LpreMin = Lpre[dMax].cost; //get minimum value of pre path cost
-
-	for (int d = 0; d< dMax; d++) {
-		int mvx = C[d].mvx;
-		int mvy = C[d].mvy;
+	ng_candidate_index_build(index, mvxPre, mvyPre, Lpre, numPre, P1);
+	PathCost LpreMin = Lpre[dMax]; //get minimum value of pre path cost
 
+	for (int d = 0; d< num; d++) {
 		PathCost min1 = LpreMin + P2;
 		PathCost min2 = LpreMin + P2;
-		PathCost min3 = LpreMin + P2;
-		PathCost bestCost = min3;
-
-		for (int d2 = 0; d2 < dMax; d2++) {
 
-			int mvxPre = Lpre[d2].mvx;
-			int mvyPre = Lpre[d2].mvy;
-
-			if(mvx == mvxPre && mvy == mvyPre) // ||d-d'|| = 0
-				min1 = Lpre[d2].cost;
-			else if(abs(mvx - mvxPre) <= 2 && abs(mvy - mvyPre) <= 2) {// ||d-d'|| < r
-				min2 = std::min<PathCost>(min2, Lpre[d2].cost + P1);
-			} 
-		}
+		ng_candidate_index_lookup(index, C.mvx[d], C.mvy[d], min1, min2); //||d-d'|| = 0, ||d-d'|| < r
+		L[d] = std::min<PathCost>(min1, min2);
+	}
 
-		bestCost = std::min<PathCost>(bestCost, min1);
-		bestCost = std::min<PathCost>(bestCost, min2);
-		L[d].cost = (C[d].cost + bestCost) - LpreMin;
-		L[d].mvx = mvx;
-		L[d].mvy = mvy;
-		minPathCost = std::min<PathCost>(L[d].cost, minPathCost);
+	//the best previous costs are at least LpreMin, and C + P2 fits in PathCost
+	PathCost minPathCost = MAX_PATH_COST;
+	for (int d = 0; d < num; d++) {
+		L[d] = (PathCost)(C.cost[d] + L[d] - LpreMin);
+		minPathCost = std::min<PathCost>(L[d], minPathCost);
 	}
 
-	L[dMax].cost = minPathCost; //set minimum value of current path cost
+	L[dMax] = minPathCost; //set minimum value of current path cost
 }
 
 
@@ -90,32 +77,41 @@ inline int adaptive_P2(int P2, int pixCur, int pixPre) {
  * mvSub is the output subpixel position for mvx/mvy
  *
  * Input:
- * C: 3-d cost volume
- * width/height/dMax: width/height/dMax(third dimension) of C
+ * C/offsets: candidate lists of the pixels, pixel i owns C[offsets[i] .. offsets[i + 1])
+ * width/height: width/height of C, dMax: maximum candidates of a pixel
  * mvPre: previous level's the mv map
  * mvWidth/mvHeight: width/height of mvPre
  * P1/P2: small/large penalty
+ * lowMemory: keep the best candidates of each pixel after the forward pass instead of the
+ *            width x height x dMax path cost sums, see sgm_aggregate_summary()
  *
  */
   
 void sgm2d(unsigned* minC, double* mvSub, 
-        PixelType* I1, CostEntry* C, int width, int height, int dMax,
-        int P1, int P2 )
+        PixelType* I1, NgCandidates C, const size_t* offsets, int width, int height, int dMax,
+        int P1, int P2, bool lowMemory = false)
 {
     //allocate path cost buffers. dMax cost entries + 1 minimun cost entry
-    CostEntry* L1 = (CostEntry*) mxMalloc (sizeof(CostEntry) * 2 * (dMax + 1));            //Left -> Right direction
-    CostEntry* L2 = (CostEntry*) mxMalloc (sizeof(CostEntry) * 2 * width * (dMax + 1));  //top-left -> bottom right direction
-    CostEntry* L3 = (CostEntry*) mxMalloc (sizeof(CostEntry) * 2 * width * (dMax + 1));    //up -> bottom direction
-    CostEntry* L4 = (CostEntry*) mxMalloc (sizeof(CostEntry) * 2 * width * (dMax + 1));  //top-right->bottom left direction
-    unsigned * Sp = (unsigned *) mxMalloc (sizeof(unsigned ) * width * height * dMax); //sum of path cost from all directions
-    memset(Sp, 0, sizeof(unsigned)*width*height*dMax);
+    mxAssert(NG_MAX_COST + 2 * P2 <= MAX_PATH_COST, "path costs overflow PathCost");
+    PathCost* L1 = (PathCost*) mxMalloc (sizeof(PathCost) * 2 * (dMax + 1));            //Left -> Right direction
+    PathCost* L2 = (PathCost*) mxMalloc (sizeof(PathCost) * 2 * width * (dMax + 1));  //top-left -> bottom right direction
+    PathCost* L3 = (PathCost*) mxMalloc (sizeof(PathCost) * 2 * width * (dMax + 1));    //up -> bottom direction
+    PathCost* L4 = (PathCost*) mxMalloc (sizeof(PathCost) * 2 * width * (dMax + 1));  //top-right->bottom left direction
+    //sum of path cost from all directions, only of the current pixel in low memory mode
+    const size_t spEntries = lowMemory ? dMax : offsets[(size_t)width * height];
+    PathSum* Sp = (PathSum*) mxMalloc (sizeof(PathSum) * spEntries);
+    memset(Sp, 0, sizeof(PathSum)*spEntries);
+    void* indexBuffer = mxMalloc(ng_candidate_index_size(dMax));
+    NgCandidateIndex index;
+    ng_candidate_index_init(index, indexBuffer, dMax);
+    SgmCandidate* summary = lowMemory ? (SgmCandidate*) mxMalloc (sizeof(SgmCandidate) * (size_t)width * height * SGM_SUMMARY_CANDIDATES) : NULL;
+    const SgmSummaryParams summaryParams = { 0, { 0 } }; //no subpixel neighbours
 
 	double* flowX = mvSub;
 	double* flowY = mvSub + width*height;
 
     const int pathCostEntryPerPixel = (dMax + 1); //dMax + 1 minimun
     const int pathCostEntryPerRow = width * pathCostEntryPerPixel;
-    const int costPerRowEntry = width*dMax;
     
     const bool adpativeP2 = false;
     const int totalPass = 2;
@@ -140,60 +136,59 @@ void sgm2d(unsigned* minC, double* mvSub,
             xstep = -1;
         }
 
-        CostEntry* ptrL1Pre = L1;
-        CostEntry* ptrL1Cur = L1 + dMax + 1;
-        CostEntry* ptrL3PreRow = L3;
-        CostEntry* ptrL3CurRow = L3 + pathCostEntryPerRow;
-        CostEntry* ptrL2PreRow = L2;
-        CostEntry* ptrL2CurRow = L2 + pathCostEntryPerRow;
-        CostEntry* ptrL4PreRow = L4;
-        CostEntry* ptrL4CurRow = L4 + pathCostEntryPerRow;
+        PathCost* ptrL1Pre = L1;
+        PathCost* ptrL1Cur = L1 + dMax + 1;
+        PathCost* ptrL3PreRow = L3;
+        PathCost* ptrL3CurRow = L3 + pathCostEntryPerRow;
+        PathCost* ptrL2PreRow = L2;
+        PathCost* ptrL2CurRow = L2 + pathCostEntryPerRow;
+        PathCost* ptrL4PreRow = L4;
+        PathCost* ptrL4CurRow = L4 + pathCostEntryPerRow;
 
         for (int y = ystart; y != yend; y += ystep) {
 
-            unsigned* ptrSp = Sp + y*costPerRowEntry;
-            CostEntry* ptrC = C + y*costPerRowEntry;
-
             for (int x = xstart; x != xend; x += xstep) {
 
-                CostEntry* ptrL3Cur = ptrL3CurRow + x*(dMax + 1);
-                CostEntry* ptrL3Pre = ptrL3PreRow + x*(dMax + 1);
+                PathCost* ptrL3Cur = ptrL3CurRow + x*(dMax + 1);
+                PathCost* ptrL3Pre = ptrL3PreRow + x*(dMax + 1);
 
-                CostEntry* ptrL2Cur = ptrL2CurRow + x*(dMax + 1);
-                CostEntry* ptrL2Pre = ptrL2PreRow + (x - xstep)*(dMax + 1);
+                PathCost* ptrL2Cur = ptrL2CurRow + x*(dMax + 1);
+                PathCost* ptrL2Pre = ptrL2PreRow + (x - xstep)*(dMax + 1);
 
-                CostEntry* ptrL4Cur = ptrL4CurRow + x*(dMax + 1);
-                CostEntry* ptrL4Pre = ptrL4PreRow + (x + xstep)*(dMax + 1);
+                PathCost* ptrL4Cur = ptrL4CurRow + x*(dMax + 1);
+                PathCost* ptrL4Pre = ptrL4PreRow + (x + xstep)*(dMax + 1);
 
-                CostEntry* ptrCCur = ptrC + x*dMax;
+                const size_t pixel = (size_t)y*width + x;
+                const NgCandidates ptrCCur = ng_candidates_at(C, offsets[pixel]);
+                const int num = (int)(offsets[pixel + 1] - offsets[pixel]);
 
                 if (x == xstart) {
-                    memcpy(ptrL1Cur, ptrCCur, sizeof(CostEntry)*dMax);
-                    ptrL1Cur[dMax].cost = 0;
+                    memcpy(ptrL1Cur, ptrCCur.cost, sizeof(PathCost)*num);
+                    ptrL1Cur[dMax] = 0;
 
                     if (enableDiagnalPath) {
-                        memcpy(ptrL2Cur, ptrCCur, sizeof(CostEntry)*dMax);
-                        ptrL2Cur[dMax].cost = 0;
+                        memcpy(ptrL2Cur, ptrCCur.cost, sizeof(PathCost)*num);
+                        ptrL2Cur[dMax] = 0;
                     }
                 }
 
                 if (y == ystart) {
-                    memcpy(ptrL3Cur, ptrCCur, sizeof(CostEntry)*dMax);
-                    ptrL3Cur[dMax].cost = 0;
+                    memcpy(ptrL3Cur, ptrCCur.cost, sizeof(PathCost)*num);
+                    ptrL3Cur[dMax] = 0;
 
                     if (enableDiagnalPath) {
-                        memcpy(ptrL2Cur, ptrCCur, sizeof(CostEntry)*dMax);
-                        ptrL2Cur[dMax].cost = 0;
+                        memcpy(ptrL2Cur, ptrCCur.cost, sizeof(PathCost)*num);
+                        ptrL2Cur[dMax] = 0;
 
-                        memcpy(ptrL4Cur, ptrCCur, sizeof(CostEntry)*dMax);
-                        ptrL4Cur[dMax].cost = 0;
+                        memcpy(ptrL4Cur, ptrCCur.cost, sizeof(PathCost)*num);
+                        ptrL4Cur[dMax] = 0;
                     }
                 }
 
                 if (x == xend) {
                     if (enableDiagnalPath) {
-                        memcpy(ptrL4Cur, ptrCCur, sizeof(CostEntry)*dMax);
-                        ptrL4Cur[dMax].cost = 0;
+                        memcpy(ptrL4Cur, ptrCCur.cost, sizeof(PathCost)*num);
+                        ptrL4Cur[dMax] = 0;
                     }
                 }
 
@@ -202,22 +197,28 @@ void sgm2d(unsigned* minC, double* mvSub,
                     //when 2nd pyd processing
                     PixelType pixCur = I1[width*y + x];
                     PixelType pixPre = I1[width*y + x - xstep];
-                    
+                    const size_t pixelPre = pixel - xstep;
+                    const NgCandidates CPre = ng_candidates_at(C, offsets[pixelPre]);
+
                     sgm_step(ptrL1Cur,              //current path cost
                         ptrL1Pre,                   //previous path cost
                         ptrCCur,                    //cost map
-                        dMax, P1, adpativeP2 ? adaptive_P2(P2, pixCur, pixPre) : P2);
+                        CPre.mvx, CPre.mvy,         //previous mvs
+                        dMax, num, (int)(offsets[pixelPre + 1] - offsets[pixelPre]), P1, adpativeP2 ? adaptive_P2(P2, pixCur, pixPre) : P2, index);
                 }
 
 
                 if (y != ystart) {
                     PixelType pixCur = I1[width*y + x];
                     PixelType pixPre = I1[width*(y-ystep) + x];
+                    const size_t pixelPre = pixel - (size_t)ystep*width;
+                    const NgCandidates CPre = ng_candidates_at(C, offsets[pixelPre]);
 
                     sgm_step(ptrL3Cur,              //current path cost
                         ptrL3Pre,                   //previous path cost
                         ptrCCur,                    //cost map
-                        dMax, P1, adpativeP2 ? adaptive_P2(P2, pixCur, pixPre) : P2);
+                        CPre.mvx, CPre.mvy,         //previous mvs
+                        dMax, num, (int)(offsets[pixelPre + 1] - offsets[pixelPre]), P1, adpativeP2 ? adaptive_P2(P2, pixCur, pixPre) : P2, index);
                 }
 
                 if (enableDiagnalPath) {
@@ -225,41 +226,59 @@ void sgm2d(unsigned* minC, double* mvSub,
 
                         PixelType pixCur = I1[width*y + x];
                         PixelType pixPre = I1[width*(y - ystep) + x - xstep];
+                        const size_t pixelPre = pixel - (size_t)ystep*width - xstep;
+                        const NgCandidates CPre = ng_candidates_at(C, offsets[pixelPre]);
 
                         sgm_step(ptrL2Cur,          //current path cost
                             ptrL2Pre,               //previous path cost
                             ptrCCur,                //cost map
-                            dMax, P1, adpativeP2 ? adaptive_P2(P2, pixCur, pixPre) : P2);
+                            CPre.mvx, CPre.mvy,     //previous mvs
+                            dMax, num, (int)(offsets[pixelPre + 1] - offsets[pixelPre]), P1, adpativeP2 ? adaptive_P2(P2, pixCur, pixPre) : P2, index);
                     }
 
                     if (x != xend && y != ystart) {
 
                         PixelType pixCur = I1[width*y + x];
                         PixelType pixPre = I1[width*(y - ystep) + x + xstep];
+                        const size_t pixelPre = pixel - (size_t)ystep*width + xstep;
+                        const NgCandidates CPre = ng_candidates_at(C, offsets[pixelPre]);
 
                         sgm_step(ptrL4Cur,          //current path cost
                             ptrL4Pre,               //previous path cost
                             ptrCCur,                //cost map
-                            dMax, P1, adpativeP2 ? adaptive_P2(P2, pixCur, pixPre) : P2);
+                            CPre.mvx, CPre.mvy,     //previous mvs
+                            dMax, num, (int)(offsets[pixelPre + 1] - offsets[pixelPre]), P1, adpativeP2 ? adaptive_P2(P2, pixCur, pixPre) : P2, index);
 
                     }
                 }
 
-                for (int d = 0; d < dMax; d++) {
-                    ptrSp[x*dMax + d] += ptrL1Cur[d].cost + ptrL3Cur[d].cost;
+                PathSum* ptrSpCur = lowMemory ? Sp : Sp + offsets[pixel];
+                if (lowMemory)
+                    memset(ptrSpCur, 0, sizeof(PathSum)*num);
+
+                for (int d = 0; d < num; d++) {
+                    ptrSpCur[d] += ptrL1Cur[d] + ptrL3Cur[d];
                     if (enableDiagnalPath) {
-                        ptrSp[x*dMax + d] += ptrL2Cur[d].cost + ptrL4Cur[d].cost;
+                        ptrSpCur[d] += ptrL2Cur[d] + ptrL4Cur[d];
                     }
                 }
 
+                if (lowMemory) {
+                    SgmCandidate* cand = summary + ((size_t)y*width + x)*SGM_SUMMARY_CANDIDATES;
+                    if (pass == 0)
+                        sgm_summary_select(cand, ptrSpCur, num, summaryParams);
+                    else
+                        sgm_summary_fold(cand, ptrSpCur, num, summaryParams);
+                }
+
                 //swap buffer pointer for left->right direction
-                CostEntry* tmp = ptrL1Pre;
+                PathCost* tmp = ptrL1Pre;
                 ptrL1Pre = ptrL1Cur;
                 ptrL1Cur = tmp;
             }
 
             //swap buffer pointer for top->bottom direction
-            CostEntry* tmp = ptrL3PreRow;
+            PathCost* tmp = ptrL3PreRow;
             ptrL3PreRow = ptrL3CurRow;
             ptrL3CurRow = tmp;
 
@@ -278,23 +297,26 @@ void sgm2d(unsigned* minC, double* mvSub,
     }
     
     //mexPrintf("path cost aggregate done!\n");
-    for(int y = 0; y< height; y++) {
-        unsigned* SpPtr = Sp + y*costPerRowEntry;
-		
-        for (int x = 0; x <width; x++) {
-            CostEntry* ptrC = C + width* dMax*y + dMax*x;
-            unsigned minCost = SpPtr[x*dMax];
-            unsigned minIdx = 0;
-
-            for (int d = 1; d<dMax; d++) {
-                if(SpPtr[x*dMax + d] < minCost) {
-                    minCost = SpPtr[x*dMax + d] ;
-                    minIdx = d;
-                }
+    if (lowMemory) {
+        for(int y = 0; y< height; y++) {
+            for (int x = 0; x <width; x++) {
+                const size_t offset = offsets[(size_t)y*width + x];
+                const SgmCandidate* best = sgm_summary_best(summary + ((size_t)y*width + x)*SGM_SUMMARY_CANDIDATES);
+                minC[y*width +x] = best->cost[0];
+                flowX[y*width + x] = C.mvx[offset + best->d];
+                flowY[y*width + x] = C.mvy[offset + best->d];
+            }
+        }
+    } else {
+        for(int y = 0; y< height; y++) {
+            for (int x = 0; x <width; x++) {
+                const size_t pixel = (size_t)y*width + x;
+                PathSum minCost;
+                const int minIdx = sgm_argmin(Sp + offsets[pixel], (int)(offsets[pixel + 1] - offsets[pixel]), minCost);
+                minC[y*width +x] = minCost;
+                flowX[y*width + x] = C.mvx[offsets[pixel] + minIdx];
+                flowY[y*width + x] = C.mvy[offsets[pixel] + minIdx];
             }
-            minC[y*width +x] = minCost;
-            flowX[y*width + x] = ptrC[minIdx].mvx;
-			flowY[y*width + x] = ptrC[minIdx].mvy;
         }
     }
 		
@@ -303,6 +325,9 @@ void sgm2d(unsigned* minC, double* mvSub,
     mxFree(L3);
     mxFree(L4);
     mxFree(Sp);
+    mxFree(indexBuffer);
+    if (summary)
+        mxFree(summary);
 }
 
 void subpixel_refine(double* flow, unsigned* cen1, unsigned* cen2, int width, int height) 
@@ -366,8 +391,13 @@ void subpixel_refine(double* flow, unsigned* cen1, unsigned* cen2, int width, in
 		}
 	}
 }
-        
-void calc_cost(CostEntry* C,
+
+/* candidate lists of the pixels into C/offsets (CSR, C holds at most dMax entries per pixel): the (2r+1)^2 mvs
+ * around the hints of the neighbours at step pixels. A repeated mv is skipped before its cost is evaluated, the
+ * first occurrence keeps its position. The window sums of integral hints reuse the columns of the previous pixels
+ * of the row (NgCostCache)
+ */
+void calc_cost(NgCandidates C, size_t* offsets,
 	const unsigned* cen1, const unsigned* cen2, int width, int height,
 	const double* preMv, int mvWidth, int mvHeight,
 	int winRadiusAgg, int winRadiusX, int winRadiusY, 
@@ -378,14 +408,26 @@ void calc_cost(CostEntry* C,
 	int winPixels = (2 * winRadiusAgg + 1)*(2 * winRadiusAgg + 1);
 	const CostType defaultCost = 5;
 
+	void* mvSetBuffer = mxMalloc(ng_mv_set_size(dMax));
+	NgMvSet mvSet;
+	ng_mv_set_init(mvSet, mvSetBuffer, dMax);
+	void* costCacheBuffer = mxMalloc(ng_cost_cache_size());
+	NgCostCache costCache;
+	const bool cacheWindow = 2 * winRadiusAgg + 1 <= NG_CACHE_COLUMNS; //wider windows are summed directly
+	ng_cost_cache_init(costCache, costCacheBuffer, cacheWindow ? winRadiusAgg : 0);
+	const auto costStart = std::chrono::steady_clock::now();
+
 	const int step = 8;
+	offsets[0] = 0;
 	for (int y = 0; y < height; y++) {
 		for (int x = 0; x < width; x++) {
 			int hintIdx = 0;
 
-			CostEntry* ptrC = C + dMax*width*y + dMax*x;
+			NgCandidates ptrC = ng_candidates_at(C, offsets[(size_t)width*y + x]);
 
 			int d = 0;
+			int n = 0; //candidates including the repeated ones
+			ng_mv_set_clear(mvSet);
 
 			for (int dy = -step*hintYradius; dy <= step*hintYradius; dy += step) {
 				for (int dx = -step*hintXradius; dx <= step*hintXradius; dx += step) {
@@ -394,14 +436,41 @@ void calc_cost(CostEntry* C,
 
 					double mvx = pMvx[mvWidth*yn + xn];
 					double mvy = pMvy[mvWidth*yn + xn];
-					
+					//a fractional hint truncates per reference pixel, its costs are summed directly
+					const bool cacheHint = cacheWindow && mvx == floor(mvx) && mvy == floor(mvy);
 					
 					for (int offx = -winRadiusX; offx <= winRadiusX; offx++) {
 						for (int offy = -winRadiusY; offy <= winRadiusY; offy++) {
-				
+
+							n++;
+							const int candMvx = mvx + offx;
+							const int candMvy = mvy + offy;
+							if (!ng_mv_set_insert(mvSet, candMvx, candMvy))
+								continue;
+
 							unsigned costSum = 0;
 
-							for (int aggy = -winRadiusAgg; aggy <= winRadiusAgg; aggy++) {
+							if (cacheHint) {
+								//census cost of column xa of the aggregation window, the window sum goes through the cache
+								auto column = [&](int xa) {
+									if (xa < 0 || xa > width - 1)
+										return (unsigned)(2 * winRadiusAgg + 1) * defaultCost;
+
+									const int x2 = xa + candMvx;
+									unsigned sum = 0;
+									for (int aggy = -winRadiusAgg; aggy <= winRadiusAgg; aggy++) {
+										int y1 = y + aggy;
+										int y2 = y1 + candMvy;
+										if (y1 < 0 || y1 > height - 1 || y2 < 0 || y2 > height - 1 || x2 < 0 || x2 > width - 1)
+											sum += defaultCost;
+										else
+											sum += _mm_popcnt_u32(cen1[width*y1 + xa] ^ cen2[width*y2 + x2]);
+									}
+									return sum;
+								};
+								costSum = ng_cost_cache_sum(costCache, x, y, candMvx, candMvy, column);
+							}
+							else for (int aggy = -winRadiusAgg; aggy <= winRadiusAgg; aggy++) {
 								for (int aggx = -winRadiusAgg; aggx <= winRadiusAgg; aggx++) {
 
 									int y1 = y + aggy;
@@ -429,9 +498,9 @@ void calc_cost(CostEntry* C,
 								}
 							}
 							
-							ptrC[d].cost = (1.0 * costSum / winPixels) + 0.5;
-							ptrC[d].mvx = mvx + offx;
-							ptrC[d].mvy = mvy + offy;
+							ptrC.cost[d] = (CostType)((1.0 * costSum / winPixels) + 0.5);
+							ptrC.mvx[d] = (MvType)candMvx;
+							ptrC.mvy[d] = (MvType)candMvy;
 							
 							d++;
 						}
@@ -440,12 +509,19 @@ void calc_cost(CostEntry* C,
 				} //dx
 			} //dy
 
-			mxAssert(d == dMax, "incorrect candidates per pixel!\n");
+			mxAssert(n == dMax, "incorrect candidates per pixel!\n");
+			offsets[(size_t)width*y + x + 1] = offsets[(size_t)width*y + x] + d;
 		}
 	}
+
+	if (NG_VERBOSE)
+		ng_cost_cache_report(costCache, std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - costStart).count());
+
+	mxFree(mvSetBuffer);
+	mxFree(costCacheBuffer);
 }
 /* The gateway function */
-void mexFunction(int nlhs, mxArray *plhs[],
+void mexFunction(int /*nlhs*/, mxArray *plhs[],
                  int nrhs, const mxArray *prhs[])
 {
     PixelType *I1;             /* pointer to Input image I1 */
@@ -468,6 +544,7 @@ void mexFunction(int nlhs, mxArray *plhs[],
 
     int P1 = mxGetScalar(prhs[6]);
     int P2 = mxGetScalar(prhs[7]);
+    bool lowMemory = nrhs > 8 ? mxGetScalar(prhs[8]) != 0 : false;
     
     /* create the output matrix */
 
@@ -496,27 +573,43 @@ void mexFunction(int nlhs, mxArray *plhs[],
 
 	int dMax = hintN*candidatePerHint ;
 
-    mexPrintf("width: %d, height: %d, dMax: %d, winRadiusAgg: %d\n", width, height, dMax, winRadiusAgg);
+    mexPrintf("width: %d, height: %d, dMax: %d, winRadiusAgg: %d\n", (int)width, (int)height, dMax, winRadiusAgg);
     
     int mvWidth = mxGetM(prhs[2]);
     int mvHeight = mxGetN(prhs[2])/2;
     
-	CostEntry* C2 = (CostEntry*) mxMalloc(width * height * sizeof(CostEntry) * dMax);
+	const size_t maxEntries = (size_t)width * height * dMax;
+	NgCandidates C2;
+	C2.cost = (CostType*) mxMalloc(maxEntries * sizeof(CostType));
+	C2.mvx = (MvType*) mxMalloc(maxEntries * sizeof(MvType));
+	C2.mvy = (MvType*) mxMalloc(maxEntries * sizeof(MvType));
+	size_t* offsets = (size_t*) mxMalloc(((size_t)width * height + 1) * sizeof(size_t));
 	//construct cost volume
-	calc_cost(C2, cen1, cen2,  width, height, preMv, mvWidth, mvHeight,
+	calc_cost(C2, offsets, cen1, cen2,  width, height, preMv, mvWidth, mvHeight,
 		winRadiusAgg, winRadiusX, winRadiusY,
 		hintXradius, hintYradius, dMax);
 
+	//keep the packed lists only
+	const size_t entries = offsets[(size_t)width * height];
+	C2.cost = (CostType*) mxRealloc(C2.cost, entries * sizeof(CostType));
+	C2.mvx = (MvType*) mxRealloc(C2.mvx, entries * sizeof(MvType));
+	C2.mvy = (MvType*) mxRealloc(C2.mvy, entries * sizeof(MvType));
+	if (NG_VERBOSE)
+		mexPrintf("candidates per pixel: %.1f of %d\n", (double)entries / ((size_t)width * height), dMax);
+
 	//perform sgm
 	sgm2d(minC, flowResult, 
-		I1, C2, width, height, dMax, 
-		P1, P2);
+		I1, C2, offsets, width, height, dMax, 
+		P1, P2, lowMemory);
 
 
 	if(subPixelRefine)
 		subpixel_refine(flowResult, cen1, cen2, width, height);
 
-	mxFree(C2);
+	mxFree(C2.cost);
+	mxFree(C2.mvx);
+	mxFree(C2.mvy);
+	mxFree(offsets);
     mxFree(cen1);
     mxFree(cen2);
     
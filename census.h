@@ -0,0 +1,288 @@
+#ifndef _CENSUS_H_
+#define _CENSUS_H_
+#include <nmmintrin.h>
+#include "common.h"
+#if defined(__AVX2__) || defined(__AVX512BW__)
+#include <immintrin.h>
+#endif
+
+#if defined(__AVX512BW__)
+#define CENSUS_SIMD_WIDTH 64
+#elif defined(__AVX2__)
+#define CENSUS_SIMD_WIDTH 32
+#endif
+
+/*
+ * Census window policies, the window shape and code width are fixed at compile time.
+ *
+ * CodeType: integer type of the census code, it also selects the popcount width in hamming_cost()
+ * RADIUS_X/RADIUS_Y: half window size, pixels closer to the image border use the clamped scalar path
+ * BITS: number of comparisons, bit k (counted from the most significant one) is set if I(a) >= I(b)
+ * SHIFT: extra left shift applied to the final code
+ * CENTERED: b is always the center pixel
+ */
+
+//dense 5x5 window, 25 comparisons including the center. Same codes as census(img, cen, width, height, 2)
+struct CensusDense5x5
+{
+    typedef unsigned CodeType;
+    enum { RADIUS_X = 2, RADIUS_Y = 2, BITS = 25, SHIFT = 1, CENTERED = 1 };
+    static inline void pair(int k, int& ax, int& ay, int& bx, int& by) { ax = k%5 - 2; ay = k/5 - 2; bx = 0; by = 0; }
+};
+
+//sparse checkerboard 9x7 window: all pixels with odd dx + dy, 32 comparisons
+struct CensusSparse9x7
+{
+    typedef unsigned CodeType;
+    enum { RADIUS_X = 4, RADIUS_Y = 3, BITS = 32, SHIFT = 0, CENTERED = 1 };
+    static inline void pair(int k, int& ax, int& ay, int& bx, int& by)
+    {
+        //rows alternate between 5 (odd dy, even dx) and 4 (even dy, odd dx) samples
+        int rowPair = k/9, i = k%9;
+        if (i < 5) { ay = 2*rowPair - 3; ax = 2*i - 4; }
+        else { ay = 2*rowPair - 2; ax = 2*(i - 5) - 3; }
+        bx = 0; by = 0;
+    }
+};
+
+//center-symmetric 5x5 window: the 12 pixels before the center are compared with their mirrored pixel
+struct CensusCS5x5
+{
+    typedef unsigned short CodeType;
+    enum { RADIUS_X = 2, RADIUS_Y = 2, BITS = 12, SHIFT = 0, CENTERED = 0 };
+    static inline void pair(int k, int& ax, int& ay, int& bx, int& by) { ax = k%5 - 2; ay = k/5 - 2; bx = -ax; by = -ay; }
+};
+
+//center-symmetric 9x7 window, 31 comparisons
+struct CensusCS9x7
+{
+    typedef unsigned CodeType;
+    enum { RADIUS_X = 4, RADIUS_Y = 3, BITS = 31, SHIFT = 0, CENTERED = 0 };
+    static inline void pair(int k, int& ax, int& ay, int& bx, int& by) { ax = k%9 - 4; ay = k/9 - 3; bx = -ax; by = -ay; }
+};
+
+//dense 9x7 window without the center, 62 comparisons
+struct CensusDense9x7
+{
+    typedef unsigned long long CodeType;
+    enum { RADIUS_X = 4, RADIUS_Y = 3, BITS = 62, SHIFT = 0, CENTERED = 1 };
+    static inline void pair(int k, int& ax, int& ay, int& bx, int& by)
+    {
+        int i = k < 31 ? k : k + 1;
+        ax = i%9 - 4; ay = i/9 - 3; bx = 0; by = 0;
+    }
+};
+
+//census window used by the cost kernels, can be overridden at build time, e.g. -DCENSUS_WINDOW=CensusSparse9x7
+#ifndef CENSUS_WINDOW
+#define CENSUS_WINDOW CensusDense5x5
+#endif
+typedef CENSUS_WINDOW CensusWindow;
+
+//matching cost of two census codes, the popcount follows the code width
+inline int hamming_cost(unsigned short a, unsigned short b) { return _mm_popcnt_u32(a ^ b); }
+inline int hamming_cost(unsigned a, unsigned b) { return _mm_popcnt_u32(a ^ b); }
+inline int hamming_cost(unsigned long long a, unsigned long long b) { return (int)_mm_popcnt_u64(a ^ b); }
+
+//census code of a single pixel, neighbours outside of the image are clamped to the border
+template <class Window>
+inline typename Window::CodeType census_pixel(const PixelType* img, int x, int y, int width, int height)
+{
+    typedef typename Window::CodeType CodeType;
+    CodeType code = 0;
+    for (int k = 0; k < Window::BITS; k++) {
+        int ax, ay, bx, by;
+        Window::pair(k, ax, ay, bx, by);
+        PixelType a = img[clamp(y + ay, 0, height - 1)*width + clamp(x + ax, 0, width - 1)];
+        PixelType b = img[clamp(y + by, 0, height - 1)*width + clamp(x + bx, 0, width - 1)];
+        code = (CodeType)((code << 1) | (a >= b ? 1 : 0));
+    }
+    return (CodeType)(code << Window::SHIFT);
+}
+
+#ifdef CENSUS_SIMD_WIDTH
+/*
+ * The vectorized census accumulates the comparison results of CENSUS_SIMD_WIDTH pixels into
+ * sizeof(CodeType) byte planes, plane p holds bits 8p .. 8p+7 of every code. Bits are produced
+ * from the most significant one downwards, so each plane is built with acc = 2*acc | bit and the
+ * planes are interleaved into codes at the end.
+ */
+
+//first/last comparison index stored in byte plane p
+template <class Window>
+inline int census_plane_begin(int p)
+{
+    const int top = Window::BITS - 1 + Window::SHIFT;
+    return top - std::min<int>(8*p + 7, top);
+}
+
+template <class Window>
+inline int census_plane_end(int p)
+{
+    const int top = Window::BITS - 1 + Window::SHIFT;
+    return top - std::max<int>(8*p, Window::SHIFT);
+}
+
+#if defined(__AVX512BW__)
+//v[j] holds 128-bit lane i of the result for j = 0..3, transpose so that out lane j comes from v[j]
+inline void census_store_4x128(__m512i* v, void* dst0, void* dst1, void* dst2, void* dst3)
+{
+    __m512i t0 = _mm512_shuffle_i32x4(v[0], v[1], _MM_SHUFFLE(2, 0, 2, 0));
+    __m512i t1 = _mm512_shuffle_i32x4(v[2], v[3], _MM_SHUFFLE(2, 0, 2, 0));
+    __m512i u0 = _mm512_shuffle_i32x4(v[0], v[1], _MM_SHUFFLE(3, 1, 3, 1));
+    __m512i u1 = _mm512_shuffle_i32x4(v[2], v[3], _MM_SHUFFLE(3, 1, 3, 1));
+    _mm512_storeu_si512(dst0, _mm512_shuffle_i32x4(t0, t1, _MM_SHUFFLE(2, 0, 2, 0)));
+    _mm512_storeu_si512(dst1, _mm512_shuffle_i32x4(u0, u1, _MM_SHUFFLE(2, 0, 2, 0)));
+    _mm512_storeu_si512(dst2, _mm512_shuffle_i32x4(t0, t1, _MM_SHUFFLE(3, 1, 3, 1)));
+    _mm512_storeu_si512(dst3, _mm512_shuffle_i32x4(u0, u1, _MM_SHUFFLE(3, 1, 3, 1)));
+}
+#endif
+
+//returns the first pixel of row y which is not processed
+template <class Window>
+int census_row_simd(const PixelType* img, typename Window::CodeType* cen, int width, int y, int x,
+    const int* offA, const int* offB)
+{
+    typedef typename Window::CodeType CodeType;
+    const int P = sizeof(CodeType);
+    const PixelType* row = img + width*y;
+    CodeType* ptrCen = cen + width*y;
+
+#if defined(__AVX512BW__)
+    const __m512i one = _mm512_set1_epi8(1);
+
+    for (; x + CENSUS_SIMD_WIDTH + Window::RADIUS_X <= width; x += CENSUS_SIMD_WIDTH) {
+        const PixelType* center = row + x;
+        const __m512i c = _mm512_loadu_si512((const void*)center);
+        __m512i v[P];
+
+        for (int p = P - 1; p >= 0; p--) {
+            __m512i acc = _mm512_setzero_si512();
+            for (int k = census_plane_begin<Window>(p); k <= census_plane_end<Window>(p); k++) {
+                __m512i a = _mm512_loadu_si512((const void*)(center + offA[k]));
+                __m512i b = Window::CENTERED ? c : _mm512_loadu_si512((const void*)(center + offB[k]));
+                acc = _mm512_add_epi8(acc, acc);
+                acc = _mm512_mask_add_epi8(acc, _mm512_cmpge_epu8_mask(a, b), acc, one);
+            }
+            if (p == 0)
+                for (int s = 0; s < Window::SHIFT; s++)
+                    acc = _mm512_add_epi8(acc, acc);
+            v[p] = acc;
+        }
+
+        //interleave bytes -> words -> dwords -> qwords inside each 128-bit lane
+        for (int groups = P, parts = 1, level = 0; groups > 1; groups /= 2, parts *= 2, level++) {
+            __m512i t[P];
+            for (int g = 0; g < groups/2; g++) {
+                for (int i = 0; i < parts; i++) {
+                    __m512i a = v[2*g*parts + i];
+                    __m512i b = v[(2*g + 1)*parts + i];
+                    __m512i* out = t + 2*g*parts + 2*i;
+                    if (level == 0) { out[0] = _mm512_unpacklo_epi8(a, b); out[1] = _mm512_unpackhi_epi8(a, b); }
+                    else if (level == 1) { out[0] = _mm512_unpacklo_epi16(a, b); out[1] = _mm512_unpackhi_epi16(a, b); }
+                    else { out[0] = _mm512_unpacklo_epi32(a, b); out[1] = _mm512_unpackhi_epi32(a, b); }
+                }
+            }
+            for (int i = 0; i < P; i++)
+                v[i] = t[i];
+        }
+
+        //lane i of v[j] now holds pixels 16i + j*16/P ...
+        CodeType* dst = ptrCen + x;
+        if (P == 2) {
+            for (int j = 0; j < 2; j++) {
+                _mm_storeu_si128((__m128i*)(dst + j*8), _mm512_extracti32x4_epi32(v[j], 0));
+                _mm_storeu_si128((__m128i*)(dst + 16 + j*8), _mm512_extracti32x4_epi32(v[j], 1));
+                _mm_storeu_si128((__m128i*)(dst + 32 + j*8), _mm512_extracti32x4_epi32(v[j], 2));
+                _mm_storeu_si128((__m128i*)(dst + 48 + j*8), _mm512_extracti32x4_epi32(v[j], 3));
+            }
+        } else {
+            for (int j = 0; j < P; j += 4)
+                census_store_4x128(v + j, dst + j*16/P, dst + 16 + j*16/P, dst + 32 + j*16/P, dst + 48 + j*16/P);
+        }
+    }
+#else
+    const __m256i one = _mm256_set1_epi8(1);
+
+    for (; x + CENSUS_SIMD_WIDTH + Window::RADIUS_X <= width; x += CENSUS_SIMD_WIDTH) {
+        const PixelType* center = row + x;
+        const __m256i c = _mm256_loadu_si256((const __m256i*)center);
+        __m256i v[P];
+
+        for (int p = P - 1; p >= 0; p--) {
+            __m256i acc = _mm256_setzero_si256();
+            for (int k = census_plane_begin<Window>(p); k <= census_plane_end<Window>(p); k++) {
+                __m256i a = _mm256_loadu_si256((const __m256i*)(center + offA[k]));
+                __m256i b = Window::CENTERED ? c : _mm256_loadu_si256((const __m256i*)(center + offB[k]));
+                //a >= b (unsigned) <=> max(a, b) == a
+                __m256i ge = _mm256_and_si256(_mm256_cmpeq_epi8(_mm256_max_epu8(a, b), a), one);
+                acc = _mm256_or_si256(_mm256_add_epi8(acc, acc), ge);
+            }
+            if (p == 0)
+                for (int s = 0; s < Window::SHIFT; s++)
+                    acc = _mm256_add_epi8(acc, acc);
+            v[p] = acc;
+        }
+
+        //interleave bytes -> words -> dwords -> qwords inside each 128-bit lane
+        for (int groups = P, parts = 1, level = 0; groups > 1; groups /= 2, parts *= 2, level++) {
+            __m256i t[P];
+            for (int g = 0; g < groups/2; g++) {
+                for (int i = 0; i < parts; i++) {
+                    __m256i a = v[2*g*parts + i];
+                    __m256i b = v[(2*g + 1)*parts + i];
+                    __m256i* out = t + 2*g*parts + 2*i;
+                    if (level == 0) { out[0] = _mm256_unpacklo_epi8(a, b); out[1] = _mm256_unpackhi_epi8(a, b); }
+                    else if (level == 1) { out[0] = _mm256_unpacklo_epi16(a, b); out[1] = _mm256_unpackhi_epi16(a, b); }
+                    else { out[0] = _mm256_unpacklo_epi32(a, b); out[1] = _mm256_unpackhi_epi32(a, b); }
+                }
+            }
+            for (int i = 0; i < P; i++)
+                v[i] = t[i];
+        }
+
+        //lane 0/1 of v[j] now holds pixels j*16/P ... / 16 + j*16/P ...
+        CodeType* dst = ptrCen + x;
+        for (int j = 0; j < P/2; j++) {
+            _mm256_storeu_si256((__m256i*)(dst + j*32/P), _mm256_permute2x128_si256(v[2*j], v[2*j + 1], 0x20));
+            _mm256_storeu_si256((__m256i*)(dst + 16 + j*32/P), _mm256_permute2x128_si256(v[2*j], v[2*j + 1], 0x31));
+        }
+    }
+#endif
+    return x;
+}
+#endif
+
+/*
+ * census transform with a compile-time window. The interior is vectorized, the border where the
+ * window leaves the image is done by the scalar path which clamps the neighbours.
+ */
+template <class Window>
+void census_transform(const PixelType* img, typename Window::CodeType* cen, int width, int height)
+{
+#ifdef CENSUS_SIMD_WIDTH
+    int offA[Window::BITS];
+    int offB[Window::BITS];
+    for (int k = 0; k < Window::BITS; k++) {
+        int ax, ay, bx, by;
+        Window::pair(k, ax, ay, bx, by);
+        offA[k] = ay*width + ax;
+        offB[k] = by*width + bx;
+    }
+#endif
+
+    for (int y = 0; y < height; y++) {
+        int x = 0;
+#ifdef CENSUS_SIMD_WIDTH
+        if (y >= Window::RADIUS_Y && y < height - Window::RADIUS_Y) {
+            for (; x < Window::RADIUS_X && x < width; x++)
+                cen[x + y*width] = census_pixel<Window>(img, x, y, width, height);
+            x = census_row_simd<Window>(img, cen, width, y, x, offA, offB);
+        }
+#endif
+        for (; x < width; x++)
+            cen[x + y*width] = census_pixel<Window>(img, x, y, width, height);
+    }
+}
+
+#endif
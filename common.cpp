@@ -1,27 +1,86 @@
 #include "common.h"
+#include "census.h"
 
-void census(PixelType* img, unsigned * cen, int width, int height, int halfWin)
+//census code of a single pixel, neighbours outside of the image are clamped to the border
+inline unsigned census_pixel(const PixelType* img, int x, int y, int width, int height, int halfWin)
 {
-    
-    
-    for (int y = 0; y< height; y++) {
-        for(int x= 0; x< width; x++) {
-            
-            unsigned censusCode = 0;
-            unsigned char centerValue = img[x +  width*y];
-            for (int offsetY = -halfWin; offsetY <= halfWin; ++offsetY) {
-                for (int offsetX = -halfWin; offsetX <= halfWin; ++offsetX) {
-                    int y2 = y + offsetY;
-                    int x2 = x + offsetX;
-                    
-                    y2 = y2 < 0? 0 : (y2 > height-1? height-1:y2);
-                    x2 = x2 < 0? 0 : (x2 > width-1? width-1:x2);
-                    if (img[x2 + width*y2] >= centerValue)
-                        censusCode += 1;
-                    censusCode = censusCode << 1;
-                }
-            }
-            cen[x + y*width] = censusCode;
+    unsigned censusCode = 0;
+    unsigned char centerValue = img[x +  width*y];
+    for (int offsetY = -halfWin; offsetY <= halfWin; ++offsetY) {
+        for (int offsetX = -halfWin; offsetX <= halfWin; ++offsetX) {
+            int y2 = y + offsetY;
+            int x2 = x + offsetX;
+
+            y2 = y2 < 0? 0 : (y2 > height-1? height-1:y2);
+            x2 = x2 < 0? 0 : (x2 > width-1? width-1:x2);
+            if (img[x2 + width*y2] >= centerValue)
+                censusCode += 1;
+            censusCode = censusCode << 1;
         }
     }
-}
\ No newline at end of file
+    return censusCode;
+}
+
+void census(PixelType* img, unsigned * cen, int width, int height, int halfWin)
+{
+    //the 5x5 window has a vectorized kernel
+    if (halfWin == 2) {
+        census_transform<CensusDense5x5>(img, cen, width, height);
+        return;
+    }
+
+    for (int y = 0; y< height; y++)
+        for(int x= 0; x< width; x++)
+            cen[x + y*width] = census_pixel(img, x, y, width, height, halfWin);
+}
+
+void box_filter_row(CostType* dst, const unsigned* colSum, int width, int dMax, int radius, unsigned* rowSum)
+{
+    const int winPixels = (2*radius + 1)*(2*radius + 1);
+    const unsigned long long factor = box_normalize_factor(winPixels);
+
+    for (int d = 0; d < dMax; d++)
+        rowSum[d] = 0;
+    for (int dx = -radius; dx <= radius; dx++) {
+        const unsigned* ptrCol = colSum + clamp(dx, 0, width - 1)*dMax;
+        for (int d = 0; d < dMax; d++)
+            rowSum[d] += ptrCol[d];
+    }
+
+    for (int x = 0; x < width; x++) {
+        CostType* ptrDst = dst + x*dMax;
+        for (int d = 0; d < dMax; d++)
+            ptrDst[d] = box_normalize(rowSum[d], winPixels, factor);
+
+        //slide the window to x + 1
+        const unsigned* ptrIn = colSum + clamp(x + radius + 1, 0, width - 1)*dMax;
+        const unsigned* ptrOut = colSum + clamp(x - radius, 0, width - 1)*dMax;
+        for (int d = 0; d < dMax; d++)
+            rowSum[d] += ptrIn[d] - ptrOut[d];
+    }
+}
+
+void box_filter_cost(CostType* dst, const CostType* src, int width, int height, int dMax, int radius, unsigned* workspace)
+{
+    const int costPerRow = width*dMax;
+    unsigned* colSum = workspace;
+    unsigned* rowSum = workspace + costPerRow;
+
+    for (int i = 0; i < costPerRow; i++)
+        colSum[i] = 0;
+    for (int dy = -radius; dy <= radius; dy++) {
+        const CostType* ptrSrc = src + (size_t)clamp(dy, 0, height - 1)*costPerRow;
+        for (int i = 0; i < costPerRow; i++)
+            colSum[i] += ptrSrc[i];
+    }
+
+    for (int y = 0; y < height; y++) {
+        box_filter_row(dst + (size_t)y*costPerRow, colSum, width, dMax, radius, rowSum);
+
+        //move the column sums to row y + 1
+        const CostType* ptrIn = src + (size_t)clamp(y + radius + 1, 0, height - 1)*costPerRow;
+        const CostType* ptrOut = src + (size_t)clamp(y - radius, 0, height - 1)*costPerRow;
+        for (int i = 0; i < costPerRow; i++)
+            colSum[i] += ptrIn[i] - ptrOut[i];
+    }
+}
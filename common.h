@@ -4,10 +4,40 @@
 typedef unsigned char PathCost;
 typedef unsigned char PixelType;
 typedef unsigned char CostType;
+//sum of the path costs of all directions, 16 bits hold 257 saturated path costs. define SGM_PATH_SUM_32BIT for 32 bit sums
+#ifdef SGM_PATH_SUM_32BIT
+typedef unsigned PathSum;
+#else
+typedef unsigned short PathSum;
+#endif
 
 #define MAX_PATH_COST 255
+#define MAX_PATH_SUM ((PathSum)~0u)
 #define SUBPIXEL_PRECISION 8
 void census(PixelType* img, unsigned * cen, int width, int height, int halfWin);
 
+/* box filtering of a width x height x dMax cost volume, (2*radius+1)^2 window with clamped borders.
+ * Vertical column sums are updated incrementally per row and slid horizontally, so the cost per entry
+ * does not depend on radius. Output rounding is identical to (CostType)(1.0*costSum/winPixels + 0.5).
+ * workspace: (width + 1) * dMax entries
+ */
+void box_filter_cost(CostType* dst, const CostType* src, int width, int height, int dMax, int radius, unsigned* workspace);
+
+/* horizontal pass of box_filter_cost for one row, colSum holds the vertical sums of the row (width x dMax)
+ * rowSum: dMax entries of workspace
+ */
+void box_filter_row(CostType* dst, const unsigned* colSum, int width, int dMax, int radius, unsigned* rowSum);
+
+const int BOX_MAX_RADIUS = 22;  //largest box window radius for which box_normalize is exact
+
+//fixed-point reciprocal for box_normalize, exact for radius <= BOX_MAX_RADIUS
+inline unsigned long long box_normalize_factor(int winPixels) {return ((1ULL << 32) + 2*winPixels - 1) / (2*winPixels);}
+
+//round(costSum/winPixels) without division, costSum/winPixels never ends in .5 as winPixels is odd
+inline CostType box_normalize(unsigned costSum, int winPixels, unsigned long long factor)
+{
+    return (CostType)(((2ULL*costSum + winPixels) * factor) >> 32);
+}
+
 inline int clamp(int val, int minVal, int maxVal) {return std::min<int>(maxVal, std::max<int>(minVal, val));}
 #endif
\ No newline at end of file
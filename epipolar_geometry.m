@@ -1,4 +1,4 @@
-function [PrefD0, NormlizeDirection, Offset,  Rflow, status] = epipolar_geometry(I1, I2, K)
+function [geometry, status, PrefD0, NormlizeDirection, Offset,  Rflow] = epipolar_geometry(I1, I2, K)
 %Calculate the epipolar geometry for two Camera views I1 and I2
 % output is Fundamental Matrix F and esstential Matrix E
 % epipole position in I2
@@ -10,11 +10,16 @@ function [PrefD0, NormlizeDirection, Offset,  Rflow, status] = epipolar_geometry
 % 
 %   denote p as current pixel position, p' is the starting search position in reference image, e' as the epipole in the reference image 
 %
+% geometry: compact form for calc_cost_sgm, struct of H, F and epipole =
+%   [ex, ey, expansion] in the 0-based pixel coordinates of the kernel
+% status: 0/1 success/fail
+%
+% the per pixel planes below are only computed when they are requested, for
+% the MATLAB reference path (calc_cost.m)
 % PrefD0: starting search pixel position of pixel p in reference image (M x N x2)
 % normlizeDirection: unit direction vector of line e' -> p' (MxNx2)
 % Offset: offset of e'-> p' (MxN)
 % Rflow: rotation flow of p (MxNx2)
-% status: 0/1 success/fail
 % 
     assert(isequal(size(I1), size(I2)));
 
@@ -33,7 +38,7 @@ function [PrefD0, NormlizeDirection, Offset,  Rflow, status] = epipolar_geometry
     
 %in case Fundamental matrix estimation fail, set all output to zero
     if(status) 
-        PrefD0 = 0; NormlizeDirection = 0;Offset = 0; Rflow = 0;
+        PrefD0 = 0; NormlizeDirection = 0;Offset = 0; Rflow = 0; geometry = [];
         return;
     end
     
@@ -98,6 +103,11 @@ function [PrefD0, NormlizeDirection, Offset,  Rflow, status] = epipolar_geometry
     end
 
 
+    geometry = struct('H', H, 'F', F, 'epipole', [epi(1) - 1, epi(2) - 1, ~direction]);
+    if(nargout <= 2)
+        return;
+    end
+
 %%% calculate starting search postition in I2
 % and the direction along epipolar line for every pixel in I1
 
@@ -21,7 +21,7 @@ P1 = 6; P2 = 64;
 rows = size(I0, 1);
 cols = size(I0, 2);
 
-[Pd0, normlizeDirection, O, flowR, status] = epipolar_geometry(I0, I1, K);
+[geometry, status] = epipolar_geometry(I0, I1, K);
 
 if(status)
     flow = zeros(rows, cols, 3);
@@ -38,16 +38,12 @@ if(size(I0_, 3) > 1)
 end
 
 tic;
-Pd0_ = permute(Pd0, [2, 1, 3]);
-normlizeDirection_ = permute(normlizeDirection, [2, 1, 3]);
-O_ = O';
-
-[bestD, minC] = calc_cost_sgm(I0_, I1_, dMax, vMax, Pd0_, normlizeDirection_, O_, P1, P2);
-disparites = double(bestD')/256.0;
+% the kernel evaluates the geometry from H, F and the epipole instead of the
+% per pixel planes and returns the flow along the epipolar lines
+[~, minC, ~, ~, ~, flow] = calc_cost_sgm(I0_, I1_, dMax, vMax, geometry.H, geometry.F, geometry.epipole, P1, P2);
 toc;
 
-flowT = disparites.*normlizeDirection;
-flow = flowT + flowR;
+flow = permute(flow, [2, 1, 3]);
 flow(:,:,3) = 1;
 
 % in case that epipolar sgm flow fail, output zero flow map
@@ -0,0 +1,26 @@
+function [ hints ] = forward_warp_flow( flow )
+% Move the flow of the frame pair (t-1, t) to frame t assuming constant
+% motion, as motion prior (temporal hints) of the pair (t, t+1).
+%   Of the pixels landing on the same position the larger motion (the
+%   closer object) wins, positions nothing lands on keep their own flow.
+    row = size(flow, 1);
+    col = size(flow, 2);
+    u = flow(:, :, 1);
+    v = flow(:, :, 2);
+
+    [x, y] = meshgrid(1:col, 1:row);
+    tx = round(x + u);
+    ty = round(y + v);
+    idx = find(tx >= 1 & tx <= col & ty >= 1 & ty <= row);
+
+    % ascending magnitude, the last assignment to a position wins
+    [~, order] = sort(u(idx).^2 + v(idx).^2);
+    idx = idx(order);
+    target = sub2ind([row, col], ty(idx), tx(idx));
+
+    hu = u;
+    hv = v;
+    hu(target) = u(idx);
+    hv(target) = v(idx);
+    hints = cat(3, hu, hv);
+end
@@ -0,0 +1,29 @@
+#ifndef _MEX_COMPAT_H_
+#define _MEX_COMPAT_H_
+
+/*
+ * MATLAB api functions used by the kernels. The MEX build (mex defines MATLAB_MEX_FILE) uses the MATLAB
+ * runtime, native builds (proj/) map allocation, assertions and printing to the C runtime.
+ */
+#ifdef MATLAB_MEX_FILE
+#include "mex.h"
+#else
+#include <cassert>
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+
+//like mxMalloc, never returns NULL
+inline void* mxMalloc(size_t n)
+{
+    void* p = malloc(n);
+    if (p == NULL && n > 0)
+        throw std::bad_alloc();
+    return p;
+}
+inline void mxFree(void* p) {free(p);}
+#define mxAssert(expr, msg) assert((expr) && (msg))
+#define mexPrintf printf
+#endif
+
+#endif
@@ -1,11 +1,23 @@
-function [ flow , minC] = ng_sgm( I0, I1 )
+function [ flow , minC, fullSearchCost] = ng_sgm( I0, I1, prevFlow, fullSearchCost )
 % Calculate flow from I0 to I1 using neighbour guided SGM Optical flow Method
 % 
-%   Detailed explanation goes here
+%   prevFlow/fullSearchCost (optional): flow of the previous frame pair of a
+%   sequence and the fullSearchCost returned by the previous call. The
+%   forward warped flow seeds the random hints, which are then drawn from a
+%   small search window around it. The search without prior is run instead
+%   if the mean minC is more than fallbackRatio times the mean minC of the
+%   last search without prior (scene cut, motion prior broken). The
+%   reference is that last cold search and not the previous output, so a
+%   run of warm frames cannot drift it.
+%   fullSearchCost: mean minC of the last search without prior, pass it to
+%   the next call
 % main parameters
     
     P1 = 6;
     P2 = 32;
+    halfSearchWinSize = 1;
+    warmHalfSearchWinSize = 2;  % search window around the prior, doubled in horizontal direction
+    fallbackRatio = 1.5;
     
     % loop pyramidal levels
     row = size(I0, 1);
@@ -14,12 +26,21 @@ function [ flow , minC] = ng_sgm( I0, I1 )
     tic;
     I1gray = rgb2gray(permute(I0, [2, 1, 3]));
     I2gray = rgb2gray(permute(I1, [2, 1, 3]));
-    temporalHints = permute(zeros(row, col), [2, 1, 3]);
     %construct cost volume and SGM
 
-    [minC, flow] = calc_cost_sgm_ng(I1gray, I2gray, temporalHints, 1, 2, 0, P1, P2);
+    warmStart = nargin >= 4 && ~isempty(prevFlow) && ~isempty(fullSearchCost) && fullSearchCost > 0;
+    if warmStart
+        temporalHints = permute(forward_warp_flow(prevFlow(1:row, 1:col, 1:2)), [2, 1, 3]);
+        [minC, flow] = calc_cost_sgm_ng(I1gray, I2gray, temporalHints, warmHalfSearchWinSize, 2, 0, P1, P2);
+        if mean(double(minC(:))) > fallbackRatio * fullSearchCost
+            warmStart = 0;
+        end
+    end
+    if ~warmStart
+        [minC, flow] = calc_cost_sgm_ng(I1gray, I2gray, [], halfSearchWinSize, 2, 0, P1, P2);
+        fullSearchCost = mean(double(minC(:)));
+    end
     flow = permute(flow, [2, 1, 3]);
     toc;
         
 end
-
@@ -0,0 +1,79 @@
+#ifndef __EPI_GEOMETRY_H__
+#define __EPI_GEOMETRY_H__
+#include <opencv2/opencv.hpp>
+#include <vector>
+using namespace cv;
+
+//epipolar geometry of an image pair (see epipolar_geometry.m), pixel coordinates are 0-based
+struct EpiGeometry
+{
+    Matx33d F;              //fundamental matrix, x2' * F * x1 = 0
+    Matx33d E;              //essential matrix, K' * F * K
+    Matx33d R;              //camera rotation from E
+    Matx33d H;              //homography which compensates the rotation, K * R * inv(K)
+    Point2d epipole;        //epipole in image 2
+    bool expansion;         //pixels move away from the epipole (forward motion)
+};
+
+//statistics of the last detect()/estimate() of an EpiGeometryEstimator
+struct EpiGeometryStats
+{
+    int keyPoints1;         //features of image 1/2
+    int keyPoints2;
+    int matches;
+    int inliers;
+    int iterations;         //sampling iterations run, at most maxIterations
+    double detectTime;      //ms of the last detect()
+    double matchTime;       //ms of the matching of estimate()
+    double ransacTime;      //ms of the sampling loop, refit and decomposition of estimate()
+};
+
+/*
+ * fast fundamental matrix stage, replaces SURF + exhaustive matching + LMedS with 10000 trials of
+ * estimate_fundamental_matrix in epipolar_geometry.m:
+ *  - ORB features, the strongest FAST corners of each cell of a gridX x gridY grid so that they cover the image
+ *  - matching only against the features of image 2 within searchRadius, found through a grid of buckets, with
+ *    a ratio test and a mutual best check
+ *  - fixed budget PROSAC: 8-point samples drawn from the best matches first, the sampled subset grows towards
+ *    all matches, early stop at the RANSAC iteration bound for the given confidence. The best model is refit
+ *    to all of its inliers
+ * then E, R, H, the epipole and the expansion/contraction decision as epipolar_geometry.m.
+ */
+class EpiGeometryEstimator
+{
+public:
+    //K: camera intrinsic matrix
+    EpiGeometryEstimator(const Mat& K);
+
+    //features of a gray image
+    void detect(const Mat& gray, std::vector<KeyPoint>& keyPoints, Mat& descriptors);
+
+    //geometry from the features of image 1/2, false on failure
+    bool estimate(const std::vector<KeyPoint>& keyPoints1, const Mat& descriptors1,
+        const std::vector<KeyPoint>& keyPoints2, const Mat& descriptors2, EpiGeometry& g);
+
+    const EpiGeometryStats& stats() const {return stats_;}
+
+    int maxFeatures;        //features per image
+    int gridX;              //detection grid
+    int gridY;
+    float searchRadius;     //maximum feature motion in pixels
+    float ratio;            //best/second best descriptor distance ratio
+    int maxIterations;      //sampling budget
+    double threshold;       //inlier threshold, Sampson distance in pixels
+    double confidence;
+
+private:
+    Matx33d K_;
+    Ptr<ORB> orb_;
+    EpiGeometryStats stats_;
+
+    void match(const std::vector<KeyPoint>& keyPoints1, const Mat& descriptors1,
+        const std::vector<KeyPoint>& keyPoints2, const Mat& descriptors2, std::vector<DMatch>& matches);
+
+    //F of the points with the most inliers, inlier mask of the points
+    bool find_fundamental(const std::vector<Point2f>& points1, const std::vector<Point2f>& points2,
+        Matx33d& F, std::vector<uchar>& inliers);
+};
+
+#endif
@@ -1,14 +1,73 @@
 #ifndef __EPI_SGM_H__
 #define __EPI_SGM_H__
 #include <opencv2/opencv.hpp>
+#include <vector>
+#include "sgm_arena.h"
+#include "census.h"
+#include "epi_geometry.h"
 using namespace cv;
 
+class SgmWorkerPool;
+
 class EpiSGM
 {
 public:
+    //K: camera intrinsic matrix, dMax: number of disparities, vMax: maximum v-z ratio
+    EpiSGM(const Mat& K, int dMax = 64, double vMax = 0.3);
+
     //main routine to caclulate optical flow for image1/image2
-    //return a WXHx2 optical flow vector map
+    //return a WXHx2 optical flow vector map, zero flow if the epipolar geometry estimation fails
     Mat compute(Mat& I1, Mat& I2);
+
+    //compute() on buffers taken from arena, which must hold workspace_size() bytes. flow is only reallocated
+    //if it is not a WxH CV_32FC2 map. pool: optional sgm workers, at least threads - 1.
+    //the feature detection of the geometry estimation allocates inside OpenCV
+    void compute(const Mat& I1, const Mat& I2, Mat& flow, SgmArena& arena, SgmWorkerPool* pool = NULL);
+
+    //arena bytes of compute() for width x height images with the current parameters
+    size_t workspace_size(int width, int height);
+
+    //per frame work of compute(): gray image, census and ORB features. A frame of a sequence is prepared
+    //once and used by the pairs (t-1, t) and (t, t+1)
+    struct Frame
+    {
+        Mat gray;                           //8 bit gray image on an arena buffer
+        CensusWindow::CodeType* census;
+        std::vector<KeyPoint> keyPoints;    //features of the geometry estimation
+        Mat descriptors;
+    };
+
+    //take the buffers of f (frame_size() bytes) from arena, they live until the arena is reset below them
+    void take_frame(Frame& f, SgmArena& arena, int width, int height);
+    size_t frame_size(int width, int height);
+
+    //gray image, census and features of I into f
+    void prepare_frame(const Mat& I, Frame& f);
+
+    //flow of the prepared frames f1/f2, the pair buffers (pair_workspace_size() bytes) are taken after the
+    //frames and released on return
+    void compute(const Frame& f1, const Frame& f2, Mat& flow, SgmArena& arena, SgmWorkerPool* pool = NULL);
+    size_t pair_workspace_size(int width, int height);
+
+    int P1;                 //small/large sgm penalty
+    int P2;
+    int aggHalfWinSize;     //half size of the cost aggregation window
+    int paths;              //number of sgm path directions, 4, 8 or 16
+    int threads;            //sgm threads, the cost rows are streamed with 1 thread
+
+    //feature/matching/sampling parameters of the geometry stage
+    EpiGeometryEstimator& geometry_estimator() {return estimator_;}
+    const EpiGeometryStats& geometry_stats() const {return estimator_.stats();}
+
+private:
+    struct Buffers;
+
+    int dMax_;
+    double vMax_;
+
+    EpiGeometryEstimator estimator_;
+
+    void take_buffers(Buffers& b, SgmArena& arena, int width, int height);
 };
 
-#endif
\ No newline at end of file
+#endif
@@ -2,15 +2,102 @@
 #define __PYD_SGM_H__
 
 #include <opencv2/opencv.hpp>
+#include <vector>
+#include "sgm_arena.h"
+#include "census.h"
 using namespace cv;
 
+class SgmWorkerPool;
+
 class PydSGM
 {
 public:
+    static const int MAX_LEVELS = 16;
+
+    //pydNum: number of pyramid levels (up to MAX_LEVELS), the search range is 2^(pydNum-1) times the search
+    //window of a level
+    PydSGM(int pydNum = 5);
+
     //main routine to caclulate optical flow for image1/image2
     //return a WXHx2 optical flow vector map
     Mat compute(Mat& I1, Mat& I2);
+
+    //compute() on buffers taken from arena, which must hold workspace_size() bytes. flow is only reallocated
+    //if it is not a WxH CV_32FC2 map. pool: optional sgm workers, at least threads - 1
+    void compute(const Mat& I1, const Mat& I2, Mat& flow, SgmArena& arena, SgmWorkerPool* pool = NULL);
+
+    //arena bytes of compute() for width x height images with the current parameters
+    size_t workspace_size(int width, int height);
+
+    //per frame work of compute(): gray image and census pyramids. A frame of a sequence is prepared once
+    //and used by the pairs (t-1, t) and (t, t+1)
+    struct Frame
+    {
+        Mat gray[MAX_LEVELS];               //8 bit gray image pyramid on arena buffers
+        CensusWindow::CodeType* census[MAX_LEVELS];
+    };
+
+    //take the buffers of f (frame_size() bytes) from arena, they live until the arena is reset below them
+    void take_frame(Frame& f, SgmArena& arena, int width, int height);
+    size_t frame_size(int width, int height);
+
+    //gray image and census pyramids of I into f
+    void prepare_frame(const Mat& I, Frame& f);
+
+    //flow of the prepared frames f1/f2, the pair buffers (pair_workspace_size() bytes) are taken after the
+    //frames and released on return.
+    //prior: optional flow of the previous pair of a sequence. Forward warped to f1 it replaces the levels coarser
+    //than warmStartLevel and the finest level searches warmSearchHalfWinSize around it. The full search is run
+    //instead if the mean minC exceeds warmFallbackRatio times the one of the last full search (scene cut, high
+    //minC), see last_warm_start()
+    void compute(const Frame& f1, const Frame& f2, Mat& flow, SgmArena& arena, SgmWorkerPool* pool = NULL,
+        const Mat& prior = Mat());
+    size_t pair_workspace_size(int width, int height);
+
+    int P1;                 //small/large sgm penalty
+    int P2;
+    int aggHalfWinSize;     //half size of the cost aggregation window
+    int verSearchHalfWinSize;   //half search window size in vertical/horizontal direction
+    int horSearchHalfWinSize;
+    int paths;              //number of sgm path directions, 4, 8 or 16
+    int totalPass;
+    int threads;            //sgm threads
+    int warmStartLevel;     //temporal warm start, see compute()
+    int warmSearchHalfWinSize;
+    double warmFallbackRatio;
+
+    //true if the last compute() kept the warm start result
+    bool last_warm_start() const {return lastWarmStart_;}
+
+    //full search compute(f1, f2, flow, arena, pool) in steps, for a scheduler which runs each level as a task:
+    //begin_levels() takes the pair buffers after the frames, compute_level() for level = levels() - 1 down to 0,
+    //end_levels() writes flow and releases the buffers. One pair at a time, no warm start
+    int levels() const {return pydNum_;}
+    void begin_levels(const Frame& f1, SgmArena& arena);
+    void compute_level(const Frame& f1, const Frame& f2, int level, SgmWorkerPool* pool = NULL);
+    void end_levels(const Frame& f1, Mat& flow, SgmArena& arena);
+
+private:
+    struct Buffers;
+
+    int pydNum_;
+    double fullSearchCost_;     //mean minC of the last full search, 0 before the first one
+    bool lastWarmStart_;
+    Buffers* levelBuffers_;     //pair buffers between begin_levels() and end_levels()
+    size_t levelMark_;
+
+    void take_buffers(Buffers& b, SgmArena& arena, int width, int height);
+
+    //level l into b.mvCur from the level above, or from hint (full resolution mv planes) or zero for the first
+    //level of a run
+    void run_level(const Frame& f1, const Frame& f2, Buffers& b, SgmWorkerPool* pool, int l, bool first,
+        const double* hint, int finestRadiusX, int finestRadiusY);
+
+    //coarse to fine levels from startLevel into b.mvCur, starting from hint (full resolution mv planes) or
+    //zero. return the mean minC of the finest level
+    double run_levels(const Frame& f1, const Frame& f2, Buffers& b, SgmWorkerPool* pool, int startLevel,
+        const double* hint, int finestRadiusX, int finestRadiusY);
 };
 
 
-#endif __PYD_SGM_H__
\ No newline at end of file
+#endif
@@ -0,0 +1,65 @@
+#ifndef __SGM_ARENA_H__
+#define __SGM_ARENA_H__
+#include <cstddef>
+#include <new>
+#include <xmmintrin.h>
+
+/*
+ * bump allocator on one 64 byte aligned block. Buffers are carved with take() and released all together
+ * with reset(), nothing is freed on its own. reset(mark) keeps the buffers taken before mark = used(),
+ * e.g. frames which live longer than one image pair. An arena without a block only counts: take() returns
+ * NULL and used() is the size the same sequence of take() calls needs.
+ */
+class SgmArena
+{
+public:
+    static const size_t ALIGNMENT = 64;
+
+    SgmArena() : base_(NULL), capacity_(0), used_(0) {}
+    explicit SgmArena(size_t capacity) : base_(NULL), capacity_(0), used_(0) {reserve(capacity);}
+    ~SgmArena() {_mm_free(base_);}
+
+    //make the block hold at least capacity bytes, a larger block drops all buffers
+    void reserve(size_t capacity)
+    {
+        if (capacity <= capacity_)
+            return;
+        _mm_free(base_);
+        base_ = (char*)_mm_malloc(capacity, ALIGNMENT);
+        if (base_ == NULL)
+            throw std::bad_alloc();
+        capacity_ = capacity;
+        used_ = 0;
+    }
+
+    //n entries of T, ALIGNMENT aligned
+    template <class T>
+    T* take(size_t n)
+    {
+        const size_t offset = align(used_);
+        used_ = offset + n * sizeof(T);
+        if (base_ == NULL)
+            return NULL;
+        if (used_ > capacity_)
+            throw std::bad_alloc();
+        return (T*)(base_ + offset);
+    }
+
+    //release the buffers taken after mark
+    void reset(size_t mark = 0) {used_ = mark;}
+
+    size_t used() const {return align(used_);}
+    size_t capacity() const {return capacity_;}
+
+private:
+    SgmArena(const SgmArena&);
+    SgmArena& operator=(const SgmArena&);
+
+    static size_t align(size_t n) {return (n + ALIGNMENT - 1) / ALIGNMENT * ALIGNMENT;}
+
+    char* base_;
+    size_t capacity_;
+    size_t used_;
+};
+
+#endif
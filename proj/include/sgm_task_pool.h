@@ -0,0 +1,136 @@
+#ifndef __SGM_TASK_POOL_H__
+#define __SGM_TASK_POOL_H__
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/*
+ * work stealing pool for independent tasks, e.g. the pairs and pyramid levels of a batch. Unlike the
+ * SgmWorkerPool of the sgm phases, whose workers must all run at the same time, a task runs on whichever
+ * worker gets it and may submit further tasks. Each worker has its own deque: a task submitted from a worker
+ * goes to the back of that worker's deque and is taken from the back (the continuation of a pair runs next on
+ * the same core, its buffers still in cache), idle workers steal from the front of the others' deques.
+ * Tasks submitted from other threads are spread round robin. A task must not wait for another task.
+ */
+class SgmTaskPool
+{
+public:
+    typedef std::function<void()> Task;
+
+    explicit SgmTaskPool(int workers) : queues_(workers > 0 ? workers : 1), queued_(0), next_(0), stolen_(0), stop_(false)
+    {
+        for (size_t w = 0; w < queues_.size(); w++)
+            workers_.push_back(std::thread(&SgmTaskPool::loop, this, (int)w));
+    }
+
+    //runs the queued tasks before returning
+    ~SgmTaskPool()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stop_ = true;
+        }
+        wake_.notify_all();
+        for (size_t w = 0; w < workers_.size(); w++)
+            workers_[w].join();
+    }
+
+    int workers() const {return (int)workers_.size();}
+
+    //tasks taken from another worker's deque
+    size_t stolen() const {return stolen_.load();}
+
+    void submit(const Task& task)
+    {
+        const int worker = current_worker(this);
+        Queue& q = queues_[worker >= 0 ? worker : next_++ % queues_.size()];
+        {
+            std::lock_guard<std::mutex> lock(q.mutex);
+            q.tasks.push_back(task);
+        }
+
+        //under the mutex so that a worker which found nothing is either still awake or already waiting
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            queued_++;
+        }
+        wake_.notify_one();
+    }
+
+private:
+    SgmTaskPool(const SgmTaskPool&);
+    SgmTaskPool& operator=(const SgmTaskPool&);
+
+    struct Queue
+    {
+        std::mutex mutex;
+        std::deque<Task> tasks;
+    };
+
+    //index of the calling thread among the workers of pool, -1 for other threads
+    static int current_worker(const SgmTaskPool* pool, int set = -2)
+    {
+        static thread_local const SgmTaskPool* owner = NULL;
+        static thread_local int index = -1;
+        if (set != -2) {
+            owner = pool;
+            index = set;
+        }
+        return owner == pool ? index : -1;
+    }
+
+    //the back of the own deque, else the front of the first non empty other deque
+    bool pop(int worker, Task& task)
+    {
+        const int n = (int)queues_.size();
+        for (int i = 0; i < n; i++) {
+            Queue& q = queues_[(worker + i) % n];
+            std::lock_guard<std::mutex> lock(q.mutex);
+            if (q.tasks.empty())
+                continue;
+            if (i == 0) {
+                task = q.tasks.back();
+                q.tasks.pop_back();
+            } else {
+                task = q.tasks.front();
+                q.tasks.pop_front();
+                stolen_++;
+            }
+            queued_--;
+            return true;
+        }
+        return false;
+    }
+
+    void loop(int worker)
+    {
+        current_worker(this, worker);
+        Task task;
+        for (;;) {
+            if (pop(worker, task)) {
+                task();
+                continue;
+            }
+
+            std::unique_lock<std::mutex> lock(mutex_);
+            wake_.wait(lock, [this] {return stop_ || queued_ > 0;});
+            if (stop_ && queued_ <= 0)
+                return;
+        }
+    }
+
+    std::vector<std::thread> workers_;
+    std::vector<Queue> queues_;
+    std::mutex mutex_;
+    std::condition_variable wake_;
+    std::atomic<int> queued_;       //tasks in the deques, briefly negative while a submit() is in flight
+    std::atomic<unsigned> next_;    //round robin deque of the submits from outside
+    std::atomic<size_t> stolen_;
+    bool stop_;
+};
+
+#endif
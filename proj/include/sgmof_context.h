@@ -0,0 +1,143 @@
+#ifndef __SGMOF_CONTEXT_H__
+#define __SGMOF_CONTEXT_H__
+
+#include <opencv2/opencv.hpp>
+#include <atomic>
+#include <functional>
+#include <vector>
+#include "sgm_arena.h"
+#include "epi_sgm.h"
+#include "pyd_sgm.h"
+using namespace cv;
+
+class SgmTaskPool;
+
+//compute_batch(): loads pair i into I1/I2, false if it cannot (the pair is counted as failed)
+typedef std::function<bool(int pair, Mat& I1, Mat& I2)> SgmofPairSource;
+//compute_batch(): receives the flow of pair i, valid until the call returns
+typedef std::function<void(int pair, const Mat& flow)> SgmofFlowSink;
+
+//statistics of a compute_batch()
+struct SgmofBatchStats
+{
+    int pairs;              //pairs computed
+    int failed;             //pairs the source could not load or which threw
+    double time;            //ms of the whole batch
+    double pairsPerSecond;
+    size_t memory;          //arena bytes held during the batch: the in-flight pairs' slots, plus the context's
+                            //own arena if compute()/push() reserved it
+    size_t stolen;          //tasks a worker took from another worker's queue
+};
+
+/*
+ * reusable SGMOF engine for a stream of same sized image pairs (e.g. video). Created once for
+ * (width, height, dMax, mode): all census, cost, path cost and path sum buffers live in one 64 byte
+ * aligned arena, reserved by the first compute()/push() together with the sgm workers. Later calls
+ * do no heap allocation (EpiSGM: apart from the OpenCV feature detection of the geometry estimation).
+ * For video, push() the frames in order: each frame is preprocessed once into one of two frame slots
+ * at the bottom of the arena and reused by the next pair.
+ * For many independent pairs, compute_batch() runs them concurrently on a work stealing pool: the pairs and
+ * (PydSGM) their pyramid levels are separate tasks, so the small coarse levels of one pair overlap the other
+ * pairs instead of leaving the cores idle. Each in-flight pair owns a single threaded slot context, the
+ * concurrency limit bounds the memory to that many arenas.
+ */
+class SgmofContext
+{
+public:
+    //mode: EpiSGM(0)/PydSGM(1). dMax: disparities of EpiSGM, for PydSGM the (2r+1)^2 candidates of the search
+    //window of a level. K: camera intrinsic matrix (EpiSGM), pydNum: pyramid levels (PydSGM)
+    //paths: sgm path directions, 0 for the default of the method. threads: sgm threads, 0 for all cores
+    SgmofContext(int width, int height, int dMax, int mode, const Mat& K = Mat(), int pydNum = 5,
+        int paths = 0, int threads = 0);
+    ~SgmofContext();
+
+    //flow of I1/I2 (width x height) into out, a WxHx2 CV_32FC2 map which is only reallocated if its
+    //size or type differs
+    void compute(const Mat& I1, const Mat& I2, Mat& out);
+
+    //sequence mode: the flow of (previous frame, frame) into out, false (out untouched) for the first
+    //frame of a sequence. compute() starts a new sequence
+    bool push(const Mat& frame, Mat& out);
+
+    //start a new sequence, the next push() has no previous frame
+    void restart() {frames_ = 0;}
+
+    //temporal warm start of push() (PydSGM): the flow of the previous pair seeds the next one with a reduced
+    //search, falling back to the full search when it breaks down. off by default
+    void set_warm_start(bool enable) {warmStart_ = enable;}
+
+    //true if the last flow was kept from a warm start
+    bool last_warm_start() const {return pydSGM_ != NULL && pydSGM_->last_warm_start();}
+
+    //feature/matching/sampling statistics of the last geometry estimation (EpiSGM), NULL for PydSGM
+    const EpiGeometryStats* geometry_stats() const {return epiSGM_ != NULL ? &epiSGM_->geometry_stats() : NULL;}
+
+    //batch mode: the flows of independent image pairs of the context's size, source(i, I1, I2) loads
+    //pair i = 0 .. pairs-1 and sink(i, flow) receives its flow. Both are called from the pool's workers
+    //concurrently and must be thread safe. The pairs are started in order, at most batch concurrency at a time
+    SgmofBatchStats compute_batch(int pairs, const SgmofPairSource& source, const SgmofFlowSink& sink);
+
+    //compute_batch() of the pairs (I1[i], I2[i]) into out[i]
+    SgmofBatchStats compute_batch(const std::vector<Mat>& I1, const std::vector<Mat>& I2, std::vector<Mat>& out);
+
+    //pairs in flight in compute_batch(), each holding memory_footprint() bytes. 0 for the number of threads
+    void set_batch_concurrency(int pairs);
+
+    //bytes of the arena, the working memory of compute(). Reserved by the first compute()/push(), not by
+    //compute_batch()
+    size_t memory_footprint() const {return workspaceSize_;}
+
+    int width() const {return width_;}
+    int height() const {return height_;}
+    int mode() const {return mode_;}
+
+private:
+    SgmofContext(const SgmofContext&);
+    SgmofContext& operator=(const SgmofContext&);
+
+    int width_;
+    int height_;
+    int dMax_;
+    int mode_;
+    Mat K_;
+    int pydNum_;
+    int paths_;
+    int threads_;
+    EpiSGM* epiSGM_;
+    PydSGM* pydSGM_;
+    SgmWorkerPool* pool_;
+    size_t workspaceSize_;          //arena bytes of compute()
+    SgmArena arena_;
+    EpiSGM::Frame epiFrames_[2];    //frame slots below frameMark_ in the arena, frame t uses slot t % 2
+    PydSGM::Frame pydFrames_[2];
+    size_t frameMark_;
+    int frames_;                    //frames pushed since the sequence start
+    bool warmStart_;
+    Mat prevFlow_;                  //flow of the previous pair, the warm start prior
+
+    //batch mode: the task pool with threads_ workers and the single threaded contexts of the in-flight pairs,
+    //created by the first compute_batch()
+    int batchConcurrency_;
+    SgmTaskPool* taskPool_;
+    std::vector<SgmofContext*> batchSlots_;
+
+    //a slot context's pair: its images, flow, the frames still being prepared and whether one failed
+    Mat batchI1_;
+    Mat batchI2_;
+    Mat batchFlow_;
+    std::atomic<int> batchPending_;
+    std::atomic<bool> batchFailed_;
+
+    //arena, frame slots and sgm workers of compute()/push(), once
+    void reserve();
+    void prepare_frame(const Mat& I, int slot);
+    void compute_frames(int slot1, int slot2, Mat& out, bool warmStart = false);
+
+    //tasks of pair on a slot context, done(ok) when the pair finished
+    void run_batch_pair(SgmTaskPool& pool, int pair, const SgmofPairSource& source, const SgmofFlowSink& sink,
+        const std::function<void(bool)>& done);
+    void run_batch_level(SgmTaskPool& pool, int pair, int level, const SgmofFlowSink& sink,
+        const std::function<void(bool)>& done);
+};
+
+#endif
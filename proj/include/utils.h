@@ -35,6 +35,14 @@ public:
 		memcpy(data_, data, width*height * 3 * sizeof(float));
 	}
 
+	// construct flow field from a CV_32FC2 flow map (u, v), all pixels valid
+	FlowImage(const Mat& flow) {
+		data_ = 0;
+		width_ = 0;
+		height_ = 0;
+		assign(flow);
+	}
+
 	// construct empty (= all pixels invalid) flow field of given width / height
 	FlowImage(const int32_t width, const int32_t height) : width_(width), height_(height) {
 		data_ = (float*)malloc(width*height * 3 * sizeof(float));
@@ -46,6 +54,25 @@ public:
 	virtual ~FlowImage() {
 		if (data_) { free(data_); data_ = 0; }
 	}
+
+	// set flow field to a CV_32FC2 flow map (u, v), all pixels valid. keeps the buffer if the size does not change
+	void assign(const Mat& flow) {
+		if (!data_ || width_ != flow.cols || height_ != flow.rows) {
+			if (data_) free(data_);
+			width_ = flow.cols;
+			height_ = flow.rows;
+			data_ = (float*)malloc(width_*height_ * 3 * sizeof(float));
+		}
+		for (int32_t v = 0; v < height_; v++) {
+			const Vec2f* src = flow.ptr<Vec2f>(v);
+			for (int32_t u = 0; u < width_; u++) {
+				setFlowU(u, v, src[u][0]);
+				setFlowV(u, v, src[u][1]);
+				setValid(u, v, true);
+			}
+		}
+	}
+
 	// read flow field from png file
 	void read(const std::string file_name) {
 		if (data_) { free(data_); data_ = 0; }
@@ -124,7 +151,7 @@ public:
 		data_[3 * (v*width_ + u) + 2] = valid ? 1 : 0;
 	}
 
-	Mat FlowImage::errorImage(FlowImage &F_noc, FlowImage &F_occ, bool log_colors = false);
+	Mat errorImage(FlowImage &F_noc, FlowImage &F_occ, bool log_colors = false);
 
 	// direct access to private variables
 	float*  data() { return data_; }
@@ -185,5 +212,23 @@ private:
 //read KITTI calibration file, return the projection matrix for cam0
 Mat read_calib_file(string fileName, bool isKITTI2015 = false);
 
+//frame file names of a sequence: the lines of an image list file, or the existing files of a printf pattern
+//(e.g. img_%06d.png) numbered from first on
+std::vector<String> read_sequence(const String& spec, int first = 0);
+
+//file name of frame index, pattern is a printf pattern or a plain name which gets _%06d before its extension
+String frame_file_name(const String& pattern, int index);
+
+//image pairs of a batch list file, one pair per line: image1 image2 [output flow file]. output[i] is empty if
+//the line has no output file
+void read_batch_list(const String& fileName, std::vector<String>& image1, std::vector<String>& image2,
+	std::vector<String>& output);
+
+//8 bit single channel copy of a gray/BGR/BGRA image, continuous as the SGM kernels expect
+Mat to_gray(const Mat& I);
+
+//to_gray() into gray, which keeps its buffer if it already has the size of I and type CV_8U
+void to_gray(const Mat& I, Mat& gray);
+
 
 #endif
\ No newline at end of file
@@ -0,0 +1,352 @@
+#include "epi_geometry.h"
+#include <nmmintrin.h>
+#include <algorithm>
+#include <climits>
+#include <cfloat>
+#include <cstring>
+
+EpiGeometryEstimator::EpiGeometryEstimator(const Mat& K)
+    : maxFeatures(2000), gridX(8), gridY(4), searchRadius(160), ratio(0.8f), maxIterations(500), threshold(1.0),
+    confidence(0.999), orb_(ORB::create(2 * 2000))
+{
+    Mat Kd;
+    K.convertTo(Kd, CV_64F);
+    K_ = Matx33d(Kd.ptr<double>());
+    stats_ = EpiGeometryStats();
+}
+
+void EpiGeometryEstimator::detect(const Mat& gray, std::vector<KeyPoint>& keyPoints, Mat& descriptors)
+{
+    int64 start = getTickCount();
+
+    //twice the features, then the strongest ones of each grid cell
+    orb_->setMaxFeatures(2 * maxFeatures);
+    std::vector<KeyPoint> candidates;
+    orb_->detect(gray, candidates);
+    std::sort(candidates.begin(), candidates.end(),
+        [](const KeyPoint& a, const KeyPoint& b) {return a.response > b.response;});
+
+    const int perCell = std::max(1, maxFeatures / (gridX * gridY));
+    std::vector<int> cellCount(gridX * gridY, 0);
+    keyPoints.clear();
+    for (size_t i = 0; i < candidates.size(); i++) {
+        const int cx = std::min(gridX - 1, (int)(candidates[i].pt.x * gridX / gray.cols));
+        const int cy = std::min(gridY - 1, (int)(candidates[i].pt.y * gridY / gray.rows));
+        if (cellCount[cy * gridX + cx]++ < perCell)
+            keyPoints.push_back(candidates[i]);
+    }
+    orb_->compute(gray, keyPoints, descriptors);
+
+    stats_.detectTime = 1000.0 * (getTickCount() - start) / getTickFrequency();
+}
+
+//features sorted into square buckets of the search radius
+struct FeatureBuckets
+{
+    int cellsX;
+    int cellsY;
+    float cellSize;
+    std::vector<int> cellStart;     //features of cell c: index[cellStart[c] .. cellStart[c+1])
+    std::vector<int> index;
+
+    FeatureBuckets(const std::vector<KeyPoint>& keyPoints, float radius) : cellSize(std::max(radius, 1.0f))
+    {
+        float maxX = 0, maxY = 0;
+        for (size_t i = 0; i < keyPoints.size(); i++) {
+            maxX = std::max(maxX, keyPoints[i].pt.x);
+            maxY = std::max(maxY, keyPoints[i].pt.y);
+        }
+        cellsX = (int)(maxX / cellSize) + 1;
+        cellsY = (int)(maxY / cellSize) + 1;
+
+        //counting sort by cell
+        cellStart.assign(cellsX * cellsY + 1, 0);
+        for (size_t i = 0; i < keyPoints.size(); i++)
+            cellStart[cell(keyPoints[i].pt) + 1]++;
+        for (int c = 0; c < cellsX * cellsY; c++)
+            cellStart[c + 1] += cellStart[c];
+        index.resize(keyPoints.size());
+        std::vector<int> fill(cellStart.begin(), cellStart.end() - 1);
+        for (size_t i = 0; i < keyPoints.size(); i++)
+            index[fill[cell(keyPoints[i].pt)]++] = (int)i;
+    }
+
+    int cell(const Point2f& pt) const
+    {
+        return std::min(cellsY - 1, (int)(pt.y / cellSize)) * cellsX + std::min(cellsX - 1, (int)(pt.x / cellSize));
+    }
+};
+
+static int hamming_distance(const uchar* a, const uchar* b, int bytes)
+{
+    int dist = 0;
+    int i = 0;
+    for (; i + 8 <= bytes; i += 8) {
+        unsigned long long wa, wb;
+        memcpy(&wa, a + i, 8);
+        memcpy(&wb, b + i, 8);
+        dist += (int)_mm_popcnt_u64(wa ^ wb);
+    }
+    for (; i < bytes; i++)
+        dist += (int)_mm_popcnt_u32(a[i] ^ b[i]);
+    return dist;
+}
+
+//best and second best feature of buckets within radius of pt, -1 if there is none
+static int nearest_feature(const Point2f& pt, const uchar* descriptor, const std::vector<KeyPoint>& keyPoints,
+    const Mat& descriptors, const FeatureBuckets& buckets, float radius, int& bestDist, int& secondDist)
+{
+    const int cx = std::min(buckets.cellsX - 1, (int)(pt.x / buckets.cellSize));
+    const int cy = std::min(buckets.cellsY - 1, (int)(pt.y / buckets.cellSize));
+    int best = -1;
+    bestDist = secondDist = INT_MAX;
+    for (int y = std::max(0, cy - 1); y <= std::min(buckets.cellsY - 1, cy + 1); y++) {
+        for (int x = std::max(0, cx - 1); x <= std::min(buckets.cellsX - 1, cx + 1); x++) {
+            const int c = y * buckets.cellsX + x;
+            for (int k = buckets.cellStart[c]; k < buckets.cellStart[c + 1]; k++) {
+                const int j = buckets.index[k];
+                const Point2f d = keyPoints[j].pt - pt;
+                if (d.x * d.x + d.y * d.y > radius * radius)
+                    continue;
+
+                const int dist = hamming_distance(descriptor, descriptors.ptr<uchar>(j), descriptors.cols);
+                if (dist < bestDist) {
+                    secondDist = bestDist;
+                    bestDist = dist;
+                    best = j;
+                } else if (dist < secondDist) {
+                    secondDist = dist;
+                }
+            }
+        }
+    }
+    return best;
+}
+
+void EpiGeometryEstimator::match(const std::vector<KeyPoint>& keyPoints1, const Mat& descriptors1,
+    const std::vector<KeyPoint>& keyPoints2, const Mat& descriptors2, std::vector<DMatch>& matches)
+{
+    FeatureBuckets buckets1(keyPoints1, searchRadius);
+    FeatureBuckets buckets2(keyPoints2, searchRadius);
+
+    matches.clear();
+    for (size_t i = 0; i < keyPoints1.size(); i++) {
+        int bestDist, secondDist;
+        const int j = nearest_feature(keyPoints1[i].pt, descriptors1.ptr<uchar>((int)i), keyPoints2, descriptors2,
+            buckets2, searchRadius, bestDist, secondDist);
+        if (j < 0 || (secondDist != INT_MAX && bestDist >= ratio * secondDist))
+            continue;
+
+        //mutual best
+        int backDist, backSecondDist;
+        if (nearest_feature(keyPoints2[j].pt, descriptors2.ptr<uchar>(j), keyPoints1, descriptors1,
+            buckets1, searchRadius, backDist, backSecondDist) != (int)i)
+            continue;
+
+        matches.push_back(DMatch((int)i, j, (float)bestDist));
+    }
+
+    //best matches first, the order of the progressive sampling
+    std::stable_sort(matches.begin(), matches.end(),
+        [](const DMatch& a, const DMatch& b) {return a.distance < b.distance;});
+}
+
+//translation to the centroid and scaling to a mean distance of sqrt(2) (Hartley normalization)
+static Matx33d normalization(const std::vector<Point2f>& points)
+{
+    double cx = 0, cy = 0;
+    for (size_t i = 0; i < points.size(); i++) {
+        cx += points[i].x;
+        cy += points[i].y;
+    }
+    cx /= points.size();
+    cy /= points.size();
+
+    double meanDist = 0;
+    for (size_t i = 0; i < points.size(); i++)
+        meanDist += std::sqrt((points[i].x - cx) * (points[i].x - cx) + (points[i].y - cy) * (points[i].y - cy));
+    meanDist /= points.size();
+    const double s = meanDist > 0 ? std::sqrt(2.0) / meanDist : 1.0;
+
+    return Matx33d(s, 0, -s * cx, 0, s, -s * cy, 0, 0, 1);
+}
+
+//8-point least squares F of the normalized points idx[0 .. n-1], rank 2 enforced
+static Matx33d fit_fundamental(const std::vector<Point2d>& p1, const std::vector<Point2d>& p2, const int* idx, int n)
+{
+    Matx<double, 9, 9> AtA = Matx<double, 9, 9>::zeros();
+    for (int k = 0; k < n; k++) {
+        const Point2d& a = p1[idx[k]];
+        const Point2d& b = p2[idx[k]];
+        const double row[9] = { b.x * a.x, b.x * a.y, b.x, b.y * a.x, b.y * a.y, b.y, a.x, a.y, 1 };
+        for (int r = 0; r < 9; r++)
+            for (int c = 0; c < 9; c++)
+                AtA(r, c) += row[r] * row[c];
+    }
+
+    //null vector: right singular vector of the smallest singular value
+    Mat w, u, vt;
+    SVD::compute(Mat(AtA), w, u, vt);
+    Matx33d F(vt.ptr<double>(8));
+
+    SVD::compute(Mat(F), w, u, vt, SVD::FULL_UV);
+    const Matx33d W(w.at<double>(0), 0, 0, 0, w.at<double>(1), 0, 0, 0, 0);
+    return Matx33d(u.ptr<double>()) * W * Matx33d(vt.ptr<double>());
+}
+
+//squared Sampson distance of a match to F
+static double sampson_distance(const Matx33d& F, const Point2f& a, const Point2f& b)
+{
+    const Vec3d x1(a.x, a.y, 1), x2(b.x, b.y, 1);
+    const Vec3d Fx1 = F * x1;
+    const Vec3d Ftx2 = F.t() * x2;
+    const double e = x2.dot(Fx1);
+    const double den = Fx1[0] * Fx1[0] + Fx1[1] * Fx1[1] + Ftx2[0] * Ftx2[0] + Ftx2[1] * Ftx2[1];
+    return den > 0 ? e * e / den : DBL_MAX;
+}
+
+static int count_inliers(const Matx33d& F, const std::vector<Point2f>& points1, const std::vector<Point2f>& points2,
+    double threshold, std::vector<uchar>* inliers = NULL)
+{
+    int count = 0;
+    for (size_t i = 0; i < points1.size(); i++) {
+        const bool inlier = sampson_distance(F, points1[i], points2[i]) < threshold * threshold;
+        if (inliers != NULL)
+            (*inliers)[i] = inlier;
+        count += inlier;
+    }
+    return count;
+}
+
+bool EpiGeometryEstimator::find_fundamental(const std::vector<Point2f>& points1, const std::vector<Point2f>& points2,
+    Matx33d& F, std::vector<uchar>& inliers)
+{
+    const int N = (int)points1.size();
+    const int sampleSize = 8;
+    if (N < sampleSize)
+        return false;
+
+    const Matx33d T1 = normalization(points1);
+    const Matx33d T2 = normalization(points2);
+    std::vector<Point2d> p1(N), p2(N);
+    for (int i = 0; i < N; i++) {
+        p1[i] = Point2d(T1(0, 0) * points1[i].x + T1(0, 2), T1(1, 1) * points1[i].y + T1(1, 2));
+        p2[i] = Point2d(T2(0, 0) * points2[i].x + T2(0, 2), T2(1, 1) * points2[i].y + T2(1, 2));
+    }
+
+    //fixed seed, the same pair gives the same geometry
+    RNG rng(0x5eed);
+    int bestCount = 0;
+    double bound = maxIterations;
+    int it = 0;
+    for (; it < maxIterations && it < bound; it++) {
+        //progressive sampling: the subset grows from the best matches to all of them over half the budget
+        const int n = std::min(N, sampleSize + (int)((double)it * (N - sampleSize) / std::max(1, maxIterations / 2)));
+        int sample[sampleSize];
+        for (int k = 0; k < sampleSize; k++) {
+            bool unique;
+            do {
+                sample[k] = rng.uniform(0, n);
+                unique = std::find(sample, sample + k, sample[k]) == sample + k;
+            } while (!unique);
+        }
+
+        const Matx33d Fs = T2.t() * fit_fundamental(p1, p2, sample, sampleSize) * T1;
+        const int count = count_inliers(Fs, points1, points2, threshold);
+        if (count > bestCount) {
+            bestCount = count;
+            F = Fs;
+
+            //iterations for the confidence at the current inlier ratio
+            const double w = std::pow((double)count / N, sampleSize);
+            bound = w < 1 ? std::log(1 - confidence) / std::log(1 - w) : 0;
+        }
+    }
+    stats_.iterations = it;
+    if (bestCount < sampleSize)
+        return false;
+
+    //refit to all inliers
+    inliers.assign(N, 0);
+    count_inliers(F, points1, points2, threshold, &inliers);
+    std::vector<int> inlierIdx;
+    for (int i = 0; i < N; i++)
+        if (inliers[i])
+            inlierIdx.push_back(i);
+    const Matx33d Fr = T2.t() * fit_fundamental(p1, p2, &inlierIdx[0], (int)inlierIdx.size()) * T1;
+    if (count_inliers(Fr, points1, points2, threshold) >= bestCount) {
+        F = Fr;
+        bestCount = count_inliers(F, points1, points2, threshold, &inliers);
+    }
+    stats_.inliers = bestCount;
+    return true;
+}
+
+bool EpiGeometryEstimator::estimate(const std::vector<KeyPoint>& keyPoints1, const Mat& descriptors1,
+    const std::vector<KeyPoint>& keyPoints2, const Mat& descriptors2, EpiGeometry& g)
+{
+    stats_.keyPoints1 = (int)keyPoints1.size();
+    stats_.keyPoints2 = (int)keyPoints2.size();
+    stats_.matches = stats_.inliers = stats_.iterations = 0;
+    stats_.matchTime = stats_.ransacTime = 0;
+    if (descriptors1.empty() || descriptors2.empty())
+        return false;
+
+    int64 start = getTickCount();
+    std::vector<DMatch> matches;
+    match(keyPoints1, descriptors1, keyPoints2, descriptors2, matches);
+    stats_.matches = (int)matches.size();
+    stats_.matchTime = 1000.0 * (getTickCount() - start) / getTickFrequency();
+
+    start = getTickCount();
+    std::vector<Point2f> points1, points2;
+    for (size_t i = 0; i < matches.size(); i++) {
+        points1.push_back(keyPoints1[matches[i].queryIdx].pt);
+        points2.push_back(keyPoints2[matches[i].trainIdx].pt);
+    }
+
+    std::vector<uchar> inliers;
+    const bool found = find_fundamental(points1, points2, g.F, inliers);
+    stats_.ransacTime = 1000.0 * (getTickCount() - start) / getTickFrequency();
+    if (!found)
+        return false;
+
+    //epipole in I2, F' * e' = 0
+    Mat epiH;
+    SVD::solveZ(Mat(g.F.t()), epiH);
+    if (std::abs(epiH.at<double>(2)) < 1e-12)
+        return false;
+    g.epipole = Point2d(epiH.at<double>(0) / epiH.at<double>(2), epiH.at<double>(1) / epiH.at<double>(2));
+
+    //from F and K, recover E and the rotation
+    g.E = K_.t() * g.F * K_;
+    Mat w, U, Vt;
+    SVD::compute(Mat(g.E), w, U, Vt, SVD::FULL_UV);
+    const Matx33d W(0, -1, 0, 1, 0, 0, 0, 0, 1);
+    Matx33d R1 = Matx33d(U.ptr<double>()) * W * Matx33d(Vt.ptr<double>());
+    Matx33d R2 = Matx33d(U.ptr<double>()) * W.t() * Matx33d(Vt.ptr<double>());
+    if (determinant(R1) < 0) {
+        R1 = -R1;
+        R2 = -R2;
+    }
+    g.R = R1(0, 0) > 0 && R1(1, 1) > 0 && R1(2, 2) > 0 ? R1 : R2;
+    g.H = K_ * g.R * K_.inv();
+
+    //detect direction (expansion or contraction)
+    int expansion = 0;
+    int inlierNum = 0;
+    for (size_t i = 0; i < points1.size(); i++) {
+        if (!inliers[i])
+            continue;
+
+        Vec3d pr = g.H * Vec3d(points1[i].x, points1[i].y, 1);
+        double dist1 = std::hypot(pr[0] / pr[2] - g.epipole.x, pr[1] / pr[2] - g.epipole.y);
+        double dist2 = std::hypot(points2[i].x - g.epipole.x, points2[i].y - g.epipole.y);
+        if (dist2 > dist1)
+            expansion++;
+        inlierNum++;
+    }
+    g.expansion = 2 * expansion > inlierNum;
+
+    return inlierNum >= 8;
+}
@@ -1,6 +1,179 @@
 #include "epi_sgm.h"
+#include "utils.h"
+#include "sgm_epipolar.h"
+
+EpiSGM::EpiSGM(const Mat& K, int dMax, double vMax)
+    : P1(6), P2(64), aggHalfWinSize(2), paths(4), threads(sgm_default_threads()), dMax_(dMax), vMax_(vMax),
+    estimator_(K)
+{
+}
+
+//kernel form of the geometry, evaluated per row instead of per pixel planes
+static void epi_geometry_params(const EpiGeometry& g, EpiGeometryParams& p)
+{
+    for (int r = 0; r < 3; r++) {
+        for (int c = 0; c < 3; c++) {
+            p.H[r*3 + c] = g.H(r, c);
+            p.F[r*3 + c] = g.F(r, c);
+        }
+    }
+    p.epipole[0] = g.epipole.x;
+    p.epipole[1] = g.epipole.y;
+    p.expansion = g.expansion;
+}
+
+//buffers of compute(), taken from the arena
+struct EpiSGM::Buffers
+{
+    double* vzInd;              //per disparity vz-index table
+    void* costRows;             //StreamCostRows buffer (1 thread)
+    CostType* C;                //aggregated cost volume, matching costs and box filter sums (threads > 1)
+    CostType* Ctmp;
+    unsigned* aggSum;
+    PathSum* Sp;
+    PathCost* L;
+    EpiPath::Workspace* ws;
+    unsigned* bestD;
+    unsigned* minC;
+};
+
+void EpiSGM::take_buffers(Buffers& b, SgmArena& arena, int width, int height)
+{
+    const size_t planeSize = (size_t)width * height;
+    const size_t volumeSize = planeSize * dMax_;
+    const SgmAggregateParams params = { width, height, dMax_, 2, paths, threads, NULL };
+
+    b.vzInd = arena.take<double>(dMax_);
+    if (threads == 1) {
+        b.costRows = arena.take<char>(StreamCostRows::buffer_size(width, dMax_, aggHalfWinSize));
+        b.C = b.Ctmp = NULL;
+        b.aggSum = NULL;
+    } else {
+        b.costRows = NULL;
+        b.C = arena.take<CostType>(volumeSize + SGM_SIMD_WIDTH); //sgm_step reads whole simd blocks
+        b.Ctmp = arena.take<CostType>(volumeSize);
+        b.aggSum = arena.take<unsigned>((size_t)(width + 1) * dMax_);
+    }
+    b.Sp = arena.take<PathSum>(volumeSize);
+    b.L = arena.take<PathCost>(sgm_aggregate_buffer_size(params));
+    b.ws = arena.take<EpiPath::Workspace>(threads);
+    b.bestD = arena.take<unsigned>(planeSize);
+    b.minC = arena.take<unsigned>(planeSize);
+}
+
+size_t EpiSGM::pair_workspace_size(int width, int height)
+{
+    SgmArena counter;
+    Buffers b;
+    take_buffers(b, counter, width, height);
+    return counter.used();
+}
+
+void EpiSGM::take_frame(Frame& f, SgmArena& arena, int width, int height)
+{
+    const size_t planeSize = (size_t)width * height;
+
+    f.gray = Mat(height, width, CV_8U, arena.take<PixelType>(planeSize));
+    f.census = arena.take<CensusWindow::CodeType>(planeSize);
+}
+
+size_t EpiSGM::frame_size(int width, int height)
+{
+    SgmArena counter;
+    Frame f;
+    take_frame(f, counter, width, height);
+    return counter.used();
+}
+
+size_t EpiSGM::workspace_size(int width, int height)
+{
+    return 2 * frame_size(width, height) + pair_workspace_size(width, height);
+}
 
 Mat EpiSGM::compute(Mat& I1, Mat& I2)
 {
-    return Mat::zeros(I1.rows, I1.cols, CV_32FC2);
+    SgmArena arena(workspace_size(I1.cols, I1.rows));
+    Mat flow;
+    compute(I1, I2, flow, arena);
+    return flow;
+}
+
+void EpiSGM::prepare_frame(const Mat& I, Frame& f)
+{
+    to_gray(I, f.gray);
+    census_transform<CensusWindow>(f.gray.ptr<PixelType>(), f.census, f.gray.cols, f.gray.rows);
+    estimator_.detect(f.gray, f.keyPoints, f.descriptors);
+}
+
+void EpiSGM::compute(const Mat& I1, const Mat& I2, Mat& flow, SgmArena& arena, SgmWorkerPool* pool)
+{
+    arena.reset();
+    Frame f1, f2;
+    take_frame(f1, arena, I1.cols, I1.rows);
+    take_frame(f2, arena, I2.cols, I2.rows);
+    prepare_frame(I1, f1);
+    prepare_frame(I2, f2);
+    compute(f1, f2, flow, arena, pool);
+}
+
+void EpiSGM::compute(const Frame& f1, const Frame& f2, Mat& flow, SgmArena& arena, SgmWorkerPool* pool)
+{
+    const int width = f1.gray.cols;
+    const int height = f1.gray.rows;
+    PixelType* gray1 = f1.gray.data;     //the frame is not modified, sgm_run only reads it
+
+    const size_t mark = arena.used();
+    Buffers b;
+    take_buffers(b, arena, width, height);
+    flow.create(height, width, CV_32FC2);
+
+    EpiGeometry g;
+    if (!estimator_.estimate(f1.keyPoints, f1.descriptors, f2.keyPoints, f2.descriptors, g)) {
+        std::cout << "epipolar geometry estimation failed" << std::endl;
+        flow.setTo(Scalar::all(0));
+        arena.reset(mark);
+        return;
+    }
+
+    EpiGeometryParams geometry;
+    epi_geometry_params(g, geometry);
+    epi_vzind_table(b.vzInd, dMax_, vMax_);
+
+    EpiCostParams costParams = { f1.census, f2.census, width, height, dMax_, vMax_, NULL, NULL, NULL, &geometry, b.vzInd };
+
+    const bool subPixelRefine = true;
+    if (threads == 1) {
+        //cost rows are produced just ahead of the sgm wavefront
+        StreamCostRows costRows(costParams, aggHalfWinSize, b.costRows);
+        sgm_run(b.bestD, b.minC, gray1, costRows, width, height, dMax_,
+            P1, P2, subPixelRefine, 1, paths, b.L, b.ws, b.Sp);
+    } else {
+        calc_cost(b.C, costParams, aggHalfWinSize, b.Ctmp, b.aggSum);
+
+        VolumeCostRows costRows = { b.C, width*dMax_ };
+        sgm_run(b.bestD, b.minC, gray1, costRows, width, height, dMax_,
+            P1, P2, subPixelRefine, threads, paths, b.L, b.ws, b.Sp, pool);
+    }
+#ifdef USE_VZIND
+    convert_vzInd_to_disp(b.bestD, width, height, geometry, vMax_, dMax_ + 1);
+#endif
+
+    //flow = disparity along the epipolar direction + rotation flow (zero disparity position - pixel)
+    float posX[EPI_GEOMETRY_CHUNK], posY[EPI_GEOMETRY_CHUNK];
+    float dirX[EPI_GEOMETRY_CHUNK], dirY[EPI_GEOMETRY_CHUNK], offset[EPI_GEOMETRY_CHUNK];
+    for (int y = 0; y < height; y++) {
+        Vec2f* dst = flow.ptr<Vec2f>(y);
+        for (int x0 = 0; x0 < width; x0 += EPI_GEOMETRY_CHUNK) {
+            const int n = std::min(EPI_GEOMETRY_CHUNK, width - x0);
+            epi_geometry_row(geometry, x0, n, y, posX, posY, dirX, dirY, offset);
+            for (int i = 0; i < n; i++) {
+                const int x = x0 + i;
+                const float d = float(b.bestD[(size_t)y*width + x]) / (1 << SUBPIXEL_PRECISION);
+                dst[x][0] = d * dirX[i] + posX[i] - x;
+                dst[x][1] = d * dirY[i] + posY[i] - y;
+            }
+        }
+    }
+
+    arena.reset(mark);
 }
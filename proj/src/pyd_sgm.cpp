@@ -1,6 +1,273 @@
 #include "pyd_sgm.h"
+#include "utils.h"
+#include "sgm_pyramidal.h"
+
+PydSGM::PydSGM(int pydNum)
+    : P1(6), P2(32), aggHalfWinSize(2), verSearchHalfWinSize(5), horSearchHalfWinSize(5), paths(8), totalPass(2),
+    threads(sgm_default_threads()), warmStartLevel(1), warmSearchHalfWinSize(2), warmFallbackRatio(1.5),
+    pydNum_(std::max(1, pydNum < MAX_LEVELS ? pydNum : (int)MAX_LEVELS)), fullSearchCost_(0), lastWarmStart_(false),
+    levelBuffers_(NULL), levelMark_(0)
+{
+}
+
+//buffers of compute(), taken from the arena. all levels share the buffers of the finest one
+struct PydSGM::Buffers
+{
+    unsigned* bestD;
+    unsigned* minC;
+    double* mvSub;
+    double* mvPre;              //previous level's mv, upscaled to the current level
+    double* mvCur;
+    double* hint;               //forward warped prior
+    float* hintMagnitude;
+    char* level;                //PydLevelBuffers block
+};
+
+void PydSGM::take_buffers(Buffers& b, SgmArena& arena, int width, int height)
+{
+    const size_t planeSize = (size_t)width * height;
+
+    b.bestD = arena.take<unsigned>(planeSize);
+    b.minC = arena.take<unsigned>(planeSize);
+    b.mvSub = arena.take<double>(2 * planeSize);
+    b.mvPre = arena.take<double>(2 * planeSize);
+    b.mvCur = arena.take<double>(2 * planeSize);
+    b.hint = arena.take<double>(2 * planeSize);
+    b.hintMagnitude = arena.take<float>(planeSize);
+    b.level = arena.take<char>(pyd_level_buffers_size(width, height, aggHalfWinSize,
+        horSearchHalfWinSize, verSearchHalfWinSize, paths, totalPass, threads));
+}
+
+size_t PydSGM::pair_workspace_size(int width, int height)
+{
+    SgmArena counter;
+    Buffers b;
+    counter.take<Buffers>(1);   //begin_levels() keeps the buffer pointers in the arena
+    take_buffers(b, counter, width, height);
+    return counter.used();
+}
+
+void PydSGM::take_frame(Frame& f, SgmArena& arena, int width, int height)
+{
+    //pyrDown halves the size, rounding up as impyramid
+    for (int l = 0, w = width, h = height; l < pydNum_; l++, w = (w + 1) / 2, h = (h + 1) / 2) {
+        f.gray[l] = Mat(h, w, CV_8U, arena.take<PixelType>((size_t)w * h));
+        f.census[l] = arena.take<CensusWindow::CodeType>((size_t)w * h);
+    }
+}
+
+size_t PydSGM::frame_size(int width, int height)
+{
+    SgmArena counter;
+    Frame f;
+    take_frame(f, counter, width, height);
+    return counter.used();
+}
+
+size_t PydSGM::workspace_size(int width, int height)
+{
+    return 2 * frame_size(width, height) + pair_workspace_size(width, height);
+}
 
 Mat PydSGM::compute(Mat& I1, Mat& I2)
 {
-    return Mat::zeros(I1.rows, I1.cols, CV_32FC2);
+    SgmArena arena(workspace_size(I1.cols, I1.rows));
+    Mat flow;
+    compute(I1, I2, flow, arena);
+    return flow;
+}
+
+void PydSGM::prepare_frame(const Mat& I, Frame& f)
+{
+    //image pyramid, impyramid(.., 'reduce') of pyramidal_sgm.m
+    to_gray(I, f.gray[0]);
+    for (int l = 1; l < pydNum_; l++)
+        pyrDown(f.gray[l - 1], f.gray[l], f.gray[l].size());
+
+    for (int l = 0; l < pydNum_; l++)
+        census_transform<CensusWindow>(f.gray[l].ptr<PixelType>(), f.census[l], f.gray[l].cols, f.gray[l].rows);
+}
+
+void PydSGM::compute(const Mat& I1, const Mat& I2, Mat& flow, SgmArena& arena, SgmWorkerPool* pool)
+{
+    arena.reset();
+    Frame f1, f2;
+    take_frame(f1, arena, I1.cols, I1.rows);
+    take_frame(f2, arena, I2.cols, I2.rows);
+    prepare_frame(I1, f1);
+    prepare_frame(I2, f2);
+    compute(f1, f2, flow, arena, pool);
+}
+
+//flow of the pair (t-1, t) moved to frame t assuming constant motion: of the pixels landing on the same position
+//the larger motion (the closer object) wins, positions nothing lands on keep their own flow
+static void forward_warp_flow(const Mat& flow, double* hint, float* magnitude)
+{
+    const int width = flow.cols;
+    const int height = flow.rows;
+    const size_t planeSize = (size_t)width * height;
+
+    for (int y = 0; y < height; y++) {
+        const Vec2f* src = flow.ptr<Vec2f>(y);
+        for (int x = 0; x < width; x++) {
+            hint[(size_t)y*width + x] = src[x][0];
+            hint[planeSize + (size_t)y*width + x] = src[x][1];
+            magnitude[(size_t)y*width + x] = -1;
+        }
+    }
+
+    for (int y = 0; y < height; y++) {
+        const Vec2f* src = flow.ptr<Vec2f>(y);
+        for (int x = 0; x < width; x++) {
+            const int tx = cvRound(x + src[x][0]);
+            const int ty = cvRound(y + src[x][1]);
+            if (tx < 0 || tx >= width || ty < 0 || ty >= height)
+                continue;
+
+            const size_t dst = (size_t)ty*width + tx;
+            const float mag = src[x][0] * src[x][0] + src[x][1] * src[x][1];
+            if (mag > magnitude[dst]) {
+                magnitude[dst] = mag;
+                hint[dst] = src[x][0];
+                hint[planeSize + dst] = src[x][1];
+            }
+        }
+    }
+}
+
+void PydSGM::run_level(const Frame& f1, const Frame& f2, Buffers& b, SgmWorkerPool* pool, int l, bool first,
+    const double* hint, int finestRadiusX, int finestRadiusY)
+{
+    const int width = f1.gray[0].cols;
+    const int height = f1.gray[0].rows;
+    const size_t planeSize = (size_t)width * height;
+
+    double* mvPre = b.mvPre;
+    double* mvCur = b.mvCur;
+    double* mvSub = b.mvSub;
+    const int curWidth = first ? 0 : f1.gray[l + 1].cols;
+    const int w = f1.gray[l].cols;
+    const int h = f1.gray[l].rows;
+    const size_t levelSize = (size_t)w * h;
+    const int radiusX = l == 0 ? finestRadiusX : horSearchHalfWinSize;
+    const int radiusY = l == 0 ? finestRadiusY : verSearchHalfWinSize;
+    const int searchWinY = 2 * radiusY + 1;
+
+    //all levels run on the buffers of the finest one, laid out for the search window of the level
+    PydLevelBuffers level;
+    pyd_level_buffers_layout(level, b.level, width, height, aggHalfWinSize, radiusX, radiusY,
+        paths, totalPass, threads);
+    level.pool = pool;
+
+    if (curWidth == 0 && hint != NULL) {
+        //the hint sampled at the level's pixels, in the level's scale
+        const int scale = 1 << l;
+        for (int y = 0; y < h; y++) {
+            for (int x = 0; x < w; x++) {
+                const size_t src = (size_t)std::min(y * scale, height - 1) * width + std::min(x * scale, width - 1);
+                mvPre[(size_t)y*w + x] = hint[src] / scale;
+                mvPre[levelSize + (size_t)y*w + x] = hint[planeSize + src] / scale;
+            }
+        }
+    } else {
+        //previous level's mv, upscaled by nearest neighbour and doubled (zero at the coarsest level)
+        for (int y = 0; y < h; y++) {
+            for (int x = 0; x < w; x++) {
+                const size_t src = (size_t)(y / 2) * curWidth + x / 2;
+                mvPre[(size_t)y*w + x] = curWidth > 0 ? 2 * mvCur[src] : 0;
+                mvPre[levelSize + (size_t)y*w + x] = curWidth > 0 ? 2 * mvCur[planeSize + src] : 0;
+            }
+        }
+    }
+
+    const int subpixelRefine = l == 0;
+    pyd_sgm_level(b.bestD, b.minC, mvSub, f1.gray[l].data, f1.census[l], f2.census[l], w, h,
+        mvPre, w, h, aggHalfWinSize, radiusX, radiusY,
+        P1, P2, subpixelRefine, paths, totalPass, false, level);
+
+    //recover mv from the search window index, the window is column major with searchWinY rows
+    for (size_t i = 0; i < levelSize; i++) {
+        const int mvx = b.bestD[i] / searchWinY - radiusX;
+        const int mvy = b.bestD[i] % searchWinY - radiusY;
+        mvCur[i] = mvx + mvPre[i] + (subpixelRefine ? mvSub[i] : 0);
+        mvCur[planeSize + i] = mvy + mvPre[levelSize + i] + (subpixelRefine ? mvSub[levelSize + i] : 0);
+    }
+}
+
+double PydSGM::run_levels(const Frame& f1, const Frame& f2, Buffers& b, SgmWorkerPool* pool, int startLevel,
+    const double* hint, int finestRadiusX, int finestRadiusY)
+{
+    for (int l = startLevel; l >= 0; l--)
+        run_level(f1, f2, b, pool, l, l == startLevel, hint, finestRadiusX, finestRadiusY);
+
+    const size_t planeSize = f1.gray[0].total();
+    double costSum = 0;
+    for (size_t i = 0; i < planeSize; i++)
+        costSum += b.minC[i];
+    return costSum / planeSize;
+}
+
+//finest level mv planes into the WxH CV_32FC2 flow
+static void write_flow(const double* mvCur, Mat& flow)
+{
+    const size_t planeSize = flow.total();
+    for (int y = 0; y < flow.rows; y++) {
+        Vec2f* dst = flow.ptr<Vec2f>(y);
+        for (int x = 0; x < flow.cols; x++) {
+            dst[x][0] = (float)mvCur[(size_t)y*flow.cols + x];
+            dst[x][1] = (float)mvCur[planeSize + (size_t)y*flow.cols + x];
+        }
+    }
+}
+
+void PydSGM::compute(const Frame& f1, const Frame& f2, Mat& flow, SgmArena& arena, SgmWorkerPool* pool,
+    const Mat& prior)
+{
+    const int width = f1.gray[0].cols;
+    const int height = f1.gray[0].rows;
+
+    const size_t mark = arena.used();
+    Buffers b;
+    take_buffers(b, arena, width, height);
+    flow.create(height, width, CV_32FC2);
+
+    //warm start from the prior, which needs the cost of a full search to detect that it broke down
+    lastWarmStart_ = false;
+    if (!prior.empty() && fullSearchCost_ > 0) {
+        CV_Assert(prior.cols == width && prior.rows == height && prior.type() == CV_32FC2);
+        forward_warp_flow(prior, b.hint, b.hintMagnitude);
+
+        const int startLevel = std::max(0, std::min(warmStartLevel, pydNum_ - 1));
+        const double cost = run_levels(f1, f2, b, pool, startLevel, b.hint,
+            std::min(warmSearchHalfWinSize, horSearchHalfWinSize), std::min(warmSearchHalfWinSize, verSearchHalfWinSize));
+        lastWarmStart_ = cost <= warmFallbackRatio * fullSearchCost_;
+    }
+    if (!lastWarmStart_)
+        fullSearchCost_ = run_levels(f1, f2, b, pool, pydNum_ - 1, NULL, horSearchHalfWinSize, verSearchHalfWinSize);
+
+    write_flow(b.mvCur, flow);
+    arena.reset(mark);
+}
+
+void PydSGM::begin_levels(const Frame& f1, SgmArena& arena)
+{
+    levelMark_ = arena.used();
+    levelBuffers_ = arena.take<Buffers>(1);
+    take_buffers(*levelBuffers_, arena, f1.gray[0].cols, f1.gray[0].rows);
+    lastWarmStart_ = false;
+}
+
+void PydSGM::compute_level(const Frame& f1, const Frame& f2, int level, SgmWorkerPool* pool)
+{
+    CV_Assert(levelBuffers_ != NULL && level >= 0 && level < pydNum_);
+    run_level(f1, f2, *levelBuffers_, pool, level, level == pydNum_ - 1, NULL, horSearchHalfWinSize, verSearchHalfWinSize);
+}
+
+void PydSGM::end_levels(const Frame& f1, Mat& flow, SgmArena& arena)
+{
+    CV_Assert(levelBuffers_ != NULL);
+    flow.create(f1.gray[0].rows, f1.gray[0].cols, CV_32FC2);
+    write_flow(levelBuffers_->mvCur, flow);
+    levelBuffers_ = NULL;
+    arena.reset(levelMark_);
 }
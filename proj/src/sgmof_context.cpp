@@ -0,0 +1,269 @@
+#include <condition_variable>
+#include <mutex>
+#include "sgmof_context.h"
+#include "sgm_aggregate.h"
+#include "sgm_task_pool.h"
+
+SgmofContext::SgmofContext(int width, int height, int dMax, int mode, const Mat& K, int pydNum, int paths, int threads)
+    : width_(width), height_(height), dMax_(dMax), mode_(mode), K_(K.clone()), pydNum_(pydNum), paths_(paths), threads_(0),
+    epiSGM_(NULL), pydSGM_(NULL), pool_(NULL), workspaceSize_(0), frameMark_(0), frames_(0), warmStart_(false),
+    batchConcurrency_(0), taskPool_(NULL), batchPending_(0), batchFailed_(false)
+{
+    if (threads <= 0)
+        threads = sgm_default_threads();
+    threads_ = threads;
+    batchConcurrency_ = threads;
+
+    //the arena and the sgm workers are only reserved by the first compute()/push(), a context which only
+    //runs compute_batch() works on its slot contexts and never needs them
+    if (mode == 0) {
+        CV_Assert(!K.empty());
+        epiSGM_ = new EpiSGM(K, dMax);
+        epiSGM_->threads = threads;
+        if (paths > 0)
+            epiSGM_->paths = paths;
+        workspaceSize_ = epiSGM_->workspace_size(width, height);
+    } else {
+        //search window of (2r+1)^2 candidates, r = 5 (11x11) for dMax = 121
+        const int r = std::max(0, ((int)std::sqrt((double)dMax) - 1) / 2);
+        pydSGM_ = new PydSGM(pydNum);
+        pydSGM_->verSearchHalfWinSize = r;
+        pydSGM_->horSearchHalfWinSize = r;
+        pydSGM_->threads = threads;
+        if (paths > 0)
+            pydSGM_->paths = paths;
+        workspaceSize_ = pydSGM_->workspace_size(width, height);
+    }
+}
+
+SgmofContext::~SgmofContext()
+{
+    delete taskPool_;
+    for (size_t i = 0; i < batchSlots_.size(); i++)
+        delete batchSlots_[i];
+    delete pool_;
+    delete epiSGM_;
+    delete pydSGM_;
+}
+
+void SgmofContext::reserve()
+{
+    if (arena_.capacity() > 0)
+        return;
+
+    //frame slots at the bottom of the arena, the pair buffers of compute are taken above them
+    arena_.reserve(workspaceSize_);
+    if (mode_ == 0) {
+        epiSGM_->take_frame(epiFrames_[0], arena_, width_, height_);
+        epiSGM_->take_frame(epiFrames_[1], arena_, width_, height_);
+    } else {
+        pydSGM_->take_frame(pydFrames_[0], arena_, width_, height_);
+        pydSGM_->take_frame(pydFrames_[1], arena_, width_, height_);
+    }
+
+    frameMark_ = arena_.used();
+    if (threads_ > 1)
+        pool_ = new SgmWorkerPool(threads_ - 1);
+}
+
+void SgmofContext::prepare_frame(const Mat& I, int slot)
+{
+    CV_Assert(I.cols == width_ && I.rows == height_);
+
+    if (mode_ == 0)
+        epiSGM_->prepare_frame(I, epiFrames_[slot]);
+    else
+        pydSGM_->prepare_frame(I, pydFrames_[slot]);
+}
+
+void SgmofContext::compute_frames(int slot1, int slot2, Mat& out, bool warmStart)
+{
+    arena_.reset(frameMark_);
+    if (mode_ == 0) {
+        epiSGM_->compute(epiFrames_[slot1], epiFrames_[slot2], out, arena_, pool_);
+        return;
+    }
+
+    pydSGM_->compute(pydFrames_[slot1], pydFrames_[slot2], out, arena_, pool_, warmStart ? prevFlow_ : Mat());
+    if (warmStart_)
+        out.copyTo(prevFlow_);
+}
+
+void SgmofContext::compute(const Mat& I1, const Mat& I2, Mat& out)
+{
+    CV_Assert(I2.size() == I1.size());
+
+    //the pair overwrites both frame slots
+    reserve();
+    restart();
+    prepare_frame(I1, 0);
+    prepare_frame(I2, 1);
+    compute_frames(0, 1, out);
+}
+
+bool SgmofContext::push(const Mat& frame, Mat& out)
+{
+    reserve();
+    const int slot = frames_ % 2;
+    prepare_frame(frame, slot);
+    frames_++;
+    if (frames_ == 1)
+        return false;
+
+    //from the third frame on the previous pair's flow is the prior
+    compute_frames(1 - slot, slot, out, warmStart_ && frames_ > 2);
+    return true;
+}
+
+void SgmofContext::set_batch_concurrency(int pairs)
+{
+    batchConcurrency_ = pairs > 0 ? pairs : threads_;
+
+    //the slots are created again by the next compute_batch()
+    if ((int)batchSlots_.size() != batchConcurrency_) {
+        for (size_t i = 0; i < batchSlots_.size(); i++)
+            delete batchSlots_[i];
+        batchSlots_.clear();
+    }
+}
+
+SgmofBatchStats SgmofContext::compute_batch(int pairs, const SgmofPairSource& source, const SgmofFlowSink& sink)
+{
+    if (taskPool_ == NULL)
+        taskPool_ = new SgmTaskPool(threads_);
+    //a single threaded context per in-flight pair, the pool provides the parallelism. The slots reserve
+    //their arenas here, the workers do not allocate
+    while ((int)batchSlots_.size() < batchConcurrency_) {
+        batchSlots_.push_back(new SgmofContext(width_, height_, dMax_, mode_, K_, pydNum_, paths_, 1));
+        batchSlots_.back()->reserve();
+    }
+
+    //the slot arenas and this context's own arena, if a compute()/push() reserved it
+    SgmofBatchStats stats;
+    stats.memory = arena_.capacity();
+    for (size_t i = 0; i < batchSlots_.size(); i++)
+        stats.memory += batchSlots_[i]->arena_.capacity();
+    const size_t stolen = taskPool_->stolen();
+
+    std::mutex mutex;
+    std::condition_variable finished;
+    std::vector<int> freeSlots;
+    for (int i = (int)batchSlots_.size() - 1; i >= 0; i--)
+        freeSlots.push_back(i);
+    int running = 0;
+    int failed = 0;
+
+    int64 start = getTickCount();
+    for (int i = 0; i < pairs; i++) {
+        int slot;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            finished.wait(lock, [&] {return !freeSlots.empty();});
+            slot = freeSlots.back();
+            freeSlots.pop_back();
+            running++;
+        }
+
+        //the last call of a pair's tasks, the slot takes the next pair
+        std::function<void(bool)> done = [&, slot](bool ok) {
+            std::lock_guard<std::mutex> lock(mutex);
+            freeSlots.push_back(slot);
+            running--;
+            if (!ok)
+                failed++;
+            finished.notify_all();
+        };
+        SgmofContext* context = batchSlots_[slot];
+        SgmTaskPool& pool = *taskPool_;
+        pool.submit([=, &pool, &source, &sink] {context->run_batch_pair(pool, i, source, sink, done);});
+    }
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        finished.wait(lock, [&] {return running == 0;});
+    }
+
+    stats.time = 1000.0 * (getTickCount() - start) / getTickFrequency();
+    stats.pairs = pairs - failed;
+    stats.failed = failed;
+    stats.pairsPerSecond = stats.time > 0 ? 1000.0 * stats.pairs / stats.time : 0;
+    stats.stolen = taskPool_->stolen() - stolen;
+    return stats;
+}
+
+SgmofBatchStats SgmofContext::compute_batch(const std::vector<Mat>& I1, const std::vector<Mat>& I2, std::vector<Mat>& out)
+{
+    CV_Assert(I1.size() == I2.size());
+    out.resize(I1.size());
+    return compute_batch((int)I1.size(),
+        [&](int pair, Mat& image1, Mat& image2) -> bool {image1 = I1[pair]; image2 = I2[pair]; return true;},
+        [&](int pair, const Mat& flow) {flow.copyTo(out[pair]);});
+}
+
+void SgmofContext::run_batch_pair(SgmTaskPool& pool, int pair, const SgmofPairSource& source, const SgmofFlowSink& sink,
+    const std::function<void(bool)>& done)
+{
+    try {
+        if (!source(pair, batchI1_, batchI2_) || batchI1_.size() != Size(width_, height_) || batchI2_.size() != batchI1_.size()) {
+            done(false);
+            return;
+        }
+
+        restart();
+        arena_.reset(frameMark_);
+        if (mode_ == 0) {
+            //the frames detect their features on the same estimator, one after the other
+            prepare_frame(batchI1_, 0);
+            prepare_frame(batchI2_, 1);
+            epiSGM_->compute(epiFrames_[0], epiFrames_[1], batchFlow_, arena_);
+            sink(pair, batchFlow_);
+            done(true);
+            return;
+        }
+    } catch (const std::exception&) {
+        done(false);
+        return;
+    }
+
+    //the frames are prepared in parallel, the last one starts the coarsest level
+    batchPending_ = 2;
+    batchFailed_ = false;
+    for (int f = 0; f < 2; f++) {
+        pool.submit([=, &pool, &sink] {
+            try {
+                prepare_frame(f == 0 ? batchI1_ : batchI2_, f);
+            } catch (const std::exception&) {
+                batchFailed_ = true;
+            }
+            if (--batchPending_ > 0)
+                return;
+
+            if (batchFailed_)
+                done(false);
+            else
+                run_batch_level(pool, pair, pydSGM_->levels() - 1, sink, done);
+        });
+    }
+}
+
+void SgmofContext::run_batch_level(SgmTaskPool& pool, int pair, int level, const SgmofFlowSink& sink,
+    const std::function<void(bool)>& done)
+{
+    try {
+        if (level == pydSGM_->levels() - 1)
+            pydSGM_->begin_levels(pydFrames_[0], arena_);
+        pydSGM_->compute_level(pydFrames_[0], pydFrames_[1], level);
+
+        //the next level is a task of its own, the workers interleave it with the levels of the other pairs
+        if (level > 0) {
+            pool.submit([=, &pool, &sink] {run_batch_level(pool, pair, level - 1, sink, done);});
+            return;
+        }
+
+        pydSGM_->end_levels(pydFrames_[0], batchFlow_, arena_);
+        sink(pair, batchFlow_);
+    } catch (const std::exception&) {
+        done(false);
+        return;
+    }
+    done(true);
+}
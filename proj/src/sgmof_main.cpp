@@ -4,15 +4,21 @@
 #include "sgmof_main.h"
 #include "epi_sgm.h"
 #include "pyd_sgm.h"
+#include "sgmof_context.h"
 #include "utils.h"
 
 using namespace cv;
 
 const String keys =
-    "{help h usage ? |      | Call SGMOF to do optical flow for two images, Usage:\n ./SGMOF I1<first image> I2<second image> [-o]=<output flow file name> [-m]=0(epiSGM)/1(pydSGM)\n }"
-    "{@I1 image1     |<none>| first image  }"
-    "{@I2 image2     |<none>| second image   }"
-    "{o outFile      |flow.png| output flow file (in KITTI format)}"
+    "{help h usage ? |      | Call SGMOF to do optical flow for two images, Usage:\n ./SGMOF I1<first image> I2<second image> [-o]=<output flow file name> [-m]=0(epiSGM)/1(pydSGM)\n ./SGMOF -s=<image list/numbered pattern e.g. img_%06d.png> [-o]=<output flow pattern>\n }"
+    "{@I1 image1     |      | first image  }"
+    "{@I2 image2     |      | second image   }"
+    "{o outFile      |flow.png| output flow file (in KITTI format), with -s a pattern numbered by the first frame of the pair (flow.png -> flow_000000.png)}"
+    "{s sequence     |      | video sequence, image list file (one image per line) or numbered pattern, flow of every consecutive pair }"
+    "{batch          |      | batch of independent pairs, list file with one pair per line: image1 image2 [output flow file], default output numbered by the line (flow.png -> flow_000000.png) }"
+    "{j concurrency  |0     | pairs in flight of --batch, bounds the memory, 0 for the number of cores }"
+    "{f firstFrame   |0     | number of the first frame of a numbered sequence }"
+    "{w warmStart    |      | seed the pairs of a sequence with the previous flow, reduced search (PydSGM) }"
     "{m mode         |0     | epiSGM(0)/pydSGM mode(1) }"
 	"{c calibFile    |calib.txt| calibration file, must have when mode = 0}"
 	"{b benchmark    |0     | 0/1 for specifying Kitti2012/kitti2015 benchmark, used in EpiSGM only (calibration file has different format for 2012/2015)}"
@@ -39,6 +45,14 @@ int main(int argc, char** argv )
     int mode = parser.get<int>("mode");
 	String calibFileName = parser.get<String>("calibFile");
 	int benchmark = parser.get<int>("benchmark");
+    String outFileName = parser.get<String>("outFile");
+    bool enableDiagonal = parser.has("enableDiagonal");
+    int pydNum = parser.get<int>("pydNum");
+    String sequence = parser.get<String>("sequence");
+    int firstFrame = parser.get<int>("firstFrame");
+    bool warmStart = parser.has("warmStart");
+    String batch = parser.get<String>("batch");
+    int concurrency = parser.get<int>("concurrency");
 
     if (!parser.check())
     {
@@ -46,34 +60,112 @@ int main(int argc, char** argv )
         exit(1);
     }
 
-    Mat I1, I2, flow;
-    I1 = imread(image1FileName, IMREAD_UNCHANGED);
-    I2 = imread(image2FileName, IMREAD_UNCHANGED);
-    if (I1.data == NULL || I2.data == NULL) {
-        std::cout << "Open image failed..." << std::endl;
+    //an image pair is a sequence of two frames, a batch is a list of pairs
+    std::vector<String> frameFileNames;
+    std::vector<String> batchImage1, batchImage2, batchOutput;
+    if (!batch.empty()) {
+        read_batch_list(batch, batchImage1, batchImage2, batchOutput);
+        if (!batchImage1.empty()) {
+            frameFileNames.push_back(batchImage1[0]);
+            frameFileNames.push_back(batchImage2[0]);
+        }
+    }
+    else if (sequence.empty()) {
+        frameFileNames.push_back(image1FileName);
+        frameFileNames.push_back(image2FileName);
+        firstFrame = 0;
+    }
+    else {
+        frameFileNames = read_sequence(sequence, firstFrame);
+        if (sequence.find('%') == String::npos)
+            firstFrame = 0;
+    }
+    if (frameFileNames.size() < 2 || frameFileNames[0].empty() || frameFileNames[1].empty()) {
+        std::cout << "Two images, a sequence of at least two frames or a batch of pairs needed..." << std::endl;
+        parser.printMessage();
         exit(1);
     }
-    else if (I1.size != I2.size) {
-        std::cout << "Size of image1/2 must match" << std::endl;
+
+    Mat I = imread(frameFileNames[0], IMREAD_UNCHANGED);
+    if (I.data == NULL) {
+        std::cout << "Open image failed..." << std::endl;
+        exit(1);
     }
     
+    Mat K;
     if (mode == 0) {
 		//check if calibration file provided
 		Mat P = read_calib_file(calibFileName, benchmark == 1);
 		//get intrinsic matrix
-		Mat K = P(Range(0, 3), Range(0, 3));
-
-        //call EpiSGM OF to calculate optical flow
-        EpiSGM epiSGM;
-        flow = epiSGM.compute(I1, I2);
+		K = P(Range(0, 3), Range(0, 3));
     }
-    else {
-        //call PydSGM OF to calculate optical flow
-        PydSGM pydSGM;
-        flow = pydSGM.compute(I1, I2);
+
+    //call EpiSGM/PydSGM OF to calculate optical flow, the context holds all buffers of the method
+    const int dMax = mode == 0 ? 64 : 121;
+    SgmofContext context(I.cols, I.rows, dMax, mode, K, pydNum, mode == 0 && enableDiagonal ? 8 : 0);
+    context.set_warm_start(warmStart);
+
+    if (!batch.empty()) {
+        //the pairs are loaded, computed and written on the workers of the context, at most concurrency at a time
+        context.set_batch_concurrency(concurrency);
+        const SgmofBatchStats stats = context.compute_batch((int)batchImage1.size(),
+            [&](int pair, Mat& I1, Mat& I2) -> bool {
+                //the first image was decoded above for the frame size, it is handed over rather than read again
+                if (pair == 0) {
+                    I1 = I;
+                    I.release();
+                }
+                else
+                    I1 = imread(batchImage1[pair], IMREAD_UNCHANGED);
+                I2 = imread(batchImage2[pair], IMREAD_UNCHANGED);
+                return I1.data != NULL && I2.data != NULL;
+            },
+            [&](int pair, const Mat& flow) {
+                FlowImage flowImage(flow);
+                flowImage.write(batchOutput[pair].empty() ? frame_file_name(outFileName, pair) : batchOutput[pair]);
+            });
+        std::cout << "batch: " << stats.pairs << " pairs, " << stats.failed << " failed (unreadable or size mismatch), "
+            << stats.time << " ms, " << stats.pairsPerSecond << " pairs/s, " << stats.memory / (1024.0 * 1024.0)
+            << " MB in flight, " << stats.stolen << " tasks stolen" << std::endl;
+        return stats.failed > 0 ? 1 : 0;
     }
 
-    //write optical flow
+    //each frame is preprocessed once, the flow of every consecutive pair is written
+    std::cout << "workspace: " << context.memory_footprint() / (1024.0 * 1024.0) << " MB" << std::endl;
+    Mat flow;
+    FlowImage flowImage;
+    double totalTime = 0;
+    for (size_t i = 0; i < frameFileNames.size(); i++) {
+        if (i > 0)
+            I = imread(frameFileNames[i], IMREAD_UNCHANGED);
+        if (I.data == NULL) {
+            std::cout << "Open image failed: " << frameFileNames[i] << std::endl;
+            exit(1);
+        }
+        else if (I.cols != context.width() || I.rows != context.height()) {
+            std::cout << "Size of image1/2 must match" << std::endl;
+            exit(1);
+        }
+
+        int64 start = getTickCount();
+        const bool hasFlow = context.push(I, flow);
+        const double time = 1000.0 * (getTickCount() - start) / getTickFrequency();
+        totalTime += time;
+        if (!hasFlow)
+            continue;
+        std::cout << "flow " << i - 1 << "-" << i << ": " << time << " ms" << (context.last_warm_start() ? " (warm start)" : "") << std::endl;
+        const EpiGeometryStats* geometry = context.geometry_stats();
+        if (geometry != NULL)
+            std::cout << "  geometry: detect " << geometry->detectTime << " ms, match " << geometry->matchTime
+                << " ms, ransac " << geometry->ransacTime << " ms, " << geometry->inliers << "/" << geometry->matches
+                << " inliers, " << geometry->iterations << " iterations" << std::endl;
+
+        //write optical flow
+        flowImage.assign(flow);
+        flowImage.write(sequence.empty() ? outFileName : frame_file_name(outFileName, firstFrame + (int)i - 1));
+    }
+    if (frameFileNames.size() > 2)
+        std::cout << "average: " << totalTime / (frameFileNames.size() - 1) << " ms per pair" << std::endl;
 
     return 0;
-}
\ No newline at end of file
+}
@@ -1,5 +1,6 @@
 #include "utils.h"
 #include "log_colormap.h"
+#include <sstream>
 void FlowImage::readFlowField(const std::string fileName)
 {
 	Mat flowRaw = imread(fileName, IMREAD_UNCHANGED);
@@ -166,4 +167,83 @@ Mat read_calib_file(string fileName, bool isKITTI2015)
 	f.close();
 	//cout << P << endl;
 	return P;
-}
\ No newline at end of file
+}
+
+void to_gray(const Mat& I, Mat& gray)
+{
+	Mat I8 = I;
+	if (I.depth() != CV_8U)
+		I.convertTo(I8, CV_8U, I.depth() == CV_16U ? 1.0 / 256 : 1.0);
+
+	if (I8.channels() == 3)
+		cvtColor(I8, gray, COLOR_BGR2GRAY);
+	else if (I8.channels() == 4)
+		cvtColor(I8, gray, COLOR_BGRA2GRAY);
+	else
+		I8.copyTo(gray);
+}
+
+Mat to_gray(const Mat& I)
+{
+	Mat gray;
+	to_gray(I, gray);
+	return gray;
+}
+
+std::vector<String> read_sequence(const String& spec, int first)
+{
+	std::vector<String> fileNames;
+	if (spec.find('%') == String::npos) {
+		ifstream listFile(spec.c_str());
+		string line;
+		while (getline(listFile, line)) {
+			//skip empty lines, tolerate CRLF lists
+			if (!line.empty() && line[line.size() - 1] == '\r')
+				line.erase(line.size() - 1);
+			if (!line.empty())
+				fileNames.push_back(line);
+		}
+		return fileNames;
+	}
+
+	for (int i = first; ; i++) {
+		String fileName = frame_file_name(spec, i);
+		if (!ifstream(fileName.c_str()).good())
+			break;
+		fileNames.push_back(fileName);
+	}
+	return fileNames;
+}
+
+String frame_file_name(const String& pattern, int index)
+{
+	String format = pattern;
+	if (format.find('%') == String::npos) {
+		size_t dot = format.rfind('.');
+		if (dot == String::npos || format.find_first_of("/\\", dot) != String::npos)
+			dot = format.size();
+		format = format.substr(0, dot) + "_%06d" + format.substr(dot);
+	}
+
+	char fileName[1024];
+	snprintf(fileName, sizeof(fileName), format.c_str(), index);
+	return fileName;
+}
+
+void read_batch_list(const String& fileName, std::vector<String>& image1, std::vector<String>& image2,
+	std::vector<String>& output)
+{
+	ifstream listFile(fileName.c_str());
+	string line;
+	while (getline(listFile, line)) {
+		istringstream fields(line);
+		string name1, name2, flowName;
+		//skip empty and incomplete lines
+		if (!(fields >> name1 >> name2))
+			continue;
+		fields >> flowName;
+		image1.push_back(name1);
+		image2.push_back(name2);
+		output.push_back(flowName);
+	}
+}
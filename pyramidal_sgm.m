@@ -17,7 +17,7 @@ function [ mvCurLevel, mvPyd , minC] = pyramidal_sgm( I0, I1, numPyd )
     aggHalfWinSize = 2;                %half aggregation window size
     verSearchHalfWinSize = 5;   %half search window size in vertical direction
     horSearchHalfWinSize = 5;   %half search window size in vertical direction
-    enableDiagonal = 1;
+    enableDiagonal = 1;         %0: 4 path directions, 1: 8, 16 adds the knight move paths
     totalPass = 2;
     adaptiveP2 = 0;
     
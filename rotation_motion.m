@@ -21,13 +21,9 @@ L2 = computeEpipoleLineI2(F, P0);
 P1 = H*P0;
 P1 = P1./P1(3,:);
 OFF = P1(1:2, :) - P0(1:2, :);
-for j = 1:rows
-    for i = 1:cols
-        ind = sub2ind([rows, cols], j, i);
-        coefficientToEpipolarLine = -L2(:, ind)'*P1(:, ind);
-        OFF(:, ind) = OFF(:, ind) + coefficientToEpipolarLine*L2(1:2, ind);
-    end
-end
+% project onto the epipolar lines, all pixels at once
+coefficientToEpipolarLine = -sum(L2.*P1, 1);
+OFF = OFF + coefficientToEpipolarLine.*L2(1:2, :);
 
 
 mv(:,:,1) = reshape(OFF(1,:), rows, cols);
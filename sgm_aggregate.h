@@ -0,0 +1,549 @@
+#ifndef _SGM_AGGREGATE_H_
+#define _SGM_AGGREGATE_H_
+#include <string.h>
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "sgm_kernels.h"
+
+/*
+ * Multi-threaded SGM path aggregation over 4, 8 or 16 directions.
+ *
+ * A direction (dx, dy) continues the path of (x - dx, y - dy) at (x, y). Every direction is swept in its
+ * natural memory order:
+ * - horizontal paths (dy = 0) do not depend on other rows, whole rows are handed out to the workers (phase 1)
+ * - all directions with dy > 0 share one top-down sweep, those with dy < 0 one bottom-up sweep (phase 2).
+ *   The sweeps are split in column strips, one per worker, which advance in a skewed wavefront: a strip
+ *   starts row k once its neighbour strips finished row k-1, as the diagonal and knight move paths cross
+ *   the strip border. All directions of a sweep are evaluated together while the cost row is in cache,
+ *   so more directions add work to the same parallel sweep instead of extra sequential passes.
+ * Every Sp entry is owned by a single worker in each phase, and the sums are integer, so the result does
+ * not depend on the thread count. Sp needs no clearing, the first horizontal path stores into it.
+ *
+ * Path policy used by sgm_aggregate():
+ *   typedef ... Workspace;    per worker scratch memory of the step, provided by the caller
+ *   void step(PathCost* L, const PathCost* Lpre, const CostType* C, int x, int y, int xpre, int ypre, Workspace& ws)
+ *                             path cost of (x, y) continuing the path at (xpre, ypre)
+ *
+ * CostRows: const CostType* row(int y), returns the width x dMax costs of row y. With more than one
+ * thread it is called concurrently and must not have state (e.g. a materialized cost volume).
+ * MATLAB api functions (mxMalloc ...) are not thread safe, all memory is allocated by the caller.
+ */
+
+const int SGM_MAX_PATHS = 16;
+const int SGM_MAX_STRIPS = 64;      //column strips of a sweep, more workers only share the horizontal paths
+
+class SgmWorkerPool;
+static_assert(SGM_MAX_PATHS * MAX_PATH_COST <= MAX_PATH_SUM, "path sums of SGM_MAX_PATHS directions overflow PathSum");
+
+typedef struct _sgmDirection
+{
+    int dx;
+    int dy;
+} SgmDirection;
+
+typedef struct _sgmAggregateParams
+{
+    int width;
+    int height;
+    int dMax;
+    int totalPass;              //1: forward paths only, 2: forward and reverse paths
+    int paths;                  //4: horizontal/vertical, 8: + diagonals, 16: + knight moves (2, 1), (1, 2) ...
+    int threads;                //number of worker threads
+    SgmWorkerPool* pool;        //optional persistent workers, NULL starts the threads of every phase
+} SgmAggregateParams;
+
+/*
+ * directions of the configured paths, returns their count. The forward directions (dy > 0, or dy = 0 and
+ * dx > 0) come first, their reverses follow in the same order if totalPass is 2.
+ */
+inline int sgm_directions(SgmDirection* dirs, int paths, int totalPass)
+{
+    static const SgmDirection forward[SGM_MAX_PATHS/2] = {
+        {1, 0}, {0, 1},             //horizontal, vertical
+        {1, 1}, {-1, 1},            //diagonals
+        {2, 1}, {1, 2}, {-1, 2}, {-2, 1} }; //knight moves
+    const int n = paths >= 16 ? 8 : (paths >= 8 ? 4 : 2);
+
+    for (int i = 0; i < n; i++) {
+        dirs[i] = forward[i];
+        dirs[n + i].dx = -forward[i].dx;
+        dirs[n + i].dy = -forward[i].dy;
+    }
+    return totalPass > 1 ? 2*n : n;
+}
+
+inline int sgm_default_threads()
+{
+    return std::max<int>(1, std::thread::hardware_concurrency());
+}
+
+//column strips of the sweeps, the knight moves reach 2 columns into the neighbour strip
+inline int sgm_aggregate_strips(const SgmAggregateParams& p)
+{
+    return std::max(1, std::min(std::min(p.threads, SGM_MAX_STRIPS), p.paths >= 16 ? p.width/2 : p.width));
+}
+
+//path cost entries needed by sgm_aggregate(): two pixels per worker for the horizontal paths, |dy| + 1 rows
+//for each of the other directions of a sweep (the sweeps run one after the other and share them)
+inline size_t sgm_aggregate_buffer_size(const SgmAggregateParams& p)
+{
+    SgmDirection dirs[SGM_MAX_PATHS];
+    const int n = sgm_directions(dirs, p.paths, 1);
+    size_t rows = 0;
+    for (int i = 0; i < n; i++)
+        if (dirs[i].dy != 0)
+            rows += std::abs(dirs[i].dy) + 1;
+    return (size_t)sgm_path_stride(p.dMax) * (2*p.threads + rows*p.width);
+}
+
+/*
+ * persistent worker threads for sgm_parallel_run(). Starting a std::thread allocates, the workers of a pool
+ * are started once and wait on a condition variable between the phases. A phase needs all of its workers
+ * running at the same time (the wavefront strips wait on their neighbours), run() requires
+ * workers() >= threads - 1.
+ */
+class SgmWorkerPool
+{
+public:
+    explicit SgmWorkerPool(int workers) : task_(NULL), fn_(NULL), threads_(0), pending_(0), generation_(0), stop_(false)
+    {
+        for (int w = 1; w <= workers; w++)
+            workers_.push_back(std::thread(&SgmWorkerPool::loop, this, w));
+    }
+
+    ~SgmWorkerPool()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stop_ = true;
+        }
+        wake_.notify_all();
+        for (size_t w = 0; w < workers_.size(); w++)
+            workers_[w].join();
+    }
+
+    int workers() const {return (int)workers_.size();}
+
+    //run fn(worker) for worker = 0 .. threads-1, worker 0 on the calling thread
+    template <class F>
+    void run(int threads, const F& fn)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            task_ = &SgmWorkerPool::call<F>;
+            fn_ = &fn;
+            threads_ = threads;
+            pending_ = threads - 1;
+            generation_++;
+        }
+        wake_.notify_all();
+        fn(0);
+
+        std::unique_lock<std::mutex> lock(mutex_);
+        done_.wait(lock, [this] {return pending_ == 0;});
+    }
+
+private:
+    SgmWorkerPool(const SgmWorkerPool&);
+    SgmWorkerPool& operator=(const SgmWorkerPool&);
+
+    //calls the functor without type erasure through std::function, which may allocate
+    template <class F>
+    static void call(const void* fn, int worker) {(*(const F*)fn)(worker);}
+
+    void loop(int worker)
+    {
+        unsigned seen = 0;
+        std::unique_lock<std::mutex> lock(mutex_);
+        for (;;) {
+            wake_.wait(lock, [&] {return stop_ || generation_ != seen;});
+            if (stop_)
+                return;
+            seen = generation_;
+            if (worker >= threads_)
+                continue;
+
+            lock.unlock();
+            task_(fn_, worker);
+            lock.lock();
+            if (--pending_ == 0)
+                done_.notify_one();
+        }
+    }
+
+    std::vector<std::thread> workers_;
+    std::mutex mutex_;
+    std::condition_variable wake_;
+    std::condition_variable done_;
+    void (*task_)(const void*, int);
+    const void* fn_;
+    int threads_;
+    int pending_;
+    unsigned generation_;
+    bool stop_;
+};
+
+//run fn(worker) for worker = 0 .. threads-1, worker 0 on the calling thread. on the pool if it has enough workers
+template <class F>
+void sgm_parallel_run(int threads, const F& fn, SgmWorkerPool* pool = NULL)
+{
+    if (threads > 1 && pool != NULL && pool->workers() >= threads - 1) {
+        pool->run(threads, fn);
+        return;
+    }
+
+    std::vector<std::thread> workers;
+    for (int t = 1; t < threads; t++)
+        workers.push_back(std::thread(fn, t));
+    fn(0);
+    for (size_t t = 0; t < workers.size(); t++)
+        workers[t].join();
+}
+
+inline void sgm_wait_progress(const std::atomic<int>& progress, int value)
+{
+    while (progress.load(std::memory_order_acquire) < value)
+        std::this_thread::yield();
+}
+
+//phase 1: horizontal paths, rows are taken from nextRow until yEnd. Sp holds the rows from ySp on
+template <class Path, class CostRows>
+void sgm_aggregate_rows(PathSum* Sp, CostRows& costRows, Path& path, typename Path::Workspace& ws,
+    PathCost* L, std::atomic<int>& nextRow, int yEnd, int ySp, const SgmAggregateParams& p)
+{
+    const int width = p.width;
+    const int dMax = p.dMax;
+    const int pathCostEntryPerPixel = sgm_path_stride(dMax);
+    const int pathMinIdx = sgm_path_min_index(dMax);
+
+    for (int y = nextRow++; y < yEnd; y = nextRow++) {
+        const CostType* ptrC = costRows.row(y);
+        PathSum* ptrSp = Sp + (size_t)(y - ySp)*width*dMax;
+
+        for (int pass = 0; pass < p.totalPass; pass++) {
+            const int xstart = pass == 0 ? 0 : width - 1;
+            const int xend = pass == 0 ? width : -1;
+            const int xstep = pass == 0 ? 1 : -1;
+
+            PathCost* ptrLPre = L;
+            PathCost* ptrLCur = L + pathCostEntryPerPixel;
+
+            for (int x = xstart; x != xend; x += xstep) {
+                const CostType* ptrCCur = ptrC + x*dMax;
+
+                if (x == xstart) {
+                    memcpy(ptrLCur, ptrCCur, sizeof(PathCost)*dMax);
+                    ptrLCur[pathMinIdx] = 0;
+                } else {
+                    path.step(ptrLCur, ptrLPre, ptrCCur, x, y, x - xstep, y, ws);
+                }
+
+                //the first path of the row initializes Sp
+                sgm_accumulate(ptrSp + x*dMax, ptrLCur, dMax, pass == 0);
+
+                PathCost* tmp = ptrLPre;
+                ptrLPre = ptrLCur;
+                ptrLCur = tmp;
+            }
+        }
+    }
+}
+
+/*
+ * phase 2: sweep rows k0 .. k1-1 (ystep = 1: top-down, -1: bottom-up) of the columns x0 .. x1-1, with the
+ * directions dirs[0 .. n-1] which all have dy = ystep*|dy|. Direction i keeps its last |dy| + 1 rows in L[i].
+ * Sp holds the rows from ySp on, the first direction stores into it if storeFirst is set.
+ */
+template <class Path, class CostRows>
+void sgm_aggregate_strip(PathSum* Sp, CostRows& costRows, Path& path, typename Path::Workspace& ws,
+    const SgmDirection* dirs, PathCost* const* L, int n, int ystep, int x0, int x1, int k0, int k1,
+    std::atomic<int>* progress, const std::atomic<int>* progressLeft, const std::atomic<int>* progressRight,
+    int rowsBefore, int ySp, bool storeFirst, const SgmAggregateParams& p)
+{
+    const int width = p.width;
+    const int height = p.height;
+    const int dMax = p.dMax;
+    const int pathCostEntryPerPixel = sgm_path_stride(dMax);
+    const int pathCostEntryPerRow = width * pathCostEntryPerPixel;
+    const int pathMinIdx = sgm_path_min_index(dMax);
+    const int ystart = ystep > 0 ? 0 : height - 1;
+
+    bool crossStrips = false;
+    for (int i = 0; i < n; i++)
+        crossStrips = crossStrips || dirs[i].dx != 0;
+
+    for (int k = k0; k < k1; k++) {
+        const int y = ystart + k*ystep;
+
+        //the paths crossing the strip border read the previous rows of the neighbour strips, which also
+        //must not overwrite them before this strip is done
+        const int rowsDone = rowsBefore + k;
+        if (crossStrips) {
+            if (progressLeft) sgm_wait_progress(*progressLeft, rowsDone);
+            if (progressRight) sgm_wait_progress(*progressRight, rowsDone);
+        }
+
+        PathSum* ptrSp = Sp + (size_t)(y - ySp)*width*dMax;
+        const CostType* ptrC = costRows.row(y);
+
+        for (int i = 0; i < n; i++) {
+            const int dx = dirs[i].dx;
+            const int rowDist = std::abs(dirs[i].dy);
+            PathCost* ptrLCurRow = L[i] + (k % (rowDist + 1))*pathCostEntryPerRow;
+            PathCost* ptrLPreRow = L[i] + ((k + 1) % (rowDist + 1))*pathCostEntryPerRow;
+
+            for (int x = x0; x < x1; x++) {
+                PathCost* ptrLCur = ptrLCurRow + x*pathCostEntryPerPixel;
+                const CostType* ptrCCur = ptrC + x*dMax;
+                const int xpre = x - dx;
+
+                //the path starts where its previous pixel is outside of the image
+                if (k < rowDist || xpre < 0 || xpre >= width) {
+                    memcpy(ptrLCur, ptrCCur, sizeof(PathCost)*dMax);
+                    ptrLCur[pathMinIdx] = 0;
+                } else {
+                    path.step(ptrLCur, ptrLPreRow + xpre*pathCostEntryPerPixel, ptrCCur, x, y, xpre, y - dirs[i].dy, ws);
+                }
+
+                sgm_accumulate(ptrSp + x*dMax, ptrLCur, dMax, storeFirst && i == 0);
+            }
+        }
+
+        progress->store(rowsDone + 1, std::memory_order_release);
+    }
+}
+
+//directions of the sweep ystep and their row buffers, which start at ptrRows. returns their count
+inline int sgm_sweep_directions(SgmDirection* sweepDirs, PathCost** L, const SgmDirection* dirs, int totalDirs,
+    int ystep, PathCost* ptrRows, int pathCostEntryPerRow)
+{
+    int n = 0;
+    for (int i = 0; i < totalDirs; i++) {
+        if (dirs[i].dy*ystep <= 0)
+            continue;
+        sweepDirs[n] = dirs[i];
+        L[n++] = ptrRows;
+        ptrRows += (std::abs(dirs[i].dy) + 1)*pathCostEntryPerRow;
+    }
+    return n;
+}
+
+/*
+ * sum of the path costs of all directions
+ * Output:
+ * Sp: width x height x dMax sums
+ *
+ * Input:
+ * ws: p.threads step workspaces
+ * buf: sgm_aggregate_buffer_size(p) path cost entries
+ */
+template <class Path, class CostRows>
+void sgm_aggregate(PathSum* Sp, CostRows& costRows, Path& path, typename Path::Workspace* ws,
+    PathCost* buf, const SgmAggregateParams& p)
+{
+    const int pathCostEntryPerPixel = sgm_path_stride(p.dMax);
+    const int pathCostEntryPerRow = p.width * pathCostEntryPerPixel;
+    const int strips = sgm_aggregate_strips(p);
+
+    memset(buf, MAX_PATH_COST, sizeof(PathCost) * sgm_aggregate_buffer_size(p));
+
+    //horizontal paths, they write Sp first. skip the leading sentinel of each entry
+    PathCost* L1 = buf + 1;
+    std::atomic<int> nextRow(0);
+    sgm_parallel_run(p.threads, [&](int worker) {
+        sgm_aggregate_rows(Sp, costRows, path, ws[worker], L1 + 2*worker*pathCostEntryPerPixel, nextRow,
+            p.height, 0, p);
+    }, p.pool);
+
+    //the other directions, grouped by sweep. the reverse sweep reuses the row buffers of the forward one
+    SgmDirection dirs[SGM_MAX_PATHS];
+    const int totalDirs = sgm_directions(dirs, p.paths, p.totalPass);
+    std::atomic<int> progress[SGM_MAX_STRIPS];
+    for (int s = 0; s < strips; s++)
+        progress[s].store(0);
+
+    for (int pass = 0; pass < p.totalPass; pass++) {
+        const int ystep = pass == 0 ? 1 : -1;
+        SgmDirection sweepDirs[SGM_MAX_PATHS];
+        PathCost* L[SGM_MAX_PATHS];
+        const int n = sgm_sweep_directions(sweepDirs, L, dirs, totalDirs, ystep,
+            L1 + 2*p.threads*pathCostEntryPerPixel, pathCostEntryPerRow);
+
+        sgm_parallel_run(strips, [&](int s) {
+            sgm_aggregate_strip(Sp, costRows, path, ws[s], sweepDirs, L, n, ystep,
+                s*p.width/strips, (s + 1)*p.width/strips, 0, p.height,
+                &progress[s], s > 0 ? &progress[s - 1] : NULL, s < strips - 1 ? &progress[s + 1] : NULL,
+                pass*p.height, 0, false, p);
+        }, p.pool);
+    }
+}
+
+/*
+ * Memory efficient two pass aggregation (eSGM). Instead of the width x height x dMax Sp volume only a band
+ * of SGM_SUMMARY_BAND_ROWS rows of sums is kept:
+ * - the forward sweep (horizontal paths and dy > 0) keeps the SGM_SUMMARY_CANDIDATES indices with the
+ *   lowest sums of each pixel, together with the sums of their subpixel neighbours
+ * - the reverse sweep (dy < 0) adds its sums to these entries.
+ * The result is identical to the argmin of the full Sp volume whenever that is one of the candidates of the
+ * forward sweep, the others are a local minimum of the total cost among them. The stored sums are exact, so
+ * minC is never below the one of the full volume, it is higher where the winner was missed. Measured on
+ * 200x300 synthetic pairs (P1 6, P2 64): the winner differs from the full volume on 0.4% (4 paths) / 0.8%
+ * (8 paths) of the pixels of the epipolar kernel (dMax 64) and 0.1% of the 2-D kernel (11x11 window) on
+ * smoothed textures with two motions, but on 20% / 15% of the pixels on pure random images, where the
+ * reverse sweep often moves the minimum to an index the forward sweep did not keep.
+ */
+const int SGM_SUMMARY_CANDIDATES = 3;
+const int SGM_SUMMARY_NEIGHBOURS = 4;
+const int SGM_SUMMARY_BAND_ROWS = 32;
+
+typedef struct _sgmCandidate
+{
+    int d;                                      //index of the candidate, -1 if dMax < SGM_SUMMARY_CANDIDATES
+    PathSum cost[1 + SGM_SUMMARY_NEIGHBOURS];   //sums at d and d + offset[i], MAX_PATH_SUM outside of 0 .. dMax-1
+} SgmCandidate;
+
+typedef struct _sgmSummaryParams
+{
+    int neighbours;                             //number of subpixel neighbours, up to SGM_SUMMARY_NEIGHBOURS
+    int offset[SGM_SUMMARY_NEIGHBOURS];         //index offsets of the neighbours, e.g. -1, 1
+} SgmSummaryParams;
+
+//band of row sums used by sgm_aggregate_summary(), in PathSum entries
+inline size_t sgm_summary_band_size(const SgmAggregateParams& p)
+{
+    return (size_t)std::min(p.height, SGM_SUMMARY_BAND_ROWS) * p.width * p.dMax;
+}
+
+inline void sgm_summary_costs(SgmCandidate& cand, const PathSum* S, int dMax, const SgmSummaryParams& sp, bool first)
+{
+    for (int i = 0; i <= sp.neighbours; i++) {
+        const int d = cand.d + (i == 0 ? 0 : sp.offset[i - 1]);
+        if (d < 0 || d >= dMax)
+            cand.cost[i] = MAX_PATH_SUM;
+        else if (first)
+            cand.cost[i] = S[d];
+        else
+            cand.cost[i] = (PathSum)std::min<unsigned>(cand.cost[i] + S[d], MAX_PATH_SUM);
+    }
+}
+
+//forward sweep: the lowest sums of S (dMax entries), the lower index first on equal sums
+inline void sgm_summary_select(SgmCandidate* cand, const PathSum* S, int dMax, const SgmSummaryParams& sp)
+{
+    int n = 0;
+    for (int d = 0; d < dMax; d++) {
+        if (n == SGM_SUMMARY_CANDIDATES && S[d] >= S[cand[n - 1].d])
+            continue;
+        int j = std::min(n, SGM_SUMMARY_CANDIDATES - 1);
+        for (; j > 0 && S[d] < S[cand[j - 1].d]; j--)
+            cand[j].d = cand[j - 1].d;
+        cand[j].d = d;
+        n = std::min(n + 1, SGM_SUMMARY_CANDIDATES);
+    }
+
+    for (int i = 0; i < SGM_SUMMARY_CANDIDATES; i++) {
+        if (i >= n)
+            cand[i].d = -1;
+        else
+            sgm_summary_costs(cand[i], S, dMax, sp, true);
+    }
+}
+
+//reverse sweep: add S to the candidates
+inline void sgm_summary_fold(SgmCandidate* cand, const PathSum* S, int dMax, const SgmSummaryParams& sp)
+{
+    for (int i = 0; i < SGM_SUMMARY_CANDIDATES && cand[i].d >= 0; i++)
+        sgm_summary_costs(cand[i], S, dMax, sp, false);
+}
+
+//candidate with the lowest total sum, the lower index first on equal sums
+inline const SgmCandidate* sgm_summary_best(const SgmCandidate* cand)
+{
+    const SgmCandidate* best = cand;
+    for (int i = 1; i < SGM_SUMMARY_CANDIDATES && cand[i].d >= 0; i++) {
+        if (cand[i].cost[0] < best->cost[0] || (cand[i].cost[0] == best->cost[0] && cand[i].d < best->d))
+            best = cand + i;
+    }
+    return best;
+}
+
+/*
+ * two pass aggregation, see above
+ * Output:
+ * summary: width x height x SGM_SUMMARY_CANDIDATES candidates
+ *
+ * Input:
+ * ws: p.threads step workspaces
+ * buf: sgm_aggregate_buffer_size(p) path cost entries
+ * band: sgm_summary_band_size(p) sums
+ */
+template <class Path, class CostRows>
+void sgm_aggregate_summary(SgmCandidate* summary, CostRows& costRows, Path& path, typename Path::Workspace* ws,
+    PathCost* buf, PathSum* band, const SgmAggregateParams& p, const SgmSummaryParams& sp)
+{
+    const int width = p.width;
+    const int dMax = p.dMax;
+    const int pathCostEntryPerPixel = sgm_path_stride(dMax);
+    const int pathCostEntryPerRow = width * pathCostEntryPerPixel;
+    const int strips = sgm_aggregate_strips(p);
+
+    memset(buf, MAX_PATH_COST, sizeof(PathCost) * sgm_aggregate_buffer_size(p));
+
+    PathCost* L1 = buf + 1;
+    SgmDirection dirs[SGM_MAX_PATHS];
+    const int totalDirs = sgm_directions(dirs, p.paths, p.totalPass);
+    std::atomic<int> progress[SGM_MAX_STRIPS];
+    for (int s = 0; s < strips; s++)
+        progress[s].store(0);
+
+    for (int pass = 0; pass < p.totalPass; pass++) {
+        const int ystep = pass == 0 ? 1 : -1;
+        SgmDirection sweepDirs[SGM_MAX_PATHS];
+        PathCost* L[SGM_MAX_PATHS];
+        const int n = sgm_sweep_directions(sweepDirs, L, dirs, totalDirs, ystep,
+            L1 + 2*p.threads*pathCostEntryPerPixel, pathCostEntryPerRow);
+
+        //the sweep continues across the bands, rows k0 .. k1-1 are y0 .. y0 + k1-k0-1 in the band
+        for (int k0 = 0; k0 < p.height; k0 += SGM_SUMMARY_BAND_ROWS) {
+            const int k1 = std::min(p.height, k0 + SGM_SUMMARY_BAND_ROWS);
+            const int y0 = ystep > 0 ? k0 : p.height - k1;
+            std::atomic<int> nextRow(y0);
+
+            //horizontal paths are part of the forward sweep
+            if (pass == 0) {
+                sgm_parallel_run(p.threads, [&](int worker) {
+                    sgm_aggregate_rows(band, costRows, path, ws[worker], L1 + 2*worker*pathCostEntryPerPixel,
+                        nextRow, y0 + k1 - k0, y0, p);
+                }, p.pool);
+                nextRow.store(y0);
+            }
+
+            if (n > 0) {
+                sgm_parallel_run(strips, [&](int s) {
+                    sgm_aggregate_strip(band, costRows, path, ws[s], sweepDirs, L, n, ystep,
+                        s*width/strips, (s + 1)*width/strips, k0, k1,
+                        &progress[s], s > 0 ? &progress[s - 1] : NULL, s < strips - 1 ? &progress[s + 1] : NULL,
+                        pass*p.height, y0, pass > 0, p);
+                }, p.pool);
+            }
+
+            sgm_parallel_run(p.threads, [&](int) {
+                for (int y = nextRow++; y < y0 + k1 - k0; y = nextRow++) {
+                    for (int x = 0; x < width; x++) {
+                        const PathSum* S = band + ((size_t)(y - y0)*width + x)*dMax;
+                        SgmCandidate* cand = summary + ((size_t)y*width + x)*SGM_SUMMARY_CANDIDATES;
+                        if (pass == 0)
+                            sgm_summary_select(cand, S, dMax, sp);
+                        else
+                            sgm_summary_fold(cand, S, dMax, sp);
+                    }
+                }
+            }, p.pool);
+        }
+    }
+}
+
+#endif
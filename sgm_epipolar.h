@@ -0,0 +1,737 @@
+#ifndef _SGM_EPIPOLAR_H_
+#define _SGM_EPIPOLAR_H_
+#include <nmmintrin.h>
+#include <cstring>
+#include <cmath>
+#include "mex_compat.h"
+#include "common.h"
+#include "census.h"
+#include "sgm_aggregate.h"
+#include "sgm_tiles.h"
+
+/*
+ * Epipolar SGM kernels: matching cost along the epipolar lines, path aggregation and winner takes all.
+ * Used by the calc_cost_sgm MEX gateway and by the native EpiSGM (proj/).
+ */
+#define USE_VZIND 
+#define INVALID_DISPARITY (512<<SUBPIXEL_PRECISION)
+
+inline int adaptive_P2(int P2, int pixCur, int pixPre) {
+    const int threshold = 25;
+    
+    return (abs(pixCur - pixPre) > threshold ? P2/8 : P2);
+}
+
+//1-D disparity path of the epipolar sgm, see sgm_aggregate.h
+struct EpiPath
+{
+    typedef int Workspace;      //no scratch memory needed
+
+    const PixelType* I1;
+    int width;
+    int dMax;
+    int P1;
+    int P2;
+    bool adpativeP2;
+
+    void step(PathCost* L, const PathCost* Lpre, const CostType* C, int x, int y, int xpre, int ypre, Workspace&)
+    {
+        PixelType pixCur = I1[width*y + x];
+        PixelType pixPre = I1[width*ypre + xpre];
+
+        sgm_step(L,                     //current path cost
+            Lpre,                       //previous path cost
+            C,                          //cost map
+            dMax, P1, adpativeP2 ? adaptive_P2(P2, pixCur, pixPre) : P2);
+    }
+};
+
+//subpixel quadratic interpolation:
+//fit parabola into (x1=d-1, y1=C[d-1]), (x2=d, y2=C[d]), (x3=d+1, y3=C[d+1])
+//then find minimum of the parabola, returns it with SUBPIXEL_PRECISION bits.
+//d + (c_1 - c1) / (2*(max(c_1, c1) - c)) in integer arithmetic, d for a flat parabola
+inline unsigned subpixel_disparity(unsigned bestIdx, unsigned c_1, unsigned c, unsigned c1)
+{
+	const long long den = 2 * ((long long)std::max(c_1, c1) - c);
+	if (den <= 0)
+		return bestIdx * (1<<SUBPIXEL_PRECISION);
+
+	//|c_1 - c1| <= den/2, the numerator is positive and the division rounds down
+	const long long num = ((long long)bestIdx * den + c_1 - c1) * (1<<SUBPIXEL_PRECISION);
+	return (unsigned)(num / den);
+}
+
+//bestD of the winner bestIdx with sums c_1/c/c1 at bestIdx-1/bestIdx/bestIdx+1, SUBPIXEL_PRECISION fixed point
+//with or without subpixelRefine
+inline unsigned wta_disparity(int bestIdx, unsigned c_1, unsigned c, unsigned c1, int dMax, bool subpixelRefine)
+{
+	if (subpixelRefine && bestIdx > 1 && bestIdx + 1 < dMax)
+		return subpixel_disparity(bestIdx, c_1, c, c1);
+	return bestIdx * (1<<SUBPIXEL_PRECISION);
+}
+
+//lowest sum outside of bestIdx-1 .. bestIdx+1, confidence of the winner
+inline unsigned second_cost(const PathSum* S, int dMax, int bestIdx)
+{
+	return std::min(sgm_min_sum_range(S, 0, bestIdx - 1), sgm_min_sum_range(S, std::min(bestIdx + 2, dMax), dMax));
+}
+
+/* winner takes all on the path cost sums Sp (width x height x dMax), the output rows of bestD/minC
+ * follow the rows of Sp. argmin, subpixel position and the optional second best cost secondC are
+ * done in one pass while the sums of the pixel are in the cache
+ */
+inline void sgm_wta(unsigned* bestD, unsigned* minC, const PathSum* Sp, int width, int height, int dMax, bool subpixelRefine,
+        unsigned* secondC = NULL)
+{
+    const size_t costPerRowEntry = (size_t)width*dMax;
+
+    for(int y = 0; y< height; y++) {
+        const PathSum* ptrSp = Sp + y*costPerRowEntry;
+        for (int x = 0; x <width; x++) {
+            const PathSum* ptrSpCur = ptrSp + dMax*x;
+            const size_t i = (size_t)y*width + x;
+            PathSum minCost;
+            const int bestIdx = sgm_argmin(ptrSpCur, dMax, minCost);
+
+            minC[i] = minCost;
+            bestD[i] = wta_disparity(bestIdx, bestIdx > 0 ? ptrSpCur[bestIdx-1] : 0, minCost,
+                bestIdx + 1 < dMax ? ptrSpCur[bestIdx+1] : 0, dMax, subpixelRefine);
+
+            if (secondC)
+                secondC[i] = second_cost(ptrSpCur, dMax, bestIdx);
+        }
+    }
+}
+
+/* path aggregation and winner takes all of sgm() on caller provided buffers
+ * L: sgm_aggregate_buffer_size() path cost entries, ws: threads path workspaces, Sp: width x height x dMax sums
+ * pool: optional persistent workers with at least threads - 1 threads
+ */
+template <class CostRows>
+void sgm_run(unsigned* bestD, unsigned* minC,
+        PixelType* I1, CostRows& costRows, int width, int height, int dMax,
+        int P1, int P2, bool subpixelRefine, int threads, int paths,
+        PathCost* L, EpiPath::Workspace* ws, PathSum* Sp, SgmWorkerPool* pool = NULL, unsigned* secondC = NULL)
+{
+    const bool adpativeP2 = false;
+    const int totalPass = 2;
+
+    SgmAggregateParams params = { width, height, dMax, totalPass, paths, threads, pool };
+    EpiPath path = { I1, width, dMax, P1, P2, adpativeP2 };
+
+    sgm_aggregate(Sp, costRows, path, ws, L, params);
+
+    sgm_wta(bestD, minC, Sp, width, height, dMax, subpixelRefine, secondC);
+}
+
+/* sgm on 3-D cost volume
+ * Output:
+ * bestD is the output best index along the third dimension, in SUBPIXEL_PRECISION fixed point
+ * minC is the corresponding cost along with best index
+ *
+ * Input:
+ * costRows: rows of the 3-d cost volume, costRows.row(y) returns the width x dMax costs of row y.
+ *           the rows are swept top-down and bottom-up, with threads > 1 they are requested concurrently
+ * width/height/dMax: width/height/dMax(third dimension) of C
+ * P1/P2: small/large penalty
+ * subpixelRefine: enable/disable subpixel position estimation
+ * threads: number of threads of the path aggregation
+ * paths: number of path directions, 4, 8 or 16
+ * lowMemory: two pass aggregation which keeps the best candidates of each pixel instead of the
+ *            width x height x dMax path cost sums. Approximate, the winner can differ from the full volume
+ *            (measured rates in sgm_aggregate.h)
+ * secondC: optional output, lowest cost outside of bestD-1 .. bestD+1. with lowMemory the lowest of the
+ *          other candidates, MAX_PATH_SUM if they are all next to bestD
+ *
+ */
+template <class CostRows>
+void sgm(unsigned* bestD, unsigned* minC,
+        PixelType* I1, CostRows& costRows, int width, int height, int dMax,
+        int P1, int P2, bool subpixelRefine, int threads = 1, int paths = 4, bool lowMemory = false,
+        unsigned* secondC = NULL)
+{
+    const bool adpativeP2 = false;
+    const int totalPass = 2;
+
+    SgmAggregateParams params = { width, height, dMax, totalPass, paths, threads, NULL };
+    EpiPath path = { I1, width, dMax, P1, P2, adpativeP2 };
+
+    //allocate path cost buffers
+    PathCost* L = (PathCost*) mxMalloc (sizeof(PathCost) * sgm_aggregate_buffer_size(params));
+    EpiPath::Workspace* ws = (EpiPath::Workspace*) mxMalloc (sizeof(EpiPath::Workspace) * threads);
+
+    if (lowMemory) {
+        //best candidates of each pixel with their d-1/d+1 neighbours
+        const SgmSummaryParams summaryParams = { 2, { -1, 1 } };
+        SgmCandidate* summary = (SgmCandidate*) mxMalloc (sizeof(SgmCandidate) * (size_t)width * height * SGM_SUMMARY_CANDIDATES);
+        PathSum* band = (PathSum*) mxMalloc (sizeof(PathSum) * sgm_summary_band_size(params));
+
+        sgm_aggregate_summary(summary, costRows, path, ws, L, band, params, summaryParams);
+
+        for (int i = 0; i < width*height; i++) {
+            const SgmCandidate* cand = summary + (size_t)i*SGM_SUMMARY_CANDIDATES;
+            const SgmCandidate* best = sgm_summary_best(cand);
+            const unsigned bestIdx = best->d;
+            minC[i] = best->cost[0];
+
+            bestD[i] = wta_disparity(bestIdx, best->cost[1], best->cost[0], best->cost[2], dMax, subpixelRefine);
+
+            if (secondC) {
+                secondC[i] = MAX_PATH_SUM;
+                for (int k = 0; k < SGM_SUMMARY_CANDIDATES && cand[k].d >= 0; k++) {
+                    if (abs(cand[k].d - best->d) > 1)
+                        secondC[i] = std::min<unsigned>(secondC[i], cand[k].cost[0]);
+                }
+            }
+        }
+
+        mxFree(summary);
+        mxFree(band);
+        mxFree(L);
+        mxFree(ws);
+        return;
+    }
+
+    //sum of path cost from all directions
+    PathSum* Sp = (PathSum*) mxMalloc (sizeof(PathSum) * (size_t)width * height * dMax);
+
+    sgm_run(bestD, minC, I1, costRows, width, height, dMax, P1, P2, subpixelRefine, threads, paths,
+        L, ws, Sp, NULL, secondC);
+
+    mxFree(L);
+    mxFree(ws);
+    mxFree(Sp);
+}
+
+
+/*
+ * analytic epipolar geometry of the matching cost, 0-based pixel coordinates. Replaces the pixelPosD0,
+ * normlizeDirection and offsetFromPosD0 planes (40 bytes per pixel) of epipolar_geometry.m: the rotation
+ * compensated position H*p is projected onto the epipolar line F*p (rotation_motion.m), which gives the zero
+ * disparity position, and the search runs along the line away from (expansion) or towards the epipole.
+ */
+typedef struct _epiGeometryParams
+{
+	double H[9];            //rotation compensating homography, row major
+	double F[9];            //fundamental matrix, row major
+	double epipole[2];      //epipole in I2
+	int expansion;
+} EpiGeometryParams;
+
+const int EPI_GEOMETRY_CHUNK = 64;  //pixels per epi_geometry_row() call of the kernels, stack buffers
+
+/*
+ * geometry of pixels x0 .. x0+n-1 of row y in float: zero disparity position posX/posY, unit search direction
+ * dirX/dirY and distance to the epipole offset. The homography and line terms are affine along the row.
+ */
+inline void epi_geometry_row(const EpiGeometryParams& g, int x0, int n, int y,
+	float* posX, float* posY, float* dirX, float* dirY, float* offset)
+{
+	//H*p and F*p = a*x + b of the row
+	const float hax = (float)g.H[0], hay = (float)g.H[3], haz = (float)g.H[6];
+	const float hbx = (float)(g.H[1]*y + g.H[2]), hby = (float)(g.H[4]*y + g.H[5]), hbz = (float)(g.H[7]*y + g.H[8]);
+	const float la0 = (float)g.F[0], la1 = (float)g.F[3], la2 = (float)g.F[6];
+	const float lb0 = (float)(g.F[1]*y + g.F[2]), lb1 = (float)(g.F[4]*y + g.F[5]), lb2 = (float)(g.F[7]*y + g.F[8]);
+	const float ex = (float)g.epipole[0];
+	const float ey = (float)g.epipole[1];
+	const float sign = g.expansion ? 1.0f : -1.0f;
+
+	int i = 0;
+#if defined(__AVX2__)
+	const __m256 one = _mm256_set1_ps(1.0f);
+	const __m256 zero = _mm256_setzero_ps();
+	const __m256 minNorm2 = _mm256_set1_ps(1e-12f);
+	for (; i + 8 <= n; i += 8) {
+		const __m256 x = _mm256_add_ps(_mm256_set1_ps((float)(x0 + i)), _mm256_setr_ps(0, 1, 2, 3, 4, 5, 6, 7));
+
+		//rotation compensated position
+		const __m256 pz = _mm256_add_ps(_mm256_mul_ps(_mm256_set1_ps(haz), x), _mm256_set1_ps(hbz));
+		const __m256 px = _mm256_div_ps(_mm256_add_ps(_mm256_mul_ps(_mm256_set1_ps(hax), x), _mm256_set1_ps(hbx)), pz);
+		const __m256 py = _mm256_div_ps(_mm256_add_ps(_mm256_mul_ps(_mm256_set1_ps(hay), x), _mm256_set1_ps(hby)), pz);
+
+		//projected onto the epipolar line, lines with a zero normal are taken unnormalized
+		const __m256 l0 = _mm256_add_ps(_mm256_mul_ps(_mm256_set1_ps(la0), x), _mm256_set1_ps(lb0));
+		const __m256 l1 = _mm256_add_ps(_mm256_mul_ps(_mm256_set1_ps(la1), x), _mm256_set1_ps(lb1));
+		const __m256 l2 = _mm256_add_ps(_mm256_mul_ps(_mm256_set1_ps(la2), x), _mm256_set1_ps(lb2));
+		__m256 norm2 = _mm256_add_ps(_mm256_mul_ps(l0, l0), _mm256_mul_ps(l1, l1));
+		norm2 = _mm256_blendv_ps(norm2, one, _mm256_cmp_ps(norm2, minNorm2, _CMP_LT_OQ));
+		const __m256 t = _mm256_div_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(l0, px), _mm256_mul_ps(l1, py)), l2), norm2);
+		const __m256 qx = _mm256_sub_ps(px, _mm256_mul_ps(t, l0));
+		const __m256 qy = _mm256_sub_ps(py, _mm256_mul_ps(t, l1));
+
+		const __m256 dx = _mm256_mul_ps(_mm256_set1_ps(sign), _mm256_sub_ps(qx, _mm256_set1_ps(ex)));
+		const __m256 dy = _mm256_mul_ps(_mm256_set1_ps(sign), _mm256_sub_ps(qy, _mm256_set1_ps(ey)));
+		const __m256 dist = _mm256_sqrt_ps(_mm256_add_ps(_mm256_mul_ps(dx, dx), _mm256_mul_ps(dy, dy)));
+		const __m256 inv = _mm256_blendv_ps(_mm256_div_ps(one, dist), zero, _mm256_cmp_ps(dist, zero, _CMP_LE_OQ));
+
+		_mm256_storeu_ps(posX + i, qx);
+		_mm256_storeu_ps(posY + i, qy);
+		_mm256_storeu_ps(dirX + i, _mm256_mul_ps(dx, inv));
+		_mm256_storeu_ps(dirY + i, _mm256_mul_ps(dy, inv));
+		_mm256_storeu_ps(offset + i, dist);
+	}
+#endif
+	for (; i < n; i++) {
+		const float x = (float)(x0 + i);
+		const float pz = haz*x + hbz;
+		const float px = (hax*x + hbx) / pz;
+		const float py = (hay*x + hby) / pz;
+
+		const float l0 = la0*x + lb0;
+		const float l1 = la1*x + lb1;
+		const float l2 = la2*x + lb2;
+		float norm2 = l0*l0 + l1*l1;
+		if (norm2 < 1e-12f)
+			norm2 = 1.0f;
+		const float t = (l0*px + l1*py + l2) / norm2;
+		posX[i] = px - t*l0;
+		posY[i] = py - t*l1;
+
+		const float dx = sign * (posX[i] - ex);
+		const float dy = sign * (posY[i] - ey);
+		const float dist = std::sqrt(dx*dx + dy*dy);
+		const float inv = dist > 0 ? 1.0f / dist : 0.0f;
+		dirX[i] = dx * inv;
+		dirY[i] = dy * inv;
+		offset[i] = dist;
+	}
+}
+
+//vz-index of (subpixel) disparity d, the search offset along the line is offset * vzInd
+inline double epi_vzind(double d, double n, double vMax)
+{
+	double vzRatio = 1.0 * d / n * vMax;
+	return vzRatio / (1 - vzRatio);
+}
+
+//per disparity vz-index table of the matching cost, dMax entries
+inline void epi_vzind_table(double* vzInd, int dMax, double vMax)
+{
+	for (int d = 0; d < dMax; d++)
+		vzInd[d] = epi_vzind(d, dMax + 1, vMax);
+}
+
+//inputs of the epipolar matching cost, the geometry is either analytic or given as planes
+typedef struct _epiCostParams
+{
+	const CensusWindow::CodeType* cen1;     //census of I1/I2
+	const CensusWindow::CodeType* cen2;
+	int width;
+	int height;
+	int dMax;
+	double vMax;
+	const double* pixelPosD0;               //geometry planes of epipolar_geometry.m (1-based positions)
+	const double* normlizeDirection;
+	const double* offsetFromPosD0;
+	const EpiGeometryParams* geometry;      //analytic geometry, replaces the planes if set
+	const double* vzInd;                    //optional epi_vzind_table()
+} EpiCostParams;
+
+//matching costs of one pixel along its epipolar line, 0-based zero disparity position
+inline void calc_match_cost_pixel(CostType* ptrC, const EpiCostParams& p, CensusWindow::CodeType cenCode1,
+	double refPosD0X, double refPosD0Y, double ux, double uy, double offset)
+{
+	const int width = p.width;
+	const int height = p.height;
+	const int dMax = p.dMax;
+	const double n = dMax + 1;
+
+	for (int d = 0; d < dMax; d++) {
+#ifdef USE_VZIND
+		double vzInd = p.vzInd != NULL ? p.vzInd[d] : epi_vzind(d, n, p.vMax);
+
+		//offset from starting searching position
+
+		double offsetX = offset * vzInd * ux;
+		double offsetY = offset * vzInd * uy;
+#else
+		double offsetX = d * ux;
+		double offsetY = d * uy;
+#endif
+		int x2 = round(refPosD0X + offsetX);
+		int y2 = round(refPosD0Y + offsetY);
+
+		x2 = clamp(x2, 0, width - 1);
+		y2 = clamp(y2, 0, height - 1);
+
+		CensusWindow::CodeType cenCode2 = p.cen2[y2*width + x2];
+		ptrC[d] = hamming_cost(cenCode1, cenCode2);
+	}
+}
+
+//matching cost of image row y along the epipolar lines (before aggregation), width x dMax entries
+inline void calc_match_cost_row(CostType* Crow, const EpiCostParams& p, int y)
+{
+	const int width = p.width;
+	const int height = p.height;
+	const int dMax = p.dMax;
+
+	if (p.geometry != NULL) {
+		float posX[EPI_GEOMETRY_CHUNK], posY[EPI_GEOMETRY_CHUNK];
+		float dirX[EPI_GEOMETRY_CHUNK], dirY[EPI_GEOMETRY_CHUNK], offset[EPI_GEOMETRY_CHUNK];
+		for (int x0 = 0; x0 < width; x0 += EPI_GEOMETRY_CHUNK) {
+			const int n = std::min(EPI_GEOMETRY_CHUNK, width - x0);
+			epi_geometry_row(*p.geometry, x0, n, y, posX, posY, dirX, dirY, offset);
+			for (int i = 0; i < n; i++) {
+				const int x = x0 + i;
+				calc_match_cost_pixel(Crow + dMax*x, p, p.cen1[y*width + x], posX[i], posY[i], dirX[i], dirY[i], offset[i]);
+			}
+		}
+		return;
+	}
+
+	const double* normlizeDirectionX = p.normlizeDirection;
+	const double* normlizeDirectionY = p.normlizeDirection + width*height;
+
+	const double* refPixelPosD0X = p.pixelPosD0;
+	const double* refPixelPosD0Y = p.pixelPosD0 + width*height;
+
+	for (int x = 0; x< width; x++) {
+		//the starting searching position in reference image
+		double refPosD0X = refPixelPosD0X[y*width + x] - 1; //due to the 1-indexing of matlab
+		double refPosD0Y = refPixelPosD0Y[y*width + x] - 1;
+
+		//unit direction vector
+		double ux = normlizeDirectionX[y*width + x];
+		double uy = normlizeDirectionY[y*width + x];
+
+		calc_match_cost_pixel(Crow + dMax*x, p, p.cen1[y*width + x], refPosD0X, refPosD0Y, ux, uy,
+			p.offsetFromPosD0[y*width + x]);
+	}
+}
+
+//construct the full aggregated cost volume on caller provided buffers
+//Ctmp: width x height x dMax matching costs, aggSum: (width + 1) x dMax box filter sums
+inline void calc_cost(CostType* C, const EpiCostParams& p, int aggWinRadius, CostType* Ctmp, unsigned* aggSum)
+{
+	const int width = p.width;
+	const int height = p.height;
+	const int dMax = p.dMax;
+
+	for (int y = 0; y < height; y++)
+		calc_match_cost_row(Ctmp + (size_t)y*dMax*width, p, y);
+
+	//box filtering
+	box_filter_cost(C, Ctmp, width, height, dMax, aggWinRadius, aggSum);
+}
+
+//construct the full aggregated cost volume
+inline void calc_cost(CostType* C, const EpiCostParams& p, int aggWinRadius)
+{
+	CostType* Ctmp = (CostType*)mxMalloc((size_t)p.width * p.height * p.dMax * sizeof(CostType));
+	unsigned* aggSum = (unsigned*)mxMalloc((p.width + 1) * p.dMax * sizeof(unsigned));
+
+	calc_cost(C, p, aggWinRadius, Ctmp, aggSum);
+
+	mxFree(Ctmp);
+	mxFree(aggSum);
+}
+
+//cost rows of a materialized cost volume
+struct VolumeCostRows
+{
+	const CostType* C;
+	int costPerRow;
+
+	const CostType* row(int y) { return C + (size_t)y*costPerRow; }
+};
+
+/*
+ * aggregated cost rows produced on demand, without materializing the cost volume.
+ *
+ * Matching cost rows are kept in a ring of 2*radius+2 rows and the vertical box sums are moved
+ * incrementally when consecutive rows are requested in either direction, so the top-down and the
+ * bottom-up SGM pass both stream through the image. Rows which fell out of the ring (e.g. in the
+ * second pass) are recomputed. Memory is O(width*dMax*radius) instead of O(width*height*dMax).
+ */
+struct StreamCostRows
+{
+	EpiCostParams params;
+	int radius;
+	int ringSize;
+	int costPerRow;
+	CostType* ring;        //matching cost rows
+	int* ringRowY;         //image row held by each ring slot, -1 if empty
+	unsigned* colSum;      //vertical box sums of curY, followed by the dMax entries of the horizontal sum
+	CostType* aggRow;      //aggregated cost of curY
+	int curY;
+	bool ownBuffer;
+
+	//bytes of the buffers for width x dMax cost rows, the unsigned/int arrays come first
+	static size_t buffer_size(int width, int dMax, int aggWinRadius)
+	{
+		const size_t costPerRow = (size_t)width*dMax;
+		return (costPerRow + dMax) * sizeof(unsigned) + (2*aggWinRadius + 2) * sizeof(int)
+			+ (2*aggWinRadius + 2) * costPerRow * sizeof(CostType)
+			+ (costPerRow + SGM_SIMD_WIDTH) * sizeof(CostType); //sgm_step reads whole simd blocks
+	}
+
+	//buffer: optional caller memory of buffer_size() bytes, allocated otherwise
+	StreamCostRows(const EpiCostParams& p, int aggWinRadius, void* buffer = NULL)
+		: params(p), radius(aggWinRadius), ringSize(2*aggWinRadius + 2), costPerRow(p.width*p.dMax), curY(-1),
+		ownBuffer(buffer == NULL)
+	{
+		if (ownBuffer)
+			buffer = mxMalloc(buffer_size(p.width, p.dMax, aggWinRadius));
+		colSum = (unsigned*)buffer;
+		ringRowY = (int*)(colSum + costPerRow + p.dMax);
+		ring = (CostType*)(ringRowY + ringSize);
+		aggRow = ring + ringSize * costPerRow;
+		for (int i = 0; i < ringSize; i++)
+			ringRowY[i] = -1;
+	}
+
+	~StreamCostRows()
+	{
+		if (ownBuffer)
+			mxFree(colSum);
+	}
+
+	//matching cost of row y, border rows are clamped
+	const CostType* match_row(int y)
+	{
+		y = clamp(y, 0, params.height - 1);
+		int slot = y % ringSize;
+		CostType* ptrRow = ring + slot*costPerRow;
+		if (ringRowY[slot] != y) {
+			calc_match_cost_row(ptrRow, params, y);
+			ringRowY[slot] = y;
+		}
+		return ptrRow;
+	}
+
+	const CostType* row(int y)
+	{
+		if (y == curY)
+			return aggRow;
+
+		if (curY >= 0 && (y == curY + 1 || y == curY - 1)) {
+			//one row enters and one row leaves the window
+			const CostType* ptrIn = match_row(y > curY ? y + radius : y - radius);
+			const CostType* ptrOut = match_row(y > curY ? curY - radius : curY + radius);
+			for (int i = 0; i < costPerRow; i++)
+				colSum[i] += ptrIn[i] - ptrOut[i];
+		} else {
+			for (int i = 0; i < costPerRow; i++)
+				colSum[i] = 0;
+			for (int dy = -radius; dy <= radius; dy++) {
+				const CostType* ptrRow = match_row(y + dy);
+				for (int i = 0; i < costPerRow; i++)
+					colSum[i] += ptrRow[i];
+			}
+		}
+
+		curY = y;
+		box_filter_row(aggRow, colSum, params.width, params.dMax, radius, colSum + costPerRow);
+		return aggRow;
+	}
+};
+
+/*
+ * sgm in horizontal strips for images whose cost volume does not fit in memory, see sgm_tiles.h
+ * The tiles run in parallel on up to threads workers (capped by tileParams.budgetRows), each streams its cost
+ * rows and keeps the path cost sums of one tile.
+ */
+inline void sgm_tiled(unsigned* bestD, unsigned* minC, PixelType* I1, const EpiCostParams& costParams, int aggWinRadius,
+        int P1, int P2, bool subpixelRefine, int threads, int paths, const SgmTileParams& tileParams, unsigned* secondC = NULL)
+{
+	const bool adpativeP2 = false;
+	const int totalPass = 2;
+	const int width = costParams.width;
+	const int dMax = costParams.dMax;
+
+	std::vector<SgmTile> tiles = sgm_tiles(costParams.height, tileParams);
+	const int workers = sgm_tile_workers(costParams.height, (int)tiles.size(), threads, tileParams);
+	const int maxRows = sgm_tile_max_rows(costParams.height, tileParams);
+	SgmAggregateParams params = { width, maxRows, dMax, totalPass, paths, 1, NULL };
+
+	//per worker buffers, the MATLAB allocator must not be called by the workers
+	const size_t bufferSize = sgm_aggregate_buffer_size(params);
+	const size_t spSize = (size_t)width * maxRows * dMax;
+	PathCost* L = (PathCost*) mxMalloc (sizeof(PathCost) * bufferSize * workers);
+	PathSum* Sp = (PathSum*) mxMalloc (sizeof(PathSum) * spSize * workers);
+	std::vector<StreamCostRows*> costRows(workers);
+	for (int w = 0; w < workers; w++)
+		costRows[w] = new StreamCostRows(costParams, aggWinRadius);
+
+	sgm_tile_run(tiles, workers, [&](const SgmTile& t, int worker) {
+		SgmAggregateParams tileAggParams = params;
+		tileAggParams.height = t.ty1 - t.ty0;
+		TileCostRows<StreamCostRows> tileRows = { costRows[worker], t.ty0 };
+		EpiPath path = { I1 + (size_t)t.ty0*width, width, dMax, P1, P2, adpativeP2 };
+		EpiPath::Workspace ws = 0;
+		PathSum* tileSp = Sp + spSize*worker;
+
+		sgm_aggregate(tileSp, tileRows, path, &ws, L + bufferSize*worker, tileAggParams);
+		sgm_wta(bestD + (size_t)t.y0*width, minC + (size_t)t.y0*width, tileSp + (size_t)(t.y0 - t.ty0)*width*dMax,
+			width, t.y1 - t.y0, dMax, subpixelRefine, secondC ? secondC + (size_t)t.y0*width : NULL);
+	});
+
+	for (int w = 0; w < workers; w++)
+		delete costRows[w];
+	mxFree(L);
+	mxFree(Sp);
+}
+
+inline void convert_vzInd_to_disp(unsigned* D, int width, int height, double* offsetFromPosD0, double vMax, int n)
+{
+    for (int y = 0; y< height; y++) {
+        for(int x= 0; x < width; x++) {
+            double d = double(D[y*width + x])/(1<<SUBPIXEL_PRECISION);
+
+            double vzRatio = d / n * vMax;
+            mxAssert(vzRatio != 1 , "vZratio shoud not equal to 1" );
+            double vzInd = vzRatio/(1-vzRatio);
+            D[y*width + x] = (offsetFromPosD0[y*width + x] * vzInd) * (1<<SUBPIXEL_PRECISION);
+        }
+    }
+}
+
+//convert_vzInd_to_disp() with the offsets of the analytic geometry
+inline void convert_vzInd_to_disp(unsigned* D, int width, int height, const EpiGeometryParams& g, double vMax, int n)
+{
+    float posX[EPI_GEOMETRY_CHUNK], posY[EPI_GEOMETRY_CHUNK];
+    float dirX[EPI_GEOMETRY_CHUNK], dirY[EPI_GEOMETRY_CHUNK], offset[EPI_GEOMETRY_CHUNK];
+    for (int y = 0; y < height; y++) {
+        for (int x0 = 0; x0 < width; x0 += EPI_GEOMETRY_CHUNK) {
+            const int m = std::min(EPI_GEOMETRY_CHUNK, width - x0);
+            epi_geometry_row(g, x0, m, y, posX, posY, dirX, dirY, offset);
+            for (int i = 0; i < m; i++) {
+                double d = double(D[y*width + x0 + i])/(1<<SUBPIXEL_PRECISION);
+                D[y*width + x0 + i] = (offset[i] * epi_vzind(d, n, vMax)) * (1<<SUBPIXEL_PRECISION);
+            }
+        }
+    }
+}
+
+//flow of the analytic geometry into the flowX/flowY planes: disparity D along the epipolar direction + rotation
+//flow (zero disparity position - pixel)
+inline void epi_flow(double* flowX, double* flowY, const unsigned* D, int width, int height, const EpiGeometryParams& g)
+{
+    float posX[EPI_GEOMETRY_CHUNK], posY[EPI_GEOMETRY_CHUNK];
+    float dirX[EPI_GEOMETRY_CHUNK], dirY[EPI_GEOMETRY_CHUNK], offset[EPI_GEOMETRY_CHUNK];
+    for (int y = 0; y < height; y++) {
+        for (int x0 = 0; x0 < width; x0 += EPI_GEOMETRY_CHUNK) {
+            const int m = std::min(EPI_GEOMETRY_CHUNK, width - x0);
+            epi_geometry_row(g, x0, m, y, posX, posY, dirX, dirY, offset);
+            for (int i = 0; i < m; i++) {
+                const size_t idx = (size_t)y*width + x0 + i;
+                const double d = double(D[idx])/(1<<SUBPIXEL_PRECISION);
+                flowX[idx] = d*dirX[i] + posX[i] - (x0 + i);
+                flowY[idx] = d*dirY[i] + posY[i] - y;
+            }
+        }
+    }
+}
+
+
+inline void calc_disp_from_first(unsigned* 
+    D2, unsigned* D1, int width, int height, 
+    double* pixelPosD0, double* normlizeDirection, double* offsetFromPosD0, double vMax, int n)
+{
+    double* normlizeDirectionX = normlizeDirection;
+    double* normlizeDirectionY = normlizeDirection + width*height;
+
+    double* refPixelPosD0X = pixelPosD0;
+    double* refPixelPosD0Y = pixelPosD0 + width*height;
+
+    //initialize D2 to invalid data
+    for (int y = 0; y < height; y++)
+        for (int x = 0; x < width; x++)
+            D2[y*width + x] = INVALID_DISPARITY;
+
+    for (int y = 0; y < height; y++) {
+        for (int x = 0; x < width; x++) {
+#ifdef USE_VZIND
+            double d = double(D1[y*width + x]) / (1 << SUBPIXEL_PRECISION);
+            double vzRatio = d / n * vMax;
+            mxAssert(vzRatio != 1, "vZratio shoud not equal to 1");
+            double vzInd = vzRatio / (1 - vzRatio);
+            d = offsetFromPosD0[y*width + x] * vzInd;
+#else 
+            double d = double(D1[y*width + x]) / (1 << SUBPIXEL_PRECISION);
+#endif
+            //the starting searching position in reference image
+            double refPosD0X = refPixelPosD0X[y*width + x] - 1; //due to the 1-indexing of matlab
+            double refPosD0Y = refPixelPosD0Y[y*width + x] - 1;
+            //unit direction vector
+            double ux = normlizeDirectionX[y*width + x];
+            double uy = normlizeDirectionY[y*width + x];
+
+            int p2x = refPosD0X + d * ux;
+            int p2y = refPosD0Y + d * uy;
+
+            //set four grids around (p2x, p2y) to D1, if grid is at a valid position
+            for (int dy = 0; dy <= 1; dy++) {
+                for (int dx = 0; dx <= 1; dx++) {
+                    int tx = dx + p2x;
+                    int ty = dy + p2y;
+
+                    if (tx >= 0 && tx < width && ty >= 0 && ty < height) {
+                        if (D2[ty*width + tx] == INVALID_DISPARITY || D2[ty*width + tx] < D1[y*width + x])
+                            D2[ty*width + tx] = D1[y*width + x];
+                    }
+                }
+            }
+        }
+    }
+
+}
+
+inline void forward_backward_check(unsigned char* conf, unsigned* D2, unsigned* D1, int width, int height,
+    double* pixelPosD0, double* normlizeDirection, double* offsetFromPosD0, double vMax, int n, int thr=2)
+{
+    memset(conf, 1, sizeof(unsigned char) * width*height);
+
+    //unsigned* D2 = (unsigned*)mxMalloc(width*height * sizeof(unsigned));
+
+    //derive D2 from D1
+    calc_disp_from_first(D2, D1, width, height, pixelPosD0, normlizeDirection, offsetFromPosD0, vMax, n);
+
+    double* refPixelPosD0X = pixelPosD0;
+    double* refPixelPosD0Y = pixelPosD0 + width*height;
+
+    double* normlizeDirectionX = normlizeDirection;
+    double* normlizeDirectionY = normlizeDirection + width*height;
+
+    //forward-backward checking
+    for (int y = 0; y < height; y++) {
+        for (int x = 0; x < width; x++) {
+#ifdef USE_VZIND
+            double d = double(D1[y*width + x]) / (1 << SUBPIXEL_PRECISION);
+            double vzRatio = d / n * vMax;
+            mxAssert(vzRatio != 1, "vZratio shoud not equal to 1");
+            double vzInd = vzRatio / (1 - vzRatio);
+            d = offsetFromPosD0[y*width + x] * vzInd;
+#else 
+            double d = double(D1[y*width + x]) / (1 << SUBPIXEL_PRECISION);
+#endif
+            double refPosD0X = refPixelPosD0X[y*width + x] - 1; //due to the 1-indexing of matlab
+            double refPosD0Y = refPixelPosD0Y[y*width + x] - 1;
+            //unit direction vector
+            double ux = normlizeDirectionX[y*width + x];
+            double uy = normlizeDirectionY[y*width + x];
+
+            int p2x = round(refPosD0X + d * ux);
+            int p2y = round(refPosD0Y + d * uy);
+
+            if (p2x < 0 || p2x > width - 1 || p2y <0 || p2y > height - 1) {
+                conf[y*width + x] = 0;
+                continue;
+            }
+
+            if (D2[p2y * width + p2x] == INVALID_DISPARITY) {
+                conf[y*width + x] = 0;
+                continue;
+            }
+
+            if (std::abs(int(D1[y*width + x]) - int(D2[p2y*width + p2x])) > thr)
+                conf[y*width + x] = 0;
+
+        }
+    }
+
+    //mxFree(D2);
+}
+
+#endif
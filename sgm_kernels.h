@@ -0,0 +1,290 @@
+#ifndef _SGM_KERNELS_H_
+#define _SGM_KERNELS_H_
+#include <emmintrin.h>
+#include "common.h"
+#if defined(__AVX2__) || defined(__AVX512BW__)
+#include <immintrin.h>
+#endif
+
+/*
+ * Vectorized SGM path cost kernels, SGM_SIMD_WIDTH disparities per instruction
+ * (SSE2: 16, AVX2: 32, AVX-512BW: 64).
+ *
+ * Path costs use a padded entry per pixel so that the d-1/d+1 neighbours are plain shifted loads:
+ *
+ *     L[-1] | L[0] ... L[dMax-1] | L[dMax] ... L[padded] | L[padded+1] | ...
+ *      255  |    path costs      |    255 (sentinels)    |   minimum   |
+ *
+ * with padded = sgm_padded_dmax(dMax). L points to the first path cost, buffers must be filled
+ * with 255 once before use, the steps never overwrite the sentinels with anything else.
+ */
+#if defined(__AVX512BW__)
+#define SGM_SIMD_WIDTH 64
+#elif defined(__AVX2__)
+#define SGM_SIMD_WIDTH 32
+#else
+#define SGM_SIMD_WIDTH 16
+#endif
+
+//number of path cost entries processed per pixel, dMax rounded up to SGM_SIMD_WIDTH
+inline int sgm_padded_dmax(int dMax) {return (dMax + SGM_SIMD_WIDTH - 1) / SGM_SIMD_WIDTH * SGM_SIMD_WIDTH;}
+
+//index of the minimum path cost relative to L
+inline int sgm_path_min_index(int dMax) {return sgm_padded_dmax(dMax) + 1;}
+
+//distance between the padded entries of two pixels
+inline int sgm_path_stride(int dMax) {return sgm_padded_dmax(dMax) + SGM_SIMD_WIDTH;}
+
+#if defined(__AVX512BW__)
+typedef __m512i SgmVec;
+inline SgmVec sgm_load(const PathCost* p) {return _mm512_loadu_si512((const void*)p);}
+inline void sgm_store(PathCost* p, SgmVec v) {_mm512_storeu_si512((void*)p, v);}
+inline SgmVec sgm_set1(int v) {return _mm512_set1_epi8((char)v);}
+inline SgmVec sgm_min(SgmVec a, SgmVec b) {return _mm512_min_epu8(a, b);}
+inline SgmVec sgm_adds(SgmVec a, SgmVec b) {return _mm512_adds_epu8(a, b);}
+inline SgmVec sgm_subs(SgmVec a, SgmVec b) {return _mm512_subs_epu8(a, b);}
+//set lanes n .. SGM_SIMD_WIDTH-1 to MAX_PATH_COST, 0 < n < SGM_SIMD_WIDTH
+inline SgmVec sgm_fill_tail(SgmVec v, int n) {return _mm512_mask_mov_epi8(v, ~0ULL << n, _mm512_set1_epi8((char)MAX_PATH_COST));}
+inline __m128i sgm_min_128(SgmVec v)
+{
+    __m256i v256 = _mm256_min_epu8(_mm512_castsi512_si256(v), _mm512_extracti64x4_epi64(v, 1));
+    return _mm_min_epu8(_mm256_castsi256_si128(v256), _mm256_extracti128_si256(v256, 1));
+}
+#elif defined(__AVX2__)
+typedef __m256i SgmVec;
+inline SgmVec sgm_load(const PathCost* p) {return _mm256_loadu_si256((const __m256i*)p);}
+inline void sgm_store(PathCost* p, SgmVec v) {_mm256_storeu_si256((__m256i*)p, v);}
+inline SgmVec sgm_set1(int v) {return _mm256_set1_epi8((char)v);}
+inline SgmVec sgm_min(SgmVec a, SgmVec b) {return _mm256_min_epu8(a, b);}
+inline SgmVec sgm_adds(SgmVec a, SgmVec b) {return _mm256_adds_epu8(a, b);}
+inline SgmVec sgm_subs(SgmVec a, SgmVec b) {return _mm256_subs_epu8(a, b);}
+inline SgmVec sgm_fill_tail(SgmVec v, int n)
+{
+    const __m256i laneIdx = _mm256_setr_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15,
+        16, 17, 18, 19, 20, 21, 22, 23, 24, 25, 26, 27, 28, 29, 30, 31);
+    return _mm256_or_si256(v, _mm256_cmpgt_epi8(laneIdx, _mm256_set1_epi8((char)(n - 1))));
+}
+inline __m128i sgm_min_128(SgmVec v) {return _mm_min_epu8(_mm256_castsi256_si128(v), _mm256_extracti128_si256(v, 1));}
+#else
+typedef __m128i SgmVec;
+inline SgmVec sgm_load(const PathCost* p) {return _mm_loadu_si128((const __m128i*)p);}
+inline void sgm_store(PathCost* p, SgmVec v) {_mm_storeu_si128((__m128i*)p, v);}
+inline SgmVec sgm_set1(int v) {return _mm_set1_epi8((char)v);}
+inline SgmVec sgm_min(SgmVec a, SgmVec b) {return _mm_min_epu8(a, b);}
+inline SgmVec sgm_adds(SgmVec a, SgmVec b) {return _mm_adds_epu8(a, b);}
+inline SgmVec sgm_subs(SgmVec a, SgmVec b) {return _mm_subs_epu8(a, b);}
+inline SgmVec sgm_fill_tail(SgmVec v, int n)
+{
+    const __m128i laneIdx = _mm_setr_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+    return _mm_or_si128(v, _mm_cmpgt_epi8(laneIdx, _mm_set1_epi8((char)(n - 1))));
+}
+inline __m128i sgm_min_128(SgmVec v) {return v;}
+#endif
+
+//16 bit path sums, SGM_SIMD_WIDTH/2 per instruction. sgm_widen() loads and zero extends SGM_SIMD_WIDTH/2 path costs
+#if defined(__AVX512BW__)
+typedef __m512i SgmSumVec;
+inline SgmSumVec sgm_widen(const PathCost* p) {return _mm512_cvtepu8_epi16(_mm256_loadu_si256((const __m256i*)p));}
+inline SgmSumVec sgm_load_sum(const unsigned short* p) {return _mm512_loadu_si512((const void*)p);}
+inline void sgm_store_sum(unsigned short* p, SgmSumVec v) {_mm512_storeu_si512((void*)p, v);}
+inline SgmSumVec sgm_adds_sum(SgmSumVec a, SgmSumVec b) {return _mm512_adds_epu16(a, b);}
+inline SgmSumVec sgm_set1_sum(int v) {return _mm512_set1_epi16((short)v);}
+inline SgmSumVec sgm_min_sum(SgmSumVec a, SgmSumVec b) {return _mm512_min_epu16(a, b);}
+inline bool sgm_any_equal_sum(SgmSumVec a, SgmSumVec b) {return _mm512_cmpeq_epi16_mask(a, b) != 0;}
+inline __m128i sgm_min_sum_128(SgmSumVec v)
+{
+    __m256i v256 = _mm256_min_epu16(_mm512_castsi512_si256(v), _mm512_extracti64x4_epi64(v, 1));
+    return _mm_min_epu16(_mm256_castsi256_si128(v256), _mm256_extracti128_si256(v256, 1));
+}
+#elif defined(__AVX2__)
+typedef __m256i SgmSumVec;
+inline SgmSumVec sgm_widen(const PathCost* p) {return _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)p));}
+inline SgmSumVec sgm_load_sum(const unsigned short* p) {return _mm256_loadu_si256((const __m256i*)p);}
+inline void sgm_store_sum(unsigned short* p, SgmSumVec v) {_mm256_storeu_si256((__m256i*)p, v);}
+inline SgmSumVec sgm_adds_sum(SgmSumVec a, SgmSumVec b) {return _mm256_adds_epu16(a, b);}
+inline SgmSumVec sgm_set1_sum(int v) {return _mm256_set1_epi16((short)v);}
+inline SgmSumVec sgm_min_sum(SgmSumVec a, SgmSumVec b) {return _mm256_min_epu16(a, b);}
+inline bool sgm_any_equal_sum(SgmSumVec a, SgmSumVec b) {return _mm256_movemask_epi8(_mm256_cmpeq_epi16(a, b)) != 0;}
+inline __m128i sgm_min_sum_128(SgmSumVec v) {return _mm_min_epu16(_mm256_castsi256_si128(v), _mm256_extracti128_si256(v, 1));}
+#else
+typedef __m128i SgmSumVec;
+inline SgmSumVec sgm_widen(const PathCost* p) {return _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)p), _mm_setzero_si128());}
+inline SgmSumVec sgm_load_sum(const unsigned short* p) {return _mm_loadu_si128((const __m128i*)p);}
+inline void sgm_store_sum(unsigned short* p, SgmSumVec v) {_mm_storeu_si128((__m128i*)p, v);}
+inline SgmSumVec sgm_adds_sum(SgmSumVec a, SgmSumVec b) {return _mm_adds_epu16(a, b);}
+inline SgmSumVec sgm_set1_sum(int v) {return _mm_set1_epi16((short)v);}
+//SSE2 has no unsigned 16 bit min, a - max(a - b, 0) is exact
+inline SgmSumVec sgm_min_sum(SgmSumVec a, SgmSumVec b) {return _mm_sub_epi16(a, _mm_subs_epu16(a, b));}
+inline bool sgm_any_equal_sum(SgmSumVec a, SgmSumVec b) {return _mm_movemask_epi8(_mm_cmpeq_epi16(a, b)) != 0;}
+inline __m128i sgm_min_sum_128(SgmSumVec v) {return v;}
+#endif
+const int SGM_SUM_WIDTH = SGM_SIMD_WIDTH / 2;
+
+//horizontal minimum of all lanes
+inline PathCost sgm_hmin(SgmVec v)
+{
+    __m128i m = sgm_min_128(v);
+    m = _mm_min_epu8(m, _mm_srli_si128(m, 8));
+    m = _mm_min_epu8(m, _mm_srli_si128(m, 4));
+    m = _mm_min_epu8(m, _mm_srli_si128(m, 2));
+    m = _mm_min_epu8(m, _mm_srli_si128(m, 1));
+    return (PathCost)_mm_cvtsi128_si32(m);
+}
+
+/*
+ * L(d) = C(d) + min(min1(d), min2(d) + P1, min(Lpre) + P2) - min(Lpre) for d < dMax, the padded entries
+ * up to sgm_padded_dmax(dMax) are set to MAX_PATH_COST and the minimum is stored behind them.
+ *
+ * The additions saturate at MAX_PATH_COST, results are identical to the scalar recurrence as long as
+ * 2*max(C) + P2 and max(C) + P2 + P1 stay below 256, which holds for census costs.
+ * min1/min2/C are read in blocks of SGM_SIMD_WIDTH, they must be readable up to sgm_padded_dmax(dMax) entries.
+ */
+inline void sgm_combine(PathCost* L, const PathCost* min1, const PathCost* min2, const CostType* C,
+    int dMax, PathCost LpreMin, int P1, int P2)
+{
+    const int padded = sgm_padded_dmax(dMax);
+    const SgmVec vP1 = sgm_set1(P1);
+    const SgmVec vLpreMin = sgm_set1(LpreMin);
+    const SgmVec vMinP2 = sgm_set1(std::min<int>(LpreMin + P2, MAX_PATH_COST));
+    SgmVec vMinPath = sgm_set1(MAX_PATH_COST);
+
+    for (int d = 0; d < padded; d += SGM_SIMD_WIDTH) {
+        SgmVec bestCost = sgm_min(sgm_min(sgm_load(min1 + d), sgm_adds(sgm_load(min2 + d), vP1)), vMinP2);
+        SgmVec cost = sgm_subs(sgm_adds(sgm_load(C + d), bestCost), vLpreMin);
+
+        //entries beyond dMax keep their sentinel
+        if (d + SGM_SIMD_WIDTH > dMax)
+            cost = sgm_fill_tail(cost, dMax - d);
+        sgm_store(L + d, cost);
+        vMinPath = sgm_min(vMinPath, cost);
+    }
+
+    L[padded + 1] = sgm_hmin(vMinPath); //set minimum value of current path cost
+}
+
+/*
+ * single SGM step of a 1-D disparity path: L(d) = C(d) + min(Lpre(d), Lpre(d+-1) + P1, min(Lpre) + P2) - min(Lpre)
+ * the d-1/d+1 neighbours are shifted loads which hit the sentinels at the border, see sgm_combine()
+ */
+inline void sgm_step(PathCost* L, //current path cost
+    const PathCost* Lpre, //previous path cost
+    const CostType* C, //cost map
+    int dMax,
+    int P1, int P2)
+{
+    const int padded = sgm_padded_dmax(dMax);
+    const PathCost LpreMin = Lpre[padded + 1]; //get minimum value of pre path cost
+    const SgmVec vP1 = sgm_set1(P1);
+    const SgmVec vLpreMin = sgm_set1(LpreMin);
+    const SgmVec vMinP2 = sgm_set1(std::min<int>(LpreMin + P2, MAX_PATH_COST));
+    SgmVec vMinPath = sgm_set1(MAX_PATH_COST);
+
+    for (int d = 0; d < padded; d += SGM_SIMD_WIDTH) {
+        SgmVec min1 = sgm_load(Lpre + d);
+        SgmVec min2 = sgm_min(sgm_load(Lpre + d - 1), sgm_load(Lpre + d + 1));
+        SgmVec bestCost = sgm_min(sgm_min(min1, sgm_adds(min2, vP1)), vMinP2);
+        SgmVec cost = sgm_subs(sgm_adds(sgm_load(C + d), bestCost), vLpreMin);
+
+        //entries beyond dMax keep their sentinel
+        if (d + SGM_SIMD_WIDTH > dMax)
+            cost = sgm_fill_tail(cost, dMax - d);
+        sgm_store(L + d, cost);
+        vMinPath = sgm_min(vMinPath, cost);
+    }
+
+    L[padded + 1] = sgm_hmin(vMinPath); //set minimum value of current path cost
+}
+
+/*
+ * dst(i) = min(src(i + k*step)), k = -2..2, for i = 0 .. n-1 rounded up to SGM_SIMD_WIDTH.
+ * one pass of the separable 5x5 min filter (erosion) of a path cost grid, step is 1 along the
+ * contiguous axis and the column stride along the other one.
+ */
+inline void sgm_min_filter5(PathCost* dst, const PathCost* src, int n, int step)
+{
+    for (int i = 0; i < n; i += SGM_SIMD_WIDTH) {
+        const PathCost* p = src + i;
+        SgmVec m = sgm_min(sgm_min(sgm_load(p - 2*step), sgm_load(p - step)),
+            sgm_min(sgm_load(p + step), sgm_load(p + 2*step)));
+        sgm_store(dst + i, sgm_min(m, sgm_load(p)));
+    }
+}
+
+/*
+ * Sp(d) = L(d) (first path of a pixel) or Sp(d) += L(d), d < dMax. The sums saturate at MAX_PATH_SUM, which
+ * is only reached with more than MAX_PATH_SUM / MAX_PATH_COST paths. Sp is not padded, its last
+ * dMax % SGM_SUM_WIDTH entries are done one by one.
+ */
+inline void sgm_accumulate(PathSum* Sp, const PathCost* L, int dMax, bool first)
+{
+    int d = 0;
+#ifndef SGM_PATH_SUM_32BIT
+    if (first) {
+        for (; d + SGM_SUM_WIDTH <= dMax; d += SGM_SUM_WIDTH)
+            sgm_store_sum(Sp + d, sgm_widen(L + d));
+    } else {
+        for (; d + SGM_SUM_WIDTH <= dMax; d += SGM_SUM_WIDTH)
+            sgm_store_sum(Sp + d, sgm_adds_sum(sgm_load_sum(Sp + d), sgm_widen(L + d)));
+    }
+#endif
+    if (first) {
+        for (; d < dMax; d++)
+            Sp[d] = L[d];
+    } else {
+        for (; d < dMax; d++)
+            Sp[d] = (PathSum)std::min<unsigned>(Sp[d] + L[d], MAX_PATH_SUM);
+    }
+}
+
+//horizontal minimum of all lanes of 16 bit sums, min(a, b) = a - max(a - b, 0) on the 128 bit rest
+inline unsigned short sgm_hmin_sum(SgmSumVec v)
+{
+    __m128i m = sgm_min_sum_128(v);
+    m = _mm_sub_epi16(m, _mm_subs_epu16(m, _mm_srli_si128(m, 8)));
+    m = _mm_sub_epi16(m, _mm_subs_epu16(m, _mm_srli_si128(m, 4)));
+    m = _mm_sub_epi16(m, _mm_subs_epu16(m, _mm_srli_si128(m, 2)));
+    return (unsigned short)_mm_cvtsi128_si32(m);
+}
+
+/*
+ * minimum of S[begin] .. S[end-1], MAX_PATH_SUM for an empty range. Blocks of SGM_SUM_WIDTH sums,
+ * the last (end - begin) % SGM_SUM_WIDTH sums are done one by one.
+ */
+inline PathSum sgm_min_sum_range(const PathSum* S, int begin, int end)
+{
+    PathSum minCost = MAX_PATH_SUM;
+    int d = begin;
+#ifndef SGM_PATH_SUM_32BIT
+    if (d + SGM_SUM_WIDTH <= end) {
+        SgmSumVec vMin = sgm_load_sum(S + d);
+        for (d += SGM_SUM_WIDTH; d + SGM_SUM_WIDTH <= end; d += SGM_SUM_WIDTH)
+            vMin = sgm_min_sum(vMin, sgm_load_sum(S + d));
+        minCost = sgm_hmin_sum(vMin);
+    }
+#endif
+    for (; d < end; d++)
+        minCost = std::min(minCost, S[d]);
+    return minCost;
+}
+
+/*
+ * winner takes all: index of the lowest of the n sums S, the lower index first on equal sums.
+ * The minimum is found with vector min, then the first block holding it with a vector compare,
+ * both scans stay in the cache lines of S.
+ */
+inline int sgm_argmin(const PathSum* S, int n, PathSum& minCost)
+{
+    minCost = sgm_min_sum_range(S, 0, n);
+
+    int d = 0;
+#ifndef SGM_PATH_SUM_32BIT
+    const SgmSumVec vMin = sgm_set1_sum(minCost);
+    while (d + SGM_SUM_WIDTH <= n && !sgm_any_equal_sum(sgm_load_sum(S + d), vMin))
+        d += SGM_SUM_WIDTH;
+#endif
+    while (S[d] != minCost)
+        d++;
+    return d;
+}
+
+#endif
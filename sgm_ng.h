@@ -0,0 +1,350 @@
+#ifndef _SGM_NG_H_
+#define _SGM_NG_H_
+#include <string.h>
+#include <algorithm>
+#include <chrono>
+#include "common.h"
+
+/*
+ * Shared parts of the neighbour guided sgm kernels (calc_cost_sgm_ng.cpp, calc_pyd_cost_sgm_ng.cpp).
+ *
+ * The candidates of a pixel are arbitrary motion vectors, so a path step has to find for every candidate the
+ * previous candidates with the same mv (no penalty) and with |dmvx|, |dmvy| <= 2 (P1). Instead of comparing all
+ * dMax x dMax pairs, the previous candidates are put into a small hash of NG_CELL_SIZE x NG_CELL_SIZE mv cells,
+ * each cell lists its distinct mvs. The +-2 window of a candidate overlaps at most 2 x 2 cells, so a lookup
+ * visits a few cells and their mvs: O(dMax * k) per step, k the number of distinct mvs close to the candidate.
+ *
+ * Neighbouring hints mostly carry the same or overlapping motion, so the candidate list of a pixel is
+ * deduplicated while it is built (NgMvSet), before the costs are evaluated. The lists have a variable length
+ * of at most dMax and are stored CSR style: the entries of all pixels packed in one array, pixel i owns
+ * entries [offsets[i], offsets[i + 1]). The path costs keep a fixed stride of dMax (+ the minimum/top-N
+ * entries) per pixel, of which the first candidate count entries are used.
+ *
+ * The path costs store costs only (PathCost), the mv of path cost d of a pixel is the mv of its candidate d.
+ * A step bounds its costs by NG_MAX_COST + 2 * P2, which fits in PathCost for the penalties in use.
+ *
+ * Neighbouring pixels mostly receive the same hint mvs, and their aggregation windows overlap. The cost of a
+ * candidate is built from the column sums of its window (NgCostCache): a slot per mv keeps the columns of the
+ * last pixel of the row which evaluated that mv, the next pixels only add the columns which entered the window.
+ */
+
+typedef short MvType;       //candidate mv component
+
+//candidate lists in structure of arrays form: the costs, and the mvs which the path costs share with them
+typedef struct _ngCandidates
+{
+	CostType* cost;
+	MvType* mvx;
+	MvType* mvy;
+} NgCandidates;
+
+//the candidates from entry offset on
+inline NgCandidates ng_candidates_at(const NgCandidates& C, size_t offset)
+{
+	NgCandidates c = { C.cost + offset, C.mvx + offset, C.mvy + offset };
+	return c;
+}
+
+const int NG_MAX_COST = 24; //aggregated 5x5 census costs are normalized to the Hamming distance of one pixel
+
+const int NG_CELL_SHIFT = 3;
+const int NG_CELL_SIZE = 1 << NG_CELL_SHIFT;
+const int NG_NEIGHBOUR_RANGE = 2;   //|dmvx|, |dmvy| of the P1 neighbours
+static_assert(2 * NG_NEIGHBOUR_RANGE < NG_CELL_SIZE, "the mv window of a candidate must overlap at most 2 x 2 cells");
+
+//a distinct mv of the previous path costs
+typedef struct _ngCandidateMv
+{
+	int mvx;
+	int mvy;
+	PathCost cost;      //cost of the last entry with this mv, the exact match term of the step
+	PathCost costP1;    //minimum of cost + P1 over the entries with this mv
+	int next;           //next mv of the cell, -1 at the end
+} NgCandidateMv;
+
+typedef struct _ngCandidateCell
+{
+	int cx;
+	int cy;
+	unsigned stamp;     //the cell belongs to the current build if equal to NgCandidateIndex::stamp
+	int head;           //first mv of the cell
+} NgCandidateCell;
+
+typedef struct _ngCandidateIndex
+{
+	NgCandidateCell* cells;
+	NgCandidateMv* mvs;
+	int mask;           //cells - 1
+	unsigned stamp;
+} NgCandidateIndex;
+
+//cells of the index of dMax candidates, a power of two with at most half of them used
+inline int ng_candidate_index_cells(int dMax)
+{
+	int cells = 16;
+	while (cells < 2 * dMax)
+		cells *= 2;
+	return cells;
+}
+
+//bytes of the index of dMax candidates
+inline size_t ng_candidate_index_size(int dMax)
+{
+	return sizeof(NgCandidateCell) * ng_candidate_index_cells(dMax) + sizeof(NgCandidateMv) * dMax;
+}
+
+//index on buffer (ng_candidate_index_size() bytes), it is reused by all steps
+inline void ng_candidate_index_init(NgCandidateIndex& index, void* buffer, int dMax)
+{
+	const int cells = ng_candidate_index_cells(dMax);
+	index.cells = (NgCandidateCell*)buffer;
+	index.mvs = (NgCandidateMv*)(index.cells + cells);
+	index.mask = cells - 1;
+	index.stamp = 0;
+	memset(index.cells, 0, sizeof(NgCandidateCell) * cells);
+}
+
+inline int ng_hash(int x, int y, int mask)
+{
+	return (int)(((unsigned)x * 73856093u) ^ ((unsigned)y * 19349663u)) & mask;
+}
+
+//cell (cx, cy) of the current build, NULL if it has no mv
+inline const NgCandidateCell* ng_candidate_cell(const NgCandidateIndex& index, int cx, int cy)
+{
+	for (int h = ng_hash(cx, cy, index.mask); ; h = (h + 1) & index.mask) {
+		const NgCandidateCell& cell = index.cells[h];
+		if (cell.stamp != index.stamp)
+			return NULL;
+		if (cell.cx == cx && cell.cy == cy)
+			return &cell;
+	}
+}
+
+//index the num previous path costs Lpre of the mvs mvx/mvy, num <= dMax of ng_candidate_index_init()
+inline void ng_candidate_index_build(NgCandidateIndex& index, const MvType* mvx, const MvType* mvy, const PathCost* Lpre,
+	int num, int P1)
+{
+	if (++index.stamp == 0) {
+		memset(index.cells, 0, sizeof(NgCandidateCell) * (index.mask + 1));
+		index.stamp = 1;
+	}
+
+	int mvNum = 0;
+	for (int d = 0; d < num; d++) {
+		const int cx = mvx[d] >> NG_CELL_SHIFT;
+		const int cy = mvy[d] >> NG_CELL_SHIFT;
+
+		int h = ng_hash(cx, cy, index.mask);
+		while (index.cells[h].stamp == index.stamp && (index.cells[h].cx != cx || index.cells[h].cy != cy))
+			h = (h + 1) & index.mask;
+		NgCandidateCell& cell = index.cells[h];
+		if (cell.stamp != index.stamp) {
+			cell.cx = cx;
+			cell.cy = cy;
+			cell.stamp = index.stamp;
+			cell.head = -1;
+		}
+
+		int m = cell.head;
+		while (m >= 0 && (index.mvs[m].mvx != mvx[d] || index.mvs[m].mvy != mvy[d]))
+			m = index.mvs[m].next;
+		if (m < 0) {
+			m = mvNum++;
+			index.mvs[m].mvx = mvx[d];
+			index.mvs[m].mvy = mvy[d];
+			index.mvs[m].costP1 = MAX_PATH_COST;
+			index.mvs[m].next = cell.head;
+			cell.head = m;
+		}
+		//same truncation to PathCost as the pairwise comparison
+		index.mvs[m].cost = Lpre[d];
+		index.mvs[m].costP1 = std::min<PathCost>(index.mvs[m].costP1, Lpre[d] + P1);
+	}
+}
+
+//exact match term min1 and P1 term min2 of candidate (mvx, mvy), both are left unchanged if there is no such mv
+inline void ng_candidate_index_lookup(const NgCandidateIndex& index, int mvx, int mvy, PathCost& min1, PathCost& min2)
+{
+	const int cx0 = (mvx - NG_NEIGHBOUR_RANGE) >> NG_CELL_SHIFT;
+	const int cx1 = (mvx + NG_NEIGHBOUR_RANGE) >> NG_CELL_SHIFT;
+	const int cy0 = (mvy - NG_NEIGHBOUR_RANGE) >> NG_CELL_SHIFT;
+	const int cy1 = (mvy + NG_NEIGHBOUR_RANGE) >> NG_CELL_SHIFT;
+
+	for (int cy = cy0; cy <= cy1; cy++) {
+		for (int cx = cx0; cx <= cx1; cx++) {
+			const NgCandidateCell* cell = ng_candidate_cell(index, cx, cy);
+			if (cell == NULL)
+				continue;
+
+			for (int m = cell->head; m >= 0; m = index.mvs[m].next) {
+				const NgCandidateMv& mv = index.mvs[m];
+				if (mv.mvx == mvx && mv.mvy == mvy)
+					min1 = mv.cost;
+				else if (abs(mvx - mv.mvx) <= NG_NEIGHBOUR_RANGE && abs(mvy - mv.mvy) <= NG_NEIGHBOUR_RANGE)
+					min2 = std::min<PathCost>(min2, mv.costP1);
+			}
+		}
+	}
+}
+
+//set of the distinct mvs of the candidate list under construction
+typedef struct _ngMvSlot
+{
+	int mvx;
+	int mvy;
+	unsigned stamp;     //the slot is used if equal to NgMvSet::stamp
+} NgMvSlot;
+
+typedef struct _ngMvSet
+{
+	NgMvSlot* slots;
+	int mask;
+	unsigned stamp;
+} NgMvSet;
+
+//bytes of the set of at most dMax mvs
+inline size_t ng_mv_set_size(int dMax)
+{
+	return sizeof(NgMvSlot) * ng_candidate_index_cells(dMax);
+}
+
+//start an empty set, the slots of the previous lists are not cleared
+inline void ng_mv_set_clear(NgMvSet& set)
+{
+	if (++set.stamp == 0) {
+		memset(set.slots, 0, sizeof(NgMvSlot) * (set.mask + 1));
+		set.stamp = 1;
+	}
+}
+
+//set on buffer (ng_mv_set_size() bytes)
+inline void ng_mv_set_init(NgMvSet& set, void* buffer, int dMax)
+{
+	set.slots = (NgMvSlot*)buffer;
+	set.mask = ng_candidate_index_cells(dMax) - 1;
+	set.stamp = 0;
+	memset(set.slots, 0, sizeof(NgMvSlot) * (set.mask + 1));
+}
+
+//add (mvx, mvy), false if it is in the set already
+inline bool ng_mv_set_insert(NgMvSet& set, int mvx, int mvy)
+{
+	int h = ng_hash(mvx, mvy, set.mask);
+	for (; set.slots[h].stamp == set.stamp; h = (h + 1) & set.mask) {
+		if (set.slots[h].mvx == mvx && set.slots[h].mvy == mvy)
+			return false;
+	}
+	set.slots[h].mvx = mvx;
+	set.slots[h].mvy = mvy;
+	set.slots[h].stamp = set.stamp;
+	return true;
+}
+
+//build with -DNG_VERBOSE=1 to print the candidate counts and the cost cache statistics, the timing is only
+//taken then
+#ifndef NG_VERBOSE
+#define NG_VERBOSE 0
+#endif
+
+const int NG_CACHE_SLOTS = 512;     //direct mapped on the mv
+const int NG_CACHE_COLUMNS = 16;    //ring of column sums, at least the aggregation window width
+const int NG_CACHE_TIMING_PERIOD = 64;
+
+typedef struct _ngCostCacheSlot
+{
+	int mvx;
+	int mvy;
+	int y;              //row of the column sums, -1 for an unused slot
+	int x;              //last pixel, the columns of its window are in col
+	unsigned col[NG_CACHE_COLUMNS]; //sum of column xa of the window at col[xa % NG_CACHE_COLUMNS]
+} NgCostCacheSlot;
+
+typedef struct _ngCostCache
+{
+	NgCostCacheSlot* slots;
+	int radius;                 //half size of the aggregation window
+	size_t lookups;             //statistics: window sums
+	size_t hits;                //window sums which reused columns
+	size_t columns;             //columns needed
+	size_t reusedColumns;       //columns taken from the cache
+	size_t sampledColumns;      //columns evaluated by the timed lookups, every NG_CACHE_TIMING_PERIOD-th
+	double sampledTime;         //ms of the timed lookups
+	double clockOverhead;       //ms of a pair of clock reads, taken off each timed lookup
+} NgCostCache;
+
+//bytes of the cache
+inline size_t ng_cost_cache_size()
+{
+	return sizeof(NgCostCacheSlot) * NG_CACHE_SLOTS;
+}
+
+//cache on buffer (ng_cost_cache_size() bytes) for a (2 * radius + 1)^2 window
+inline void ng_cost_cache_init(NgCostCache& cache, void* buffer, int radius)
+{
+	mxAssert(2 * radius + 1 <= NG_CACHE_COLUMNS, "aggregation window wider than the column ring");
+	cache.slots = (NgCostCacheSlot*)buffer;
+	cache.radius = radius;
+	cache.lookups = cache.hits = cache.columns = cache.reusedColumns = cache.sampledColumns = 0;
+	cache.sampledTime = 0;
+	cache.clockOverhead = 1e9;
+	for (int i = 0; i < (NG_VERBOSE ? 16 : 0); i++) {
+		const auto start = std::chrono::steady_clock::now();
+		cache.clockOverhead = std::min(cache.clockOverhead, std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count());
+	}
+	for (int i = 0; i < NG_CACHE_SLOTS; i++)
+		cache.slots[i].y = -1;
+}
+
+/* window sum of candidate mv (mvx, mvy) at pixel (x, y). column(xa) returns the sum over the window rows of
+ * column xa (x - radius <= xa <= x + radius, may be outside of the image) for this mv. The pixels of a row
+ * must be visited in increasing x
+ */
+template <class Column>
+inline unsigned ng_cost_cache_sum(NgCostCache& cache, int x, int y, int mvx, int mvy, Column column)
+{
+	NgCostCacheSlot& slot = cache.slots[ng_hash(mvx, mvy, NG_CACHE_SLOTS - 1)];
+	const int r = cache.radius;
+	int first = x - r; //first column to evaluate
+
+	cache.lookups++;
+	cache.columns += 2 * r + 1;
+	if (slot.y == y && slot.mvx == mvx && slot.mvy == mvy && x > slot.x && x - slot.x <= 2 * r) {
+		first = slot.x + r + 1;
+		cache.hits++;
+		cache.reusedColumns += 2 * r + 1 - (x - slot.x);
+	}
+
+	if (NG_VERBOSE && cache.lookups % NG_CACHE_TIMING_PERIOD == 0) {
+		const auto start = std::chrono::steady_clock::now();
+		for (int xa = first; xa <= x + r; xa++)
+			slot.col[(xa + NG_CACHE_COLUMNS) % NG_CACHE_COLUMNS] = column(xa);
+		cache.sampledTime += std::max(std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count() - cache.clockOverhead, 0.0);
+		cache.sampledColumns += x + r + 1 - first;
+	}
+	else {
+		for (int xa = first; xa <= x + r; xa++)
+			slot.col[(xa + NG_CACHE_COLUMNS) % NG_CACHE_COLUMNS] = column(xa);
+	}
+	slot.mvx = mvx;
+	slot.mvy = mvy;
+	slot.y = y;
+	slot.x = x;
+
+	unsigned sum = 0;
+	for (int xa = x - r; xa <= x + r; xa++)
+		sum += slot.col[(xa + NG_CACHE_COLUMNS) % NG_CACHE_COLUMNS];
+	return sum;
+}
+
+//hit rate and reuse of the cache, cost construction time and the time the reused columns saved, estimated from
+//the column time of the timed lookups. NG_VERBOSE builds only
+inline void ng_cost_cache_report(const NgCostCache& cache, double costTime)
+{
+	const double columnTime = cache.sampledTime / std::max<size_t>(cache.sampledColumns, 1);
+	mexPrintf("cost cache: %.1f%% hits, %.1f%% of the columns reused, cost %.1f ms (~%.1f ms saved)\n",
+		100.0 * cache.hits / std::max<size_t>(cache.lookups, 1), 100.0 * cache.reusedColumns / std::max<size_t>(cache.columns, 1),
+		costTime, columnTime * cache.reusedColumns);
+}
+
+#endif
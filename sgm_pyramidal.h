@@ -0,0 +1,788 @@
+#ifndef _SGM_PYRAMIDAL_H_
+#define _SGM_PYRAMIDAL_H_
+#include <nmmintrin.h>
+#include <cstring>
+#include <cmath>
+#include "mex_compat.h"
+#include "common.h"
+#include "census.h"
+#include "sgm_aggregate.h"
+#include "sgm_tiles.h"
+
+/*
+ * Pyramidal SGM kernels: cost volume of a search window around the motion of the coarser level,
+ * 2-D motion path aggregation and winner takes all.
+ * Used by the calc_pyd_cost_sgm MEX gateway and by the native PydSGM (proj/).
+ */
+#define USE_CONST_COST 
+const int GRID_BORDER = 4; //positions up to GRID_BORDER outside of the search window are looked up in the path cost grid
+
+/*
+ * workspace of sgm_step. The previous path cost is copied into a grid of searchWinX columns with searchWinY
+ * entries (same order as the path cost), surrounded by MAX_PATH_COST. The minimum over the 5x5 neighbourhood
+ * is then a separable min filter of the whole grid, and out of window positions need no bounds checks.
+ */
+typedef struct _sgmStepWorkspace
+{
+    int stride;         //entries per grid column
+    int size;           //entries of the grid
+    int offset;         //grid entry of search position (0, 0)
+    PathCost* buf;      //allocation holding all path cost buffers
+    PathCost* grid;     //previous path cost with border
+    PathCost* minY;     //minimum over 5 entries along y
+    PathCost* minXY;    //minimum over the 5x5 neighbourhood
+    PathCost* min1;     //grid at the shifted position of each search position
+    PathCost* min2;     //minXY at the shifted position of each search position
+    int* xpre;          //shifted position of each search column/row
+    int* ypre;
+} SgmStepWorkspace;
+
+//path cost entries of the workspace buffer, rounded up for the shifted positions which follow them
+inline int sgm_step_workspace_entries(int searchWinX, int searchWinY)
+{
+    const int stride = searchWinY + 2*GRID_BORDER;
+    const int margin = (2*stride + SGM_SIMD_WIDTH) / SGM_SIMD_WIDTH * SGM_SIMD_WIDTH;
+    const int bufSize = margin + sgm_padded_dmax((searchWinX + 2*GRID_BORDER + 4)*stride) + margin;
+    const int entries = 3*bufSize + 2*sgm_padded_dmax(searchWinX*searchWinY);
+    return (entries + (int)sizeof(int) - 1) / (int)sizeof(int) * (int)sizeof(int);
+}
+
+//bytes of a step workspace, see sgm_step_workspace_init()
+inline size_t sgm_step_workspace_size(int searchWinX, int searchWinY)
+{
+    return sgm_step_workspace_entries(searchWinX, searchWinY) * sizeof(PathCost) + (searchWinX + searchWinY) * sizeof(int);
+}
+
+//step workspace on caller provided memory of sgm_step_workspace_size() bytes
+inline void sgm_step_workspace_init(SgmStepWorkspace& ws, void* buffer, int searchWinX, int searchWinY)
+{
+    //two extra columns on both sides keep the x pass of the min filter inside the grid
+    const int cols = searchWinX + 2*GRID_BORDER + 4;
+    ws.stride = searchWinY + 2*GRID_BORDER;
+    ws.size = cols*ws.stride;
+    ws.offset = (GRID_BORDER + 2)*ws.stride + GRID_BORDER;
+
+    //the min filter reads whole simd blocks up to 2 columns before/after the grid
+    const int margin = (2*ws.stride + SGM_SIMD_WIDTH) / SGM_SIMD_WIDTH * SGM_SIMD_WIDTH;
+    const int bufSize = margin + sgm_padded_dmax(ws.size) + margin;
+    const int dPadded = sgm_padded_dmax(searchWinX*searchWinY);
+    const int entries = sgm_step_workspace_entries(searchWinX, searchWinY);
+
+    ws.buf = (PathCost*)buffer;
+    memset(ws.buf, MAX_PATH_COST, entries * sizeof(PathCost));
+    ws.grid = ws.buf + margin;
+    ws.minY = ws.buf + bufSize + margin;
+    ws.minXY = ws.buf + 2*bufSize + margin;
+    ws.min1 = ws.buf + 3*bufSize;
+    ws.min2 = ws.min1 + dPadded;
+    ws.xpre = (int*)(ws.buf + entries);
+    ws.ypre = ws.xpre + searchWinX;
+}
+
+inline void sgm_step_workspace_alloc(SgmStepWorkspace& ws, int searchWinX, int searchWinY)
+{
+    sgm_step_workspace_init(ws, mxMalloc(sgm_step_workspace_size(searchWinX, searchWinY)), searchWinX, searchWinY);
+}
+
+inline void sgm_step_workspace_free(SgmStepWorkspace& ws)
+{
+    mxFree(ws.buf);
+}
+
+//perform a single step to calculate path cost for current pixel position
+inline void sgm_step(PathCost* L, //current path cost
+    const PathCost* Lpre, //previous path cost
+    const CostType* C, //cost map
+    double dx, double dy, int searchWinX, int searchWinY, 
+    int P1, int P2, SgmStepWorkspace& ws)
+{
+    const int dMax = searchWinX * searchWinY;
+    const int stride = ws.stride;
+    const PathCost LpreMin = Lpre[sgm_path_min_index(dMax)]; //get minimum value of pre path cost
+
+    //search position (sx, sy) continues the path at (xpre, ypre) of the previous pixel
+    for (int sx = 0; sx < searchWinX; sx++)
+        ws.xpre[sx] = sx + dx + 0.5;
+    for (int sy = 0; sy < searchWinY; sy++)
+        ws.ypre[sy] = sy + dy + 0.5;
+
+    // ||d-d'|| <= r, r = 2: separable min filter over the grid
+    for (int sx = 0; sx < searchWinX; sx++)
+        memcpy(ws.grid + ws.offset + sx*stride, Lpre + sx*searchWinY, searchWinY * sizeof(PathCost));
+    sgm_min_filter5(ws.minY, ws.grid, ws.size, 1);
+    sgm_min_filter5(ws.minXY + 2*stride, ws.minY + 2*stride, ws.size - 4*stride, stride);
+
+    //shift the grids by the motion difference. the rounded shift is usually the same for all rows
+    const int y0 = ws.ypre[0];
+    bool constShiftY = y0 >= -GRID_BORDER && y0 <= GRID_BORDER;
+    for (int sy = 1; sy < searchWinY; sy++)
+        constShiftY = constShiftY && ws.ypre[sy] == y0 + sy;
+
+    for (int sx = 0; sx < searchWinX; sx++) {
+        PathCost* ptrMin1 = ws.min1 + sx*searchWinY;
+        PathCost* ptrMin2 = ws.min2 + sx*searchWinY;
+        const int xpre = ws.xpre[sx];
+
+        if (xpre < -GRID_BORDER || xpre >= searchWinX + GRID_BORDER) {
+            memset(ptrMin1, MAX_PATH_COST, searchWinY * sizeof(PathCost));
+            memset(ptrMin2, MAX_PATH_COST, searchWinY * sizeof(PathCost));
+            continue;
+        }
+
+        const PathCost* col1 = ws.grid + ws.offset + xpre*stride;
+        const PathCost* col2 = ws.minXY + ws.offset + xpre*stride;
+        if (constShiftY) {
+            memcpy(ptrMin1, col1 + y0, searchWinY * sizeof(PathCost));
+            memcpy(ptrMin2, col2 + y0, searchWinY * sizeof(PathCost));
+        } else {
+            for (int sy = 0; sy < searchWinY; sy++) {
+                const int ypre = ws.ypre[sy];
+                const bool inGrid = ypre >= -GRID_BORDER && ypre < searchWinY + GRID_BORDER;
+                ptrMin1[sy] = inGrid ? col1[ypre] : MAX_PATH_COST;
+                ptrMin2[sy] = inGrid ? col2[ypre] : MAX_PATH_COST;
+            }
+        }
+    }
+
+    //the 5x5 minimum includes the center, which never wins over min1 = Lpre(xpre, ypre)
+    sgm_combine(L, ws.min1, ws.min2, C, dMax, LpreMin, P1, P2);
+}
+
+inline int pyd_adaptive_P2(int P2, int pixCur, int pixPre) {
+    const int threshold = 50;
+    
+    return (abs(pixCur - pixPre) > threshold ? P2 / 8 : P2);
+}
+
+//2-D motion path of the pyramidal sgm, see sgm_aggregate.h
+struct PydPath
+{
+    typedef SgmStepWorkspace Workspace;
+
+    const PixelType* I1;
+    int width;
+    const double* pMvx;
+    const double* pMvy;
+    int mvWidth;
+    int searchWinX;
+    int searchWinY;
+    int P1;
+    int P2;
+    bool adpativeP2;
+
+    void step(PathCost* L, const PathCost* Lpre, const CostType* C, int x, int y, int xpre, int ypre, Workspace& ws)
+    {
+        //hint map may have different size with image, must set width to mvWidth, otherwise will have 45degree error propagation issue 
+        //when 2nd pyd processing
+        double dx = pMvx[y*mvWidth + x] - pMvx[ypre*mvWidth + xpre];
+        double dy = pMvy[y*mvWidth + x] - pMvy[ypre*mvWidth + xpre];
+        PixelType pixCur = I1[width*y + x];
+        PixelType pixPre = I1[width*ypre + xpre];
+
+        sgm_step(L,                     //current path cost
+            Lpre,                       //previous path cost
+            C,                          //cost map
+            dx, dy, searchWinX, searchWinY, P1, adpativeP2 ? pyd_adaptive_P2(P2, pixCur, pixPre) : P2, ws);
+    }
+};
+
+//cost rows of the cost volume
+struct PydCostRows
+{
+    const CostType* C;
+    int costPerRow;
+
+    const CostType* row(int y) { return C + (size_t)y*costPerRow; }
+};
+
+//subpixel quadratic interpolation: fit parabola into (-1, cLeft), (0, c0), (1, cRight), then find minimum of the parabola.
+//0 for a flat parabola
+inline double subpixel_offset(double cLeft, double c0, double cRight)
+{
+    const double den = 2.0 * (c0 - std::max(cLeft, cRight));
+    return den < 0 ? (cRight-cLeft)/den : 0;
+}
+
+//lowest sum outside of the 3x3 neighbourhood of bestIdx in the search window, confidence of the winner
+inline unsigned second_cost_2d(const PathSum* S, int searchWinX, int searchWinY, int bestIdx)
+{
+    const int dx = bestIdx / searchWinY;
+    const int dy = bestIdx % searchWinY;
+    PathSum minCost = MAX_PATH_SUM;
+    int begin = 0;
+    for (int x = std::max(dx - 1, 0); x <= std::min(dx + 1, searchWinX - 1); x++) {
+        minCost = std::min(minCost, sgm_min_sum_range(S, begin, x*searchWinY + std::max(dy - 1, 0)));
+        begin = x*searchWinY + std::min(dy + 2, searchWinY);
+    }
+    return std::min(minCost, sgm_min_sum_range(S, begin, searchWinX*searchWinY));
+}
+
+/* winner takes all and subpixel position on the path cost sums Sp (width x height x dMax), the output
+ * rows of bestD/minC/mvSubX/mvSubY/secondC follow the rows of Sp. argmin, subpixel position and the
+ * optional second best cost are done in one pass while the sums of the pixel are in the cache
+ */
+inline void sgm2d_wta(unsigned* bestD, unsigned* minC, double* ptrMvSubMvx, double* ptrMvSubMvy, const PathSum* Sp,
+        int width, int height, int dMax, int searchWinX, int searchWinY, int subpixelRefine, unsigned* secondC = NULL)
+{
+    const size_t costPerRowEntry = (size_t)width*dMax;
+
+    for(int y = 0; y< height; y++) {
+        const PathSum* SpPtr = Sp + y*costPerRowEntry;
+        for (int x = 0; x <width; x++) {
+            const PathSum* SpCur = SpPtr + x*dMax;
+            const size_t i = (size_t)y*width + x;
+            PathSum minCost;
+            const int bestIdx = sgm_argmin(SpCur, dMax, minCost);
+            minC[i] = minCost;
+            bestD[i] = bestIdx;
+
+            if(subpixelRefine) {
+                const int dx = bestIdx / searchWinY;
+                const int dy = bestIdx % searchWinY;
+                ptrMvSubMvy[i] = dy > 0 && dy < searchWinY - 1 ?
+                    subpixel_offset(SpCur[bestIdx - 1], minCost, SpCur[bestIdx + 1]) : 0;
+                ptrMvSubMvx[i] = dx > 0 && dx < searchWinX - 1 ?
+                    subpixel_offset(SpCur[bestIdx - searchWinY], minCost, SpCur[bestIdx + searchWinY]) : 0;
+            }
+
+            if (secondC)
+                secondC[i] = second_cost_2d(SpCur, searchWinX, searchWinY, bestIdx);
+        }
+    }
+}
+
+/* path aggregation and winner takes all of sgm2d() on caller provided buffers
+ * L: sgm_aggregate_buffer_size() path cost entries, ws: threads step workspaces of the search window,
+ * Sp: width x height x dMax path cost sums, pool: optional persistent workers with at least threads - 1 threads
+ */
+inline void sgm2d_run(unsigned* bestD, unsigned* minC, double* mvSub,
+        PixelType* I1, const CostType* C, int width, int height, int dMax,
+        double* mvPre, int mvWidth, int mvHeight,
+        int searchWinX, int searchWinY, int P1, int P2, int subpixelRefine, int paths, int totalPass, bool adpativeP2,
+        int threads, PathCost* L, SgmStepWorkspace* ws, PathSum* Sp, SgmWorkerPool* pool = NULL, unsigned* secondC = NULL)
+{
+    SgmAggregateParams params = { width, height, dMax, totalPass, paths, threads, pool };
+    PydPath path = { I1, width, mvPre, mvPre + mvWidth * mvHeight, mvWidth,
+        searchWinX, searchWinY, P1, P2, adpativeP2 };
+    PydCostRows costRows = { C, width*dMax };
+
+    sgm_aggregate(Sp, costRows, path, ws, L, params);
+
+    sgm2d_wta(bestD, minC, mvSub, mvSub + (size_t)width*height, Sp, width, height, dMax, searchWinX, searchWinY,
+        subpixelRefine, secondC);
+}
+
+/* sgm on 3-D cost volume
+ * Output:
+ * bestD is the output best index along the third dimension
+ * minC is the corresponding cost along with best index
+ * mvSub is the output subpixel position for mvx/mvy
+ *
+ * Input:
+ * C: 3-d cost volume
+ * width/height/dMax: width/height/dMax(third dimension) of C
+ * mvPre: previous level's the mv map
+ * mvWidth/mvHeight: width/height of mvPre
+ * searchWinX: search window size at x-direction
+ * searchWinY: search window size at y-direction
+ * P1/P2: small/large penalty
+ * subpixelRefine: enable/disable subpixel position estimation
+ * paths: number of path directions, 4, 8 or 16
+ * threads: number of threads of the path aggregation
+ * lowMemory: two pass aggregation which keeps the best candidates of each pixel instead of the
+ *            width x height x dMax path cost sums, see sgm_aggregate_summary()
+ * secondC: optional output, lowest cost outside of the 3x3 neighbourhood of bestD. with lowMemory the lowest
+ *          of the other candidates, MAX_PATH_SUM if they are all next to bestD
+ *
+ */
+inline void sgm2d(unsigned* bestD, unsigned* minC, double* mvSub, 
+        PixelType* I1, CostType* C, int width, int height, int dMax,
+        double* mvPre, int mvWidth, int mvHeight, 
+        int searchWinX, int searchWinY, int P1, int P2, int subpixelRefine, int paths = 8, int totalPass = 2, bool adpativeP2 = false,
+        int threads = 1, bool lowMemory = false, unsigned* secondC = NULL)
+{
+    mxAssert(dMax == searchWinX*searchWinY, "dMax should equal to searchWinX*searchWinY");
+
+    SgmAggregateParams params = { width, height, dMax, totalPass, paths, threads, NULL };
+    PydPath path = { I1, width, mvPre, mvPre + mvWidth * mvHeight, mvWidth,
+        searchWinX, searchWinY, P1, P2, adpativeP2 };
+    PydCostRows costRows = { C, width*dMax };
+
+    //allocate path cost buffers and per thread step workspaces
+    PathCost* L = (PathCost*) mxMalloc (sizeof(PathCost) * sgm_aggregate_buffer_size(params));
+    SgmStepWorkspace* ws = (SgmStepWorkspace*) mxMalloc (sizeof(SgmStepWorkspace) * threads);
+    for (int t = 0; t < threads; t++)
+        sgm_step_workspace_alloc(ws[t], searchWinX, searchWinY);
+
+    double * ptrMvSubMvx = mvSub;
+    double * ptrMvSubMvy = mvSub + width*height;
+
+    if (lowMemory) {
+        //best candidates of each pixel with their neighbours in y (index -+1) and x (index -+searchWinY)
+        const SgmSummaryParams summaryParams = { 4, { -1, 1, -searchWinY, searchWinY } };
+        SgmCandidate* summary = (SgmCandidate*) mxMalloc (sizeof(SgmCandidate) * (size_t)width * height * SGM_SUMMARY_CANDIDATES);
+        PathSum* band = (PathSum*) mxMalloc (sizeof(PathSum) * sgm_summary_band_size(params));
+
+        sgm_aggregate_summary(summary, costRows, path, ws, L, band, params, summaryParams);
+
+        for (int i = 0; i < width*height; i++) {
+            const SgmCandidate* cand = summary + (size_t)i*SGM_SUMMARY_CANDIDATES;
+            const SgmCandidate* best = sgm_summary_best(cand);
+            const int dx = best->d / searchWinY;
+            const int dy = best->d % searchWinY;
+            bestD[i] = best->d;
+            minC[i] = best->cost[0];
+
+            if (subpixelRefine) {
+                ptrMvSubMvy[i] = dy > 0 && dy < searchWinY - 1 ? subpixel_offset(best->cost[1], best->cost[0], best->cost[2]) : 0;
+                ptrMvSubMvx[i] = dx > 0 && dx < searchWinX - 1 ? subpixel_offset(best->cost[3], best->cost[0], best->cost[4]) : 0;
+            }
+
+            if (secondC) {
+                secondC[i] = MAX_PATH_SUM;
+                for (int k = 0; k < SGM_SUMMARY_CANDIDATES && cand[k].d >= 0; k++) {
+                    if (abs(cand[k].d / searchWinY - dx) > 1 || abs(cand[k].d % searchWinY - dy) > 1)
+                        secondC[i] = std::min<unsigned>(secondC[i], cand[k].cost[0]);
+                }
+            }
+        }
+
+        mxFree(summary);
+        mxFree(band);
+        for (int t = 0; t < threads; t++)
+            sgm_step_workspace_free(ws[t]);
+        mxFree(ws);
+        mxFree(L);
+        return;
+    }
+
+    //sum of path cost from all directions
+    PathSum* Sp = (PathSum*) mxMalloc (sizeof(PathSum) * (size_t)width * height * dMax);
+
+    sgm2d_run(bestD, minC, mvSub, I1, C, width, height, dMax, mvPre, mvWidth, mvHeight,
+        searchWinX, searchWinY, P1, P2, subpixelRefine, paths, totalPass, adpativeP2, threads, L, ws, Sp, NULL, secondC);
+
+    for (int t = 0; t < threads; t++)
+        sgm_step_workspace_free(ws[t]);
+    mxFree(ws);
+    mxFree(L);
+    mxFree(Sp);
+}
+        
+//cost of a window pixel which is outside of the image, a fifth of the census bits (5 for the 25 bit 5x5 window)
+const CostType defaultCost = CensusWindow::BITS / 5;
+const int COST_TILE_SIZE = 32;    //tile size of the shift-plane cost construction
+const int COST_TILE_MIN_SIZE = 2; //tiles with non-constant preMv are split down to this size
+
+/*
+ * window pixel coordinate p1 and its reference coordinate for search offset off around the motion mv,
+ * along one axis. returns false if the pair is not valid (the window pixel costs defaultCost then)
+ */
+inline bool window_ref_coord(int& p1, int& p2, int off, double mv, int size)
+{
+#ifdef USE_CONST_COST
+    if (p1 < 0 || p1 > size - 1)
+        return false;  //add constant cost if not valid current pixel position
+#else
+    p1 = clamp(p1, 0, size - 1);
+#endif
+    p2 = 1.0*(off + p1) + mv + 0.5;
+#ifdef USE_CONST_COST
+    if (p2 < 0 || p2 > size - 1)
+        return false; //add constant cost if not valid reference pixel position
+#else
+    p2 = clamp(p2, 0, size - 1);
+#endif
+    return true;
+}
+
+//matching cost of window pixel (x1, y1) for search offset (offx, offy) around the motion (mvx, mvy)
+inline unsigned window_pixel_cost(const CensusWindow::CodeType* cen1, const CensusWindow::CodeType* cen2, int width, int height,
+    int x1, int y1, int offx, int offy, double mvx, double mvy)
+{
+    int x2, y2;
+    if (!window_ref_coord(x1, x2, offx, mvx, width) || !window_ref_coord(y1, y2, offy, mvy, height))
+        return defaultCost;
+
+    return hamming_cost(cen1[width*y1 + x1], cen2[width*y2 + x2]);
+}
+
+//buffers of the shift-plane cost construction, sized for a COST_TILE_SIZE tile plus the aggregation apron
+typedef struct _costTileWorkspace
+{
+    CostType* plane;    //Hamming plane
+    unsigned* colSum;   //vertical sums of the plane
+    int* x1;            //window pixel / reference coordinates of the plane columns (x) and rows (y), -1 if not valid
+    int* x2;
+    int* y1;
+    int* y2;
+} CostTileWorkspace;
+
+//per-pixel cost construction for the tile (x0, y0, tileW, tileH), aggregates every window separately.
+//C holds the image rows from yC on
+inline void calc_cost_per_pixel(CostType* C,
+    const CensusWindow::CodeType* cen1, const CensusWindow::CodeType* cen2, int width, int height,
+    const double* pMvx, const double* pMvy, int mvWidth,
+    int winRadiusAgg, int winRadiusX, int winRadiusY,
+    int x0, int y0, int tileW, int tileH, int yC)
+{
+    int winPixels = (2 * winRadiusAgg + 1)*(2 * winRadiusAgg + 1);
+    int dMax = (2 * winRadiusX + 1) * (2 * winRadiusY + 1);
+
+    for (int y = y0; y < y0 + tileH; y++) {
+        for (int x = x0; x < x0 + tileW; x++) {
+            CostType* ptrC = C + (size_t)(y - yC)*dMax*width + dMax*x;
+            double mvx = pMvx[mvWidth*y + x];
+            double mvy = pMvy[mvWidth*y + x];
+
+            int d = 0;
+            for (int offx = -winRadiusX; offx <= winRadiusX; offx++) {
+                for (int offy = -winRadiusY; offy <= winRadiusY; offy++) {
+                    unsigned costSum = 0;
+                    for (int aggy = -winRadiusAgg; aggy <= winRadiusAgg; aggy++)
+                        for (int aggx = -winRadiusAgg; aggx <= winRadiusAgg; aggx++)
+                            costSum += window_pixel_cost(cen1, cen2, width, height, x + aggx, y + aggy, offx, offy, mvx, mvy);
+
+                    ptrC[d] = (1.0 * costSum / winPixels) + 0.5;
+                    d++;
+                }
+            }
+        }
+    }
+}
+
+/*
+ * shift-plane cost construction for the tile (x0, y0, tileW, tileH).
+ *
+ * The window pixel cost only depends on the window pixel, the search offset and the motion of the
+ * center pixel. If preMv is constant over the tile, all pixels share one Hamming plane per search
+ * offset, which is evaluated once over the tile plus the aggregation apron and box filtered with
+ * running sums. Tiles with varying preMv are split, and handled per pixel at COST_TILE_MIN_SIZE.
+ *
+ * ws: workspace for a COST_TILE_SIZE tile
+ * yC: first image row held by C
+ */
+inline void calc_cost_tile(CostType* C,
+    const CensusWindow::CodeType* cen1, const CensusWindow::CodeType* cen2, int width, int height,
+    const double* pMvx, const double* pMvy, int mvWidth,
+    int winRadiusAgg, int winRadiusX, int winRadiusY,
+    int x0, int y0, int tileW, int tileH, const CostTileWorkspace& ws, int yC)
+{
+    const double mvx = pMvx[mvWidth*y0 + x0];
+    const double mvy = pMvy[mvWidth*y0 + x0];
+    bool constMv = true;
+    for (int y = y0; y < y0 + tileH && constMv; y++)
+        for (int x = x0; x < x0 + tileW; x++)
+            if (pMvx[mvWidth*y + x] != mvx || pMvy[mvWidth*y + x] != mvy) {
+                constMv = false;
+                break;
+            }
+
+    if (!constMv) {
+        if (tileW <= COST_TILE_MIN_SIZE && tileH <= COST_TILE_MIN_SIZE) {
+            calc_cost_per_pixel(C, cen1, cen2, width, height, pMvx, pMvy, mvWidth,
+                winRadiusAgg, winRadiusX, winRadiusY, x0, y0, tileW, tileH, yC);
+            return;
+        }
+
+        //split into quadrants
+        int halfW = (tileW + 1) / 2;
+        int halfH = (tileH + 1) / 2;
+        for (int ty = y0; ty < y0 + tileH; ty += halfH)
+            for (int tx = x0; tx < x0 + tileW; tx += halfW)
+                calc_cost_tile(C, cen1, cen2, width, height, pMvx, pMvy, mvWidth, winRadiusAgg, winRadiusX, winRadiusY,
+                    tx, ty, std::min(halfW, x0 + tileW - tx), std::min(halfH, y0 + tileH - ty), ws, yC);
+        return;
+    }
+
+    const int winSize = 2 * winRadiusAgg + 1;
+    const int winPixels = winSize * winSize;
+    const unsigned long long factor = box_normalize_factor(winPixels);
+    const int dMax = (2 * winRadiusX + 1) * (2 * winRadiusY + 1);
+    const int planeW = tileW + 2 * winRadiusAgg;
+    const int planeH = tileH + 2 * winRadiusAgg;
+
+    CostType* plane = ws.plane;
+    unsigned* colSum = ws.colSum;
+
+    int d = 0;
+    for (int offx = -winRadiusX; offx <= winRadiusX; offx++) {
+        //the reference coordinates are separable in x and y
+        for (int i = 0; i < planeW; i++) {
+            int x1 = x0 - winRadiusAgg + i, x2 = 0;
+            ws.x1[i] = window_ref_coord(x1, x2, offx, mvx, width) ? x1 : -1;
+            ws.x2[i] = x2;
+        }
+
+        for (int offy = -winRadiusY; offy <= winRadiusY; offy++) {
+            for (int j = 0; j < planeH; j++) {
+                int y1 = y0 - winRadiusAgg + j, y2 = 0;
+                ws.y1[j] = window_ref_coord(y1, y2, offy, mvy, height) ? y1 : -1;
+                ws.y2[j] = y2;
+            }
+
+            //Hamming plane over the tile and its aggregation apron
+            for (int j = 0; j < planeH; j++) {
+                CostType* ptrPlane = plane + j*planeW;
+                if (ws.y1[j] < 0) {
+                    for (int i = 0; i < planeW; i++)
+                        ptrPlane[i] = defaultCost;
+                    continue;
+                }
+
+                const CensusWindow::CodeType* ptrCen1 = cen1 + width*ws.y1[j];
+                const CensusWindow::CodeType* ptrCen2 = cen2 + width*ws.y2[j];
+                for (int i = 0; i < planeW; i++)
+                    ptrPlane[i] = ws.x1[i] < 0 ? defaultCost : hamming_cost(ptrCen1[ws.x1[i]], ptrCen2[ws.x2[i]]);
+            }
+
+            //box filter: running column sums over the rows, sliding sum along each row
+            for (int i = 0; i < planeW; i++) {
+                colSum[i] = 0;
+                for (int j = 0; j < winSize; j++)
+                    colSum[i] += plane[j*planeW + i];
+            }
+
+            for (int ty = 0; ty < tileH; ty++) {
+                unsigned costSum = 0;
+                for (int i = 0; i < winSize; i++)
+                    costSum += colSum[i];
+
+                CostType* ptrC = C + (size_t)(y0 + ty - yC)*dMax*width + dMax*x0 + d;
+                for (int tx = 0; tx < tileW; tx++) {
+                    ptrC[tx*dMax] = box_normalize(costSum, winPixels, factor);
+                    if (tx + 1 < tileW)
+                        costSum += colSum[tx + winSize] - colSum[tx];
+                }
+
+                if (ty + 1 < tileH)
+                    for (int i = 0; i < planeW; i++)
+                        colSum[i] += plane[(ty + winSize)*planeW + i] - plane[ty*planeW + i];
+            }
+            d++;
+        }
+    }
+}
+
+//bytes of a cost tile workspace, see cost_tile_workspace_init()
+inline size_t cost_tile_workspace_size(int winRadiusAgg)
+{
+    const int planeSize = COST_TILE_SIZE + 2 * winRadiusAgg;
+    return 5 * planeSize * sizeof(int) + planeSize * planeSize * sizeof(CostType);
+}
+
+//cost tile workspace on caller provided memory of cost_tile_workspace_size() bytes
+inline void cost_tile_workspace_init(CostTileWorkspace& ws, void* buffer, int winRadiusAgg)
+{
+    const int planeSize = COST_TILE_SIZE + 2 * winRadiusAgg;
+    ws.colSum = (unsigned*)buffer;
+    ws.x1 = (int*)(ws.colSum + planeSize);
+    ws.x2 = ws.x1 + planeSize;
+    ws.y1 = ws.x2 + planeSize;
+    ws.y2 = ws.y1 + planeSize;
+    ws.plane = (CostType*)(ws.y2 + planeSize);
+}
+
+inline void cost_tile_workspace_alloc(CostTileWorkspace& ws, int winRadiusAgg)
+{
+    cost_tile_workspace_init(ws, mxMalloc(cost_tile_workspace_size(winRadiusAgg)), winRadiusAgg);
+}
+
+inline void cost_tile_workspace_free(CostTileWorkspace& ws)
+{
+    mxFree(ws.colSum);
+}
+
+//cost volume of the image rows yBegin .. yEnd-1, C holds these rows only
+inline void calc_cost_rows(CostType* C,
+    const CensusWindow::CodeType* cen1, const CensusWindow::CodeType* cen2, int width, int height,
+    const double* preMv, int mvWidth, int mvHeight, 
+    int winRadiusAgg, int winRadiusX, int winRadiusY, int yBegin, int yEnd, const CostTileWorkspace& ws)
+{
+    const double* pMvx = preMv;
+    const double* pMvy = preMv + mvWidth*mvHeight;
+
+    for (int y = yBegin; y < yEnd; y += COST_TILE_SIZE)
+        for (int x = 0; x < width; x += COST_TILE_SIZE)
+            calc_cost_tile(C, cen1, cen2, width, height, pMvx, pMvy, mvWidth, winRadiusAgg, winRadiusX, winRadiusY,
+                x, y, std::min(COST_TILE_SIZE, width - x), std::min(COST_TILE_SIZE, yEnd - y), ws, yBegin);
+}
+
+inline void calc_cost(unsigned char* C, 
+    const CensusWindow::CodeType* cen1, const CensusWindow::CodeType* cen2, int width, int height,
+    const double* preMv, int mvWidth, int mvHeight, 
+    int winRadiusAgg, int winRadiusX, int winRadiusY)
+{
+    CostTileWorkspace ws;
+    cost_tile_workspace_alloc(ws, winRadiusAgg);
+    calc_cost_rows(C, cen1, cen2, width, height, preMv, mvWidth, mvHeight,
+        winRadiusAgg, winRadiusX, winRadiusY, 0, height, ws);
+    cost_tile_workspace_free(ws);
+}
+
+/*
+ * buffers of one pyramid level (cost volume, path costs and sums, step and cost construction workspaces)
+ * in one block. Sized for the finest level, the coarser levels are smaller and reuse them.
+ */
+typedef struct _pydLevelBuffers
+{
+    int width;              //largest level the buffers are sized for
+    int height;
+    int threads;
+    SgmWorkerPool* pool;    //optional persistent sgm workers, at least threads - 1
+    CostType* C;
+    PathSum* Sp;
+    PathCost* L;
+    SgmStepWorkspace* ws;
+    CostTileWorkspace costWs;
+} PydLevelBuffers;
+
+const size_t PYD_BUFFER_ALIGNMENT = 64;  //every buffer of the block starts on a cache line
+
+inline size_t pyd_buffer_align(size_t n) {return (n + PYD_BUFFER_ALIGNMENT - 1) / PYD_BUFFER_ALIGNMENT * PYD_BUFFER_ALIGNMENT;}
+
+/*
+ * lays out the buffers on the block mem (PYD_BUFFER_ALIGNMENT aligned) and returns its size in bytes.
+ * mem = NULL only computes the size.
+ */
+inline size_t pyd_level_buffers_layout(PydLevelBuffers& b, char* mem, int width, int height, int winRadiusAgg,
+    int winRadiusX, int winRadiusY, int paths, int totalPass, int threads)
+{
+    const int searchWinX = 2*winRadiusX + 1;
+    const int searchWinY = 2*winRadiusY + 1;
+    const int dMax = searchWinX*searchWinY;
+    const SgmAggregateParams params = { width, height, dMax, totalPass, paths, threads, NULL };
+    const size_t stepSize = pyd_buffer_align(sgm_step_workspace_size(searchWinX, searchWinY));
+
+    size_t offset = 0;
+    b.C = (CostType*)(mem + offset);
+    offset += pyd_buffer_align(sizeof(CostType) * ((size_t)width * height * dMax + SGM_SIMD_WIDTH)); //sgm_step reads whole simd blocks
+    b.Sp = (PathSum*)(mem + offset);
+    offset += pyd_buffer_align(sizeof(PathSum) * (size_t)width * height * dMax);
+    b.L = (PathCost*)(mem + offset);
+    offset += pyd_buffer_align(sizeof(PathCost) * sgm_aggregate_buffer_size(params));
+    b.ws = (SgmStepWorkspace*)(mem + offset);
+    offset += pyd_buffer_align(sizeof(SgmStepWorkspace) * threads);
+    char* stepBuffers = mem + offset;
+    offset += stepSize * threads;
+    char* costBuffer = mem + offset;
+    offset += pyd_buffer_align(cost_tile_workspace_size(winRadiusAgg));
+
+    b.width = width;
+    b.height = height;
+    b.threads = threads;
+    b.pool = NULL;
+    if (mem != NULL) {
+        for (int t = 0; t < threads; t++)
+            sgm_step_workspace_init(b.ws[t], stepBuffers + stepSize*t, searchWinX, searchWinY);
+        cost_tile_workspace_init(b.costWs, costBuffer, winRadiusAgg);
+    }
+    return offset;
+}
+
+//bytes of the level buffers for width x height, see pyd_level_buffers_layout()
+inline size_t pyd_level_buffers_size(int width, int height, int winRadiusAgg, int winRadiusX, int winRadiusY,
+    int paths, int totalPass, int threads)
+{
+    PydLevelBuffers b;
+    return pyd_level_buffers_layout(b, NULL, width, height, winRadiusAgg, winRadiusX, winRadiusY, paths, totalPass, threads);
+}
+
+inline void pyd_level_buffers_alloc(PydLevelBuffers& b, int width, int height, int winRadiusAgg, int winRadiusX, int winRadiusY,
+    int paths, int totalPass, int threads)
+{
+    const size_t size = pyd_level_buffers_size(width, height, winRadiusAgg, winRadiusX, winRadiusY, paths, totalPass, threads);
+    pyd_level_buffers_layout(b, (char*)mxMalloc(size), width, height, winRadiusAgg, winRadiusX, winRadiusY,
+        paths, totalPass, threads);
+}
+
+inline void pyd_level_buffers_free(PydLevelBuffers& b)
+{
+    mxFree(b.C);    //start of the block
+}
+
+/*
+ * cost volume construction and sgm2d of one pyramid level on the level buffers, same outputs as calc_pyd_cost_sgm.
+ * width/height must not exceed the size the buffers are allocated for, the path cost buffer shrinks with the width.
+ */
+inline void pyd_sgm_level(unsigned* bestD, unsigned* minC, double* mvSub, PixelType* I1,
+        const CensusWindow::CodeType* cen1, const CensusWindow::CodeType* cen2, int width, int height,
+        double* mvPre, int mvWidth, int mvHeight, int winRadiusAgg, int winRadiusX, int winRadiusY,
+        int P1, int P2, int subpixelRefine, int paths, int totalPass, bool adpativeP2, PydLevelBuffers& b)
+{
+    mxAssert(width <= b.width && height <= b.height, "pyramid level is larger than the level buffers");
+    const int searchWinX = 2*winRadiusX + 1;
+    const int searchWinY = 2*winRadiusY + 1;
+
+    calc_cost_rows(b.C, cen1, cen2, width, height, mvPre, mvWidth, mvHeight,
+        winRadiusAgg, winRadiusX, winRadiusY, 0, height, b.costWs);
+    sgm2d_run(bestD, minC, mvSub, I1, b.C, width, height, searchWinX*searchWinY, mvPre, mvWidth, mvHeight,
+        searchWinX, searchWinY, P1, P2, subpixelRefine, paths, totalPass, adpativeP2, b.threads, b.L, b.ws, b.Sp, b.pool);
+}
+
+/*
+ * sgm2d in horizontal strips for images whose cost volume does not fit in memory, see sgm_tiles.h
+ * The tiles run in parallel on up to threads workers, each builds the cost volume and the path cost
+ * sums of one tile.
+ */
+inline void sgm2d_tiled(unsigned* bestD, unsigned* minC, double* mvSub, PixelType* I1,
+        const CensusWindow::CodeType* cen1, const CensusWindow::CodeType* cen2, int width, int height,
+        double* mvPre, int mvWidth, int mvHeight, int winRadiusAgg, int winRadiusX, int winRadiusY,
+        int P1, int P2, int subpixelRefine, int paths, int totalPass, bool adpativeP2,
+        int threads, const SgmTileParams& tileParams, unsigned* secondC = NULL)
+{
+    const int searchWinX = 2*winRadiusX + 1;
+    const int searchWinY = 2*winRadiusY + 1;
+    const int dMax = searchWinX*searchWinY;
+
+    std::vector<SgmTile> tiles = sgm_tiles(height, tileParams);
+    const int workers = sgm_tile_workers(height, (int)tiles.size(), threads, tileParams);
+    const int maxRows = sgm_tile_max_rows(height, tileParams);
+    SgmAggregateParams params = { width, maxRows, dMax, totalPass, paths, 1, NULL };
+
+    //per worker buffers, the MATLAB allocator must not be called by the workers
+    const size_t bufferSize = sgm_aggregate_buffer_size(params);
+    const size_t volumeSize = (size_t)width * maxRows * dMax;
+    PathCost* L = (PathCost*) mxMalloc (sizeof(PathCost) * bufferSize * workers);
+    PathSum* Sp = (PathSum*) mxMalloc (sizeof(PathSum) * volumeSize * workers);
+    CostType* C = (CostType*) mxMalloc (sizeof(CostType) * (volumeSize * workers + SGM_SIMD_WIDTH)); //sgm_step reads whole simd blocks
+    SgmStepWorkspace* ws = (SgmStepWorkspace*) mxMalloc (sizeof(SgmStepWorkspace) * workers);
+    CostTileWorkspace* costWs = (CostTileWorkspace*) mxMalloc (sizeof(CostTileWorkspace) * workers);
+    for (int w = 0; w < workers; w++) {
+        sgm_step_workspace_alloc(ws[w], searchWinX, searchWinY);
+        cost_tile_workspace_alloc(costWs[w], winRadiusAgg);
+    }
+
+    sgm_tile_run(tiles, workers, [&](const SgmTile& t, int worker) {
+        const int rows = t.ty1 - t.ty0;
+        SgmAggregateParams tileAggParams = params;
+        tileAggParams.height = rows;
+        CostType* tileC = C + volumeSize*worker;
+        PathSum* tileSp = Sp + volumeSize*worker;
+        PydPath path = { I1 + (size_t)t.ty0*width, width, mvPre + (size_t)t.ty0*mvWidth,
+            mvPre + (size_t)mvWidth*mvHeight + (size_t)t.ty0*mvWidth, mvWidth,
+            searchWinX, searchWinY, P1, P2, adpativeP2 };
+        PydCostRows costRows = { tileC, width*dMax };
+
+        calc_cost_rows(tileC, cen1, cen2, width, height, mvPre, mvWidth, mvHeight,
+            winRadiusAgg, winRadiusX, winRadiusY, t.ty0, t.ty1, costWs[worker]);
+        sgm_aggregate(tileSp, costRows, path, ws + worker, L + bufferSize*worker, tileAggParams);
+
+        const size_t out = (size_t)t.y0*width;
+        sgm2d_wta(bestD + out, minC + out, mvSub + out, mvSub + (size_t)width*height + out,
+            tileSp + (size_t)(t.y0 - t.ty0)*width*dMax, width, t.y1 - t.y0, dMax, searchWinX, searchWinY, subpixelRefine,
+            secondC ? secondC + out : NULL);
+    });
+
+    for (int w = 0; w < workers; w++) {
+        sgm_step_workspace_free(ws[w]);
+        cost_tile_workspace_free(costWs[w]);
+    }
+    mxFree(ws);
+    mxFree(costWs);
+    mxFree(L);
+    mxFree(Sp);
+    mxFree(C);
+}
+
+#endif
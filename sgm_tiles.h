@@ -0,0 +1,103 @@
+#ifndef _SGM_TILES_H_
+#define _SGM_TILES_H_
+#include <atomic>
+#include <vector>
+#include "sgm_aggregate.h"
+
+/*
+ * Horizontal strip tiling of the cost construction and SGM for images whose width x height x dMax volumes
+ * do not fit in memory. Each tile covers tileRows output rows plus up to overlap rows above and below,
+ * the costs and path sums of a tile only have (tileRows + 2*overlap) x width x dMax entries. The tiles are
+ * processed independently (in parallel), each writes its output rows only. Every concurrent tile holds its own
+ * volumes, so the peak is workers x (tileRows + 2*overlap) x width x dMax entries: the workers are capped by
+ * budgetRows / (tileRows + 2*overlap), at least one, and budgetRows defaults to the image height, which keeps
+ * a tiled run within the volume of an untiled one.
+ *
+ * Seam bound: the costs of a tile are computed from the whole image, and the horizontal paths span the
+ * full width, so they are identical to a full frame run. Only the paths with dy != 0 start at the tile
+ * border instead of the image border. Every SGM step normalizes by the previous minimum, which keeps
+ * C(d) <= L(d) <= C(d) + P2 for any start of the path, so a path started in the overlap differs from the
+ * full frame one by at most P2 at each pixel and index. The path sums of a tile therefore differ by at most
+ * P2 times the number of directions with dy != 0 (paths - 2 with both passes), and the winner only changes
+ * where the full frame margin between the best and the second best index is below twice that.
+ *
+ * How fast the paths converge depends on the margins. Measured on a 200x300 synthetic forward motion pair
+ * (smoothed texture, P1 6, P2 64, epipolar kernel with dMax 64, 4 paths), pixels whose winner differs from
+ * the full frame run, all of them near the seam rows:
+ *     overlap               32      64      96      128
+ *     tileRows 64           1.6%    0.6%    0.12%   0.03%
+ *     tileRows 16           3.1%    1.1%    0.24%   0.06%
+ * with up to 21 / 41 pixels per seam row and disparity errors of up to 40 at overlap 32 (8 paths: 1.1% / 0.06% at
+ * overlap 32 / 96, tileRows 64). The 2-D kernel (11x11 window) converges faster, 0.02% at overlap 32. On pure
+ * random images the margins are tiny and the seams never settle: 33% (epipolar) and 6.5% (2-D) at overlap 32,
+ * still 17% and 0.4% at 96. The default overlap is 96 rows, which costs (tileRows + 192) / tileRows times the
+ * work of an untiled run. Repetitive textures with small margins need a larger overlap.
+ */
+
+const int SGM_TILE_OVERLAP = 96;    //default warm-up rows, see above
+
+typedef struct _sgmTileParams
+{
+    int tileRows;               //output rows per tile, 0: no tiling
+    int overlap;                //warm-up rows above and below each tile
+    int budgetRows;             //volume rows of all concurrent tiles together, 0: the image height
+} SgmTileParams;
+
+typedef struct _sgmTile
+{
+    int y0;                     //output rows y0 .. y1-1
+    int y1;
+    int ty0;                    //processed rows ty0 .. ty1-1, including the overlap
+    int ty1;
+} SgmTile;
+
+inline std::vector<SgmTile> sgm_tiles(int height, const SgmTileParams& tp)
+{
+    std::vector<SgmTile> tiles;
+    const int rows = tp.tileRows > 0 ? tp.tileRows : height;
+    for (int y = 0; y < height; y += rows) {
+        SgmTile t;
+        t.y0 = y;
+        t.y1 = std::min(height, y + rows);
+        t.ty0 = std::max(0, t.y0 - tp.overlap);
+        t.ty1 = std::min(height, t.y1 + tp.overlap);
+        tiles.push_back(t);
+    }
+    return tiles;
+}
+
+//largest number of processed rows of a tile, buffers are sized for it
+inline int sgm_tile_max_rows(int height, const SgmTileParams& tp)
+{
+    return tp.tileRows > 0 ? std::min(height, tp.tileRows + 2*tp.overlap) : height;
+}
+
+//tiles processed at the same time: at most threads and tiles, and within the budgetRows volume rows
+inline int sgm_tile_workers(int height, int tiles, int threads, const SgmTileParams& tp)
+{
+    const int budget = tp.budgetRows > 0 ? tp.budgetRows : height;
+    return std::max(1, std::min(std::min(threads, tiles), budget / sgm_tile_max_rows(height, tp)));
+}
+
+//run fn(tile, worker) for all tiles, the tiles are taken in order by the workers
+template <class F>
+void sgm_tile_run(const std::vector<SgmTile>& tiles, int workers, const F& fn)
+{
+    std::atomic<int> nextTile(0);
+    sgm_parallel_run(workers, [&](int worker) {
+        for (int i = nextTile++; i < (int)tiles.size(); i = nextTile++)
+            fn(tiles[i], worker);
+    });
+}
+
+//rows ty0 .. of CostRows as rows 0 .. of a tile
+template <class CostRows>
+struct TileCostRows
+{
+    CostRows* rows;
+    int ty0;
+
+    const CostType* row(int y) { return rows->row(ty0 + y); }
+};
+
+#endif